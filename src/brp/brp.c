@@ -14,28 +14,155 @@
  * the first match, if any.
  */
 
-#define FUSE_USE_VERSION 29
-#include <fuse.h>
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 312
+#include <fuse3/fuse_lowlevel.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef BRP_BENCH
+#include <ftw.h>
+#include <spawn.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#endif
 
 #include <libbedrock.h>
 
-#define CONFIG "/bedrock/etc/brp.conf"
+/*
+ * Where brp's inputs are.  These are only ever changed to work against a
+ * tree other than /bedrock, to replay a trace or to benchmark; see replay()
+ * and bench().
+ */
+char config_dir[PATH_MAX] = "/bedrock/etc";
+char config_path[PATH_MAX] = "/bedrock/etc/brp.conf";
+char strata_root[PATH_MAX] = "/bedrock/strata/";
+char enabled_strata_dir[PATH_MAX] = "/bedrock/run/enabled_strata";
+
+/*
+ * Set when brp wrote the config itself, so it need not be root's; see bench().
+ */
+int config_trusted = 0;
+
+void set_bedrock_dir(const char *dir)
+{
+	snprintf(config_dir, sizeof(config_dir), "%s/etc", dir);
+	snprintf(config_path, sizeof(config_path), "%s/etc/brp.conf", dir);
+	snprintf(strata_root, sizeof(strata_root), "%s/strata/", dir);
+	snprintf(enabled_strata_dir, sizeof(enabled_strata_dir), "%s/run/enabled_strata", dir);
+}
+
+#define CONFIG_DIR config_dir
+#define CONFIG_NAME "brp.conf"
+#define CONFIG config_path
 #define CONFIG_LEN strlen(CONFIG)
-#define STRATA_ROOT "/bedrock/strata/"
+#define STRATA_ROOT strata_root
 #define STRATA_ROOT_LEN strlen(STRATA_ROOT)
+#define ENABLED_STRATA enabled_strata_dir
 
 #define MIN(x,y) (x < y ? x : y)
 
+/*
+ * openat2(2) is not wrapped by libc.  Syscall numbers are shared across
+ * architectures from this one on.
+ */
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+/*
+ * Lookup cache defaults.  See the "lookup cache" section below.
+ */
+#define CACHE_DEFAULT_TTL 1
+#define CACHE_DEFAULT_SIZE 4096
+#define CACHE_WAYS 4
+
+/*
+ * Default number of threads serving requests.
+ */
+#define DEFAULT_THREADS 8
+
+/*
+ * Default number of threads reading strata's directories concurrently.  See
+ * the "directory scan pool" section below.  With the strata on local disks
+ * and their directories in the kernel's cache, handing each one to a pool
+ * thread costs more than reading it, so by default they are read serially.
+ */
+#define DEFAULT_SCAN_THREADS 1
+
+/*
+ * Default bytes of filtered exec-filter output cached.  See the "exec-filter
+ * transform cache" section below.
+ */
+#define DEFAULT_FILTER_CACHE_SIZE (4 * 1024 * 1024)
+
+/*
+ * Default seconds the kernel may cache names, attributes and the fact that a
+ * name does not exist.  Cached entries are invalidated when the config is
+ * reparsed; see the "kernel cache invalidation" section below.
+ */
+#define DEFAULT_ENTRY_TIMEOUT 1.0
+#define DEFAULT_ATTR_TIMEOUT 1.0
+#define DEFAULT_NEGATIVE_TIMEOUT 1.0
+
+/*
+ * Maximum number of names tracked as having been reported to the kernel as
+ * not existing.  Beyond this, misses are not cached by the kernel.
+ */
+#define NEGATIVE_MAX 4096
+
+/*
+ * Maximum number of successive stratum changes applied on top of a parsed
+ * config before reparsing it instead.  See the "config reload" section below.
+ */
+#define RELOAD_MAX_DEPTH 16
+
+/*
+ * Milliseconds to let further changes accumulate after rebuilding BRP_INDEX
+ * before rebuilding it again, e.g. while a package manager installs many
+ * executables.
+ */
+#define INDEX_DELAY_MS 200
+
+/*
+ * Number of ops a trace keeps by default, the most recent overwriting the
+ * oldest.  Each takes sizeof(struct trace_record), 256 bytes.
+ */
+#define DEFAULT_TRACE_RECORDS 65536
+
+/*
+ * Supplementary groups beyond this many are dropped when acting as the
+ * calling user.  This can only deny access, never grant it.
+ */
+#define GROUPS_MAX 256
+
+/*
+ * FILTER_BRC_WRAP output is BRC_WRAP_PREFIX, the stratum, a space, the path
+ * within the stratum and BRC_WRAP_SUFFIX.
+ */
+#define BRC_WRAP_PREFIX "#!/bedrock/libexec/busybox sh\nexec /bedrock/bin/brc "
+#define BRC_WRAP_PREFIX_LEN (sizeof(BRC_WRAP_PREFIX) - 1)
+#define BRC_WRAP_SUFFIX " \"$@\"\n"
+#define BRC_WRAP_SUFFIX_LEN (sizeof(BRC_WRAP_SUFFIX) - 1)
+
 enum filter {
 	FILTER_PASS,     /* pass file through unaltered */
 	FILTER_BRC_WRAP, /* return a script that wraps executable with brc */
@@ -48,6 +175,16 @@ enum file_type {
 	FILE_TYPE_DIRECTORY,
 };
 
+/*
+ * How corresponding() matched a requested path.
+ */
+enum match {
+	MATCH_ROOT,      /* the root directory */
+	MATCH_CONTAINED, /* something within a configured directory */
+	MATCH_ITEM,      /* a configured item itself */
+	MATCH_VIRTUAL,   /* a virtual parent directory of configured items */
+};
+
 /*
  * Possible input source for a file.
  */
@@ -61,6 +198,8 @@ struct in_item {
 	/* stratum which provides file, e.g. 'gentoo" */
 	char *stratum;
 	size_t stratum_len;
+	/* O_PATH file descriptor for the stratum's root, -1 if unavailable */
+	int root_fd;
 };
 
 /*
@@ -77,6 +216,14 @@ struct out_item {
 	/* array of possible in_items for the output item */
 	struct in_item *in_items;
 	size_t in_item_count;
+	/*
+	 * in_items are those for values naming a stratum, then for each
+	 * stratum in priority order one for each of these values which do
+	 * not.
+	 */
+	size_t prefixed_count;
+	char **unprefixed_paths;
+	size_t unprefixed_count;
 };
 
 /*
@@ -85,1169 +232,9434 @@ struct out_item {
  * additional information to each function is via globals.
  */
 
-/* output file paths */
-struct out_item *out_items;
-size_t out_item_count = 0;
+/*
+ * Index over out_items by path component, built whenever the config is
+ * parsed.  See the "path trie" section below.
+ */
+struct trie_node {
+	/* path component, e.g. "bin"; empty for the root */
+	char *name;
+	size_t name_len;
+	/* child components, sorted by name */
+	struct trie_node *children;
+	size_t child_count;
+	/* indexes of out_items whose path is exactly this node, in config order */
+	size_t *items;
+	size_t item_count;
+	/* subset of the above which are FILE_TYPE_DIRECTORY */
+	size_t *dir_items;
+	size_t dir_item_count;
+	/* indexes of out_items strictly below this node, in config order */
+	size_t *below;
+	size_t below_count;
+};
 
-/* default stat information so we don't have to recalculate at runtime. */
-struct stat parent_stat;
-struct stat reparse_stat;
+/*
+ * Root directories of the strata referenced by in_items, opened when the
+ * config is parsed.  Paths within strata are resolved relative to these.
+ * A config derived by adding or removing a stratum shares the others' with
+ * the config it was derived from, hence the reference count.
+ */
+struct stratum_root {
+	char *name;
+	int fd;
+	unsigned long refs;
+};
 
 /*
- * ============================================================================
- * config management
- * ============================================================================
+ * Chunked bump allocator.  See the "arena" section below.
  */
+struct arena_chunk;
+struct arena {
+	struct arena_chunk *chunks;
+};
 
-void free_config()
-{
-	if (out_item_count <= 0) {
-		return;
-	}
+/*
+ * Names within a FILE_TYPE_DIRECTORY out_item.  See the "directory name
+ * index" section below.
+ */
+struct name_index;
 
-	int i, j;
-	for (i = 0; i < out_item_count; i++) {
-		for (j = 0; j < out_items[i].in_item_count; j++) {
-			free(out_items[i].in_items[j].full_path);
-			free(out_items[i].in_items[j].stratum_path);
-			free(out_items[i].in_items[j].stratum);
-		}
-		free(out_items[i].in_items);
-		free(out_items[i].path);
-	}
-	free(out_items);
-	out_item_count = 0;
-}
+/*
+ * Everything derived from the config.  A config is never modified once it
+ * has been parsed; reparsing builds a new one which replaces it.  See the
+ * "config snapshots" section below.
+ */
+/*
+ * Times of a virtual directory or the root, as stat_identity() gives them.
+ */
+struct dir_times {
+	char *path;
+	struct timespec mtime;
+	struct timespec ctime;
+};
 
-void parse_config()
-{
+struct config {
+	/* output file paths */
+	struct out_item *out_items;
+	size_t out_item_count;
+	/* index over out_items */
+	struct trie_node trie_root;
+	struct stratum_root **stratum_roots;
+	size_t stratum_root_count;
+	/* enabled strata, in priority order */
+	char **strata;
+	size_t stratum_count;
+	/* [stratum-order] section, whether or not enabled */
+	char **order;
+	size_t order_count;
+	/* unique to each parse */
+	unsigned long generation;
+	/* when this config was made, the oldest virtual directories can be */
+	struct timespec created;
+	/* out_items and everything they point to */
+	struct arena arena;
 	/*
-	 * Free memory associated with previous config parsing
+	 * users is the requests using this config, plus one while it is the
+	 * current config.  refs is users plus configs derived from this one,
+	 * which share its arena but not its stratum roots; those are released
+	 * once users drops to zero.
 	 */
-	free_config();
-
+	unsigned long users;
+	unsigned long refs;
 	/*
-	 * Ensure we're using a root-modifiable-only configuration file, just in case.
+	 * Config this one was derived from by adding or removing a stratum,
+	 * or NULL if parsed from CONFIG.  Anything not affected by the change
+	 * is shared with it, including the trie.  depth is the number of
+	 * such steps since the config was parsed.
 	 */
-	if (!check_config_secure(CONFIG)) {
-		fprintf(stderr, "brp: config file at "CONFIG" is not secure, refusing to continue.\n");
-		exit(1);
-	}
-
+	struct config *base;
+	unsigned int depth;
 	/*
-	 * Pre-parse config with awk to simplify C parsing code.
+	 * Per out_item name indexes, or NULL if there are none.  Unlike the
+	 * rest of the config these are updated in place as the strata
+	 * change.
 	 */
+	struct name_index *name_indexes;
+	/*
+	 * Times of the virtual directories stat()ed so far, which merge those
+	 * of every backing directory below them.  As with the name indexes,
+	 * these are updated as the strata change, and so only kept while the
+	 * config is watched.
+	 */
+	struct dir_times *dir_times;
+	size_t dir_times_count;
+	int dir_times_valid;
+};
 
-	FILE* fp = popen(
-			"/bedrock/libexec/busybox awk '\n"
-			"BEGIN {\n"
-			"	FS=\"[=, ]\\+\"\n"
-			"\n"
-			"	# get enabled strata\n"
-			"	cmd=\"/bedrock/bin/bri -l\"\n"
-			"	while (cmd | getline) {\n"
-			"		existing_strata[$0] = $0\n"
-			"	}\n"
-			"	close(cmd)\n"
-			"}\n"
-			"\n"
-			"/^\\s*#/ || /^\\s*;/ || /^\\s*$/ {\n"
-			"	# empty line or comment, skip\n"
-			"	next\n"
-			"}\n"
-			"\n"
-			"length($0) > max_line_len {\n"
-			"	max_line_len = length($0)\n"
-			"}\n"
-			"\n"
-			"/^\\s*\\[[^]]*\\]\\s*$/ {\n"
-			"	# section header\n"
-			"	section = substr($1, 2, length($1)-2)\n"
-			"	next\n"
-			"}\n"
-			"\n"
-			"section == \"stratum-order\" {\n"
-			"	if ($0 in existing_strata && !($0 in strata)) {\n"
-			"		strata_ordered[stratum_count++] = $0\n"
-			"		strata[$0] = $0\n"
-			"	}\n"
-			"	next\n"
-			"}\n"
-			"\n"
-			"section == \"pass\" || section == \"brc-wrap\" || section == \"exec-filter\" {\n"
-			"	item_count+=0; # ensure is a integer, not a string\n"
-			"	if (substr($1, length($1)) != \"/\") {\n"
-			"		items[item_count\".path\"] = $1\n"
-			"		items[item_count\".type\"] = \"normal\"\n"
-			"	} else {\n"
-			"		items[item_count\".path\"] = substr($1, 1, length($1)-1)\n"
-			"		items[item_count\".type\"] = \"directory\"\n"
-			"	}\n"
-			"\n"
-			"	items[item_count\".filter\"] = section\n"
-			"\n"
-			"	items[item_count\".in_count\"] = NF - 1\n"
-			"	\n"
-			"	for (i=2; i <= NF; i++) {\n"
-			"		if ( index($i, \":\") == 0) {\n"
-			"			items[item_count\".in.\"(i-2)\".stratum\"] = \"\"\n"
-			"			items[item_count\".in.\"(i-2)\".path\"] = $i\n"
-			"		} else {\n"
-			"			items[item_count\".in.\"(i-2)\".stratum\"] = substr($i, 0, index($i, \":\")-1)\n"
-			"			items[item_count\".in.\"(i-2)\".path\"] = substr($i, index($i, \":\")+1)\n"
-			"		}\n"
-			"	}\n"
-			"\n"
-			"	item_count++;\n"
-			"}\n"
-			"\n"
-			"END {\n"
-			"	for (stratum in existing_strata) {\n"
-			"		if (!(stratum in strata)) {\n"
-			"			strata_ordered[stratum_count++] = stratum\n"
-			"		}\n"
-			"	}\n"
-			"\n"
-			"	print max_line_len\n"
-			"	print item_count\n"
-			"\n"
-			"	for (item_i = 0; item_i < item_count; item_i++) {\n"
-			"		print items[item_i\".path\"]\n"
-			"		print items[item_i\".type\"]\n"
-			"		print items[item_i\".filter\"]\n"
-			"		in_count = 0\n"
-			"		for (in_i = 0; in_i < items[item_i\".in_count\"]; in_i++) {\n"
-			"			if (items[item_i\".in.\"in_i\".stratum\"] != \"\") {\n"
-			"				in_count++\n"
-			"			} else {\n"
-			"				in_count+=stratum_count\n"
-			"			}\n"
-			"		}\n"
-			"		print in_count\n"
-			"		for (in_i = 0; in_i < items[item_i\".in_count\"]; in_i++) {\n"
-			"			if (items[item_i\".in.\"in_i\".stratum\"] != \"\") {\n"
-			"				print items[item_i\".in.\"in_i\".stratum\"]\n"
-			"				print items[item_i\".in.\"in_i\".path\"]\n"
-			"			}\n"
-			"		}\n"
-			"		for (stratum_i = 0; stratum_i < stratum_count; stratum_i++) {\n"
-			"			for (in_i = 0; in_i < items[item_i\".in_count\"]; in_i++) {\n"
-			"				if (items[item_i\".in.\"in_i\".stratum\"] == \"\") {\n"
-			"					print strata_ordered[stratum_i]\n"
-			"					print items[item_i\".in.\"in_i\".path\"]\n"
-			"				}\n"
-			"			}\n"
-			"		}\n"
-			"	}\n"
-			"}\n"
-			"' " CONFIG, "r");
-
-	if (fp == NULL) {
-		fprintf(stderr, "brp: Failed to parse config\n");
-		exit(1);
-	}
-
-	/* malloc to hold one line */
-	int maxlinelen;
-	fscanf(fp, "%d\n", &maxlinelen);
-	char* line = malloc(maxlinelen * sizeof(char));
-
-	/* get items */
-	fgets(line, maxlinelen, fp);
-	sscanf(line, "%ld", &out_item_count);
+/* cleared if the kernel turns out not to support openat2(2) */
+int have_openat2 = 1;
 
-	out_items = malloc(out_item_count * sizeof(struct out_item));
-	int i, j;
-	for (i=0; i < out_item_count; i++) {
-		/* get path */
-		fgets(line, maxlinelen, fp);
-		line[strlen(line)-1] = '\0'; /* strip newline */
-		out_items[i].path = malloc((strlen(line)+1) * sizeof(char));
-		strcpy(out_items[i].path, line);
-		out_items[i].path_len = strlen(line);
-
-		/* get type */
-		fgets(line, maxlinelen, fp);
-		line[strlen(line)-1] = '\0'; /* strip newline */
-		if (strcmp(line, "normal") == 0) {
-			out_items[i].file_type = FILE_TYPE_NORMAL;
-		} else if (strcmp(line, "directory") == 0) {
-			out_items[i].file_type = FILE_TYPE_DIRECTORY;
-		} else {
-			fprintf(stderr, "brp: Failed to parse config\n");
-			exit(1);
-		}
-
-		/* get filter */
-		fgets(line, maxlinelen, fp);
-		line[strlen(line)-1] = '\0'; /* strip newline */
-		if (strcmp(line, "pass") == 0) {
-			out_items[i].filter = FILTER_PASS;
-		} else if (strcmp(line, "brc-wrap") == 0) {
-			out_items[i].filter = FILTER_BRC_WRAP;
-		} else if (strcmp(line, "exec-filter") == 0) {
-			out_items[i].filter = FILTER_EXEC;
-		} else {
-			fprintf(stderr, "brp: Failed to parse config\n");
-			exit(1);
-		}
+/* default stat information so we don't have to recalculate at runtime. */
+struct stat parent_stat;
+/*
+ * /reparse_config and /.brp_stats are generated when read and so have no
+ * size; they are opened with direct_io, so that the kernel reads them
+ * regardless.
+ */
+struct stat reparse_stat;
+struct stat stats_stat;
 
-		/* get input items */
-		fgets(line, maxlinelen, fp);
-		sscanf(line, "%ld", &out_items[i].in_item_count);
-		out_items[i].in_items = malloc(out_items[i].in_item_count * sizeof(struct in_item));
-		for (j=0; j < out_items[i].in_item_count; j++) {
-			/* get stratum */
-			fgets(line, maxlinelen, fp);
-			line[strlen(line)-1] = '\0'; /* strip newline */
-			out_items[i].in_items[j].stratum = malloc((strlen(line)+1) * sizeof(char));
-			strcpy(out_items[i].in_items[j].stratum, line);
-			out_items[i].in_items[j].stratum_len = strlen(line);
-			
-			/* get stratum path */
-			fgets(line, maxlinelen, fp);
-			line[strlen(line)-1] = '\0'; /* strip newline */
-			if (line[strlen(line)-1] == '/') {
-				line[strlen(line)-1] = '\0'; /* strip trailing slash */
-			}
-			out_items[i].in_items[j].stratum_path = malloc((strlen(line)+1) * sizeof(char));
-			strcpy(out_items[i].in_items[j].stratum_path, line);
-			out_items[i].in_items[j].stratum_path_len = strlen(line);
+/*
+ * brp-specific mount options, e.g. "-o cache_ttl=5".  Anything not listed
+ * here is passed through to FUSE.
+ */
+struct brp_options {
+	/* seconds a corresponding() result may be reused, 0 disables cache */
+	unsigned int cache_ttl;
+	/* maximum number of cached corresponding() results */
+	unsigned int cache_size;
+	/* number of threads serving requests */
+	unsigned int threads;
+	/* seconds the kernel may cache names, attributes and misses */
+	double entry_timeout;
+	double attr_timeout;
+	double negative_timeout;
+	/* maximum bytes of cached exec-filter output */
+	unsigned int filter_cache_size;
+	/* watch the config and strata for changes, 0 disables */
+	unsigned int watch;
+	/* threads reading strata's directories concurrently, <2 disables */
+	unsigned int scan_threads;
+	/* publish BRP_INDEX, 0 disables */
+	unsigned int index;
+	/* file to record ops to, NULL disables, and how many to keep */
+	char *trace;
+	unsigned int trace_records;
+	/* provide the user.bedrock.* xattrs, 0 disables */
+	unsigned int xattr;
+};
 
-			/* calculate full path */
-			out_items[i].in_items[j].full_path = malloc((
-						STRATA_ROOT_LEN +
-						out_items[i].in_items[j].stratum_len +
-						out_items[i].in_items[j].stratum_path_len + 1) * sizeof(char));
-			strcpy(out_items[i].in_items[j].full_path, STRATA_ROOT);
-			strcat(out_items[i].in_items[j].full_path, out_items[i].in_items[j].stratum);
-			strcat(out_items[i].in_items[j].full_path, out_items[i].in_items[j].stratum_path);
-		}
-	}
+struct brp_options options = {
+	.cache_ttl = CACHE_DEFAULT_TTL,
+	.cache_size = CACHE_DEFAULT_SIZE,
+	.threads = DEFAULT_THREADS,
+	.entry_timeout = DEFAULT_ENTRY_TIMEOUT,
+	.attr_timeout = DEFAULT_ATTR_TIMEOUT,
+	.negative_timeout = DEFAULT_NEGATIVE_TIMEOUT,
+	.filter_cache_size = DEFAULT_FILTER_CACHE_SIZE,
+	.watch = 1,
+	.scan_threads = DEFAULT_SCAN_THREADS,
+	.index = 1,
+	.trace = NULL,
+	.trace_records = DEFAULT_TRACE_RECORDS,
+	.xattr = 0,
+};
 
-	free(line);
-	pclose(fp);
-}
+#define BRP_OPT(t, p) { t, offsetof(struct brp_options, p), 1 }
+static const struct fuse_opt brp_opts[] = {
+	BRP_OPT("cache_ttl=%u", cache_ttl),
+	BRP_OPT("cache_size=%u", cache_size),
+	BRP_OPT("threads=%u", threads),
+	BRP_OPT("entry_timeout=%lf", entry_timeout),
+	BRP_OPT("attr_timeout=%lf", attr_timeout),
+	BRP_OPT("negative_timeout=%lf", negative_timeout),
+	BRP_OPT("filter_cache_size=%u", filter_cache_size),
+	BRP_OPT("watch=%u", watch),
+	BRP_OPT("scan_threads=%u", scan_threads),
+	BRP_OPT("index=%u", index),
+	BRP_OPT("trace=%s", trace),
+	BRP_OPT("trace_records=%u", trace_records),
+	BRP_OPT("xattr=%u", xattr),
+	FUSE_OPT_END
+};
 
 /*
- * Return a pointer to a string describing the current configuration.  Up to
- * the calling program to free() it.  This is used when /reparse_config is read
- * to show the current configuration.  It is useful for debugging.
+ * ============================================================================
+ * statistics
+ * ============================================================================
+ *
+ * Counters reported by reading /.brp_stats.  They are recorded on every
+ * request, so rather than one set of counters which every thread would
+ * contend for, each thread adds to one of STATS_SHARDS cache-line aligned
+ * shards with relaxed atomic increments.  Reading sums the shards, and may
+ * see some counters a few requests ahead of others.
  */
-char* config_contents()
-{
-	int i, j;
-
-	size_t len = 0;
-	for (i = 0; i < out_item_count; i++) {
-		len += strlen("path = ");
-		len += strlen(out_items[i].path);
-		len += strlen("\n");
 
-		len += strlen("type = ");
-		switch (out_items[i].file_type) {
-		case FILE_TYPE_NORMAL:
-			len += strlen("normal");
-			break;
-		case FILE_TYPE_DIRECTORY:
-			len += strlen("directory");
-			break;
-		}
-		len += strlen("\n");
+#define STATS_SHARDS 16
 
-		len += strlen("filter = ");
-		switch (out_items[i].filter) {
-		case FILTER_PASS:
-			len += strlen("pass");
-			break;
-		case FILTER_BRC_WRAP:
-			len += strlen("brc-wrap");
-			break;
-		case FILTER_EXEC:
-			len += strlen("exec");
-			break;
-		}
-		len += strlen("\n");
+/*
+ * Request latencies are counted in power-of-two buckets of nanoseconds:
+ * bucket n counts those from 2^n up to 2^(n+1) ns, the last anything
+ * longer.
+ */
+#define STATS_BUCKETS 36
+
+/* FUSE operations, in brp_oper order */
+enum op {
+	OP_LOOKUP,
+	OP_FORGET,
+	OP_GETATTR,
+	OP_SETATTR,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_READDIRPLUS,
+	OP_RELEASEDIR,
+	OP_OPEN,
+	OP_READ,
+	OP_RELEASE,
+	OP_WRITE,
+	OP_GETXATTR,
+	OP_LISTXATTR,
+	OP_COUNT,
+};
 
-		for (j = 0; j < out_items[i].in_item_count; j++) {
-			len += strlen("  stratum = ");
-			len += strlen(out_items[i].in_items[j].stratum);
-			len += strlen("\n");
-			len += strlen("  stratum_path = ");
-			len += strlen(out_items[i].in_items[j].stratum_path);
-			len += strlen("\n");
-			len += strlen("  full_path = ");
-			len += strlen(out_items[i].in_items[j].full_path);
-			len += strlen("\n");
-		}
-	}
-	len += strlen("\n");
+static const char *op_names[OP_COUNT] = {
+	"lookup",
+	"forget",
+	"getattr",
+	"setattr",
+	"opendir",
+	"readdir",
+	"readdirplus",
+	"releasedir",
+	"open",
+	"read",
+	"release",
+	"write",
+	"getxattr",
+	"listxattr",
+};
 
-	char *config_str = malloc((len+1) * sizeof(char));
-	if (!config_str) {
-		return NULL;
-	}
-	config_str[0] = '\0';
+enum stat_counter {
+	/* how corresponding() resolved paths, see enum match */
+	STAT_MATCH_ROOT,
+	STAT_MATCH_CONTAINED,
+	STAT_MATCH_ITEM,
+	STAT_MATCH_VIRTUAL,
+	STAT_MATCH_MISS,
+	/* resolving paths within strata, see brp_openat() */
+	STAT_OPENAT,
+	STAT_OPENAT2,
+	STAT_OPENAT_WALK,
+	/* caches */
+	STAT_LOOKUP_HIT,
+	STAT_LOOKUP_MISS,
+	STAT_LISTING_HIT,
+	STAT_LISTING_MISS,
+	STAT_FILTER_HIT,
+	STAT_FILTER_MISS,
+	STAT_NAME_INDEX_SKIP,
+	STAT_NEGATIVE_REPLY,
+	STAT_COUNT,
+};
 
-	for (i = 0; i < out_item_count; i++) {
-		strcat(config_str, "path = ");
-		strcat(config_str, out_items[i].path);
-		strcat(config_str, "\n");
+static const char *stat_names[STAT_COUNT] = {
+	"match_root",
+	"match_contained",
+	"match_item",
+	"match_virtual",
+	"match_miss",
+	"openat",
+	"openat2_syscalls",
+	"openat_walks",
+	"lookup_cache_hits",
+	"lookup_cache_misses",
+	"listing_cache_hits",
+	"listing_cache_misses",
+	"filter_cache_hits",
+	"filter_cache_misses",
+	"name_index_skips",
+	"negative_replies",
+};
 
-		strcat(config_str, "type = ");
-		switch (out_items[i].file_type) {
-		case FILE_TYPE_NORMAL:
-			strcat(config_str, "normal");
-			break;
-		case FILE_TYPE_DIRECTORY:
-			strcat(config_str, "directory");
-			break;
-		}
-		strcat(config_str, "\n");
+struct stats_shard {
+	uint64_t ops[OP_COUNT];
+	uint64_t latency[OP_COUNT][STATS_BUCKETS];
+	uint64_t counters[STAT_COUNT];
+} __attribute__((aligned(64)));
 
-		strcat(config_str, "filter = ");
-		switch (out_items[i].filter) {
-		case FILTER_PASS:
-			strcat(config_str, "pass");
-			break;
-		case FILTER_BRC_WRAP:
-			strcat(config_str, "brc-wrap");
-			break;
-		case FILTER_EXEC:
-			strcat(config_str, "exec");
-			break;
-		}
-		strcat(config_str, "\n");
+struct stats_shard stats[STATS_SHARDS];
+unsigned int stats_next_shard = 0;
+__thread struct stats_shard *stats_local = NULL;
 
-		for (j = 0; j < out_items[i].in_item_count; j++) {
-			strcat(config_str, "  stratum = ");
-			strcat(config_str, out_items[i].in_items[j].stratum);
-			strcat(config_str, "\n");
-			strcat(config_str, "  stratum_path = ");
-			strcat(config_str, out_items[i].in_items[j].stratum_path);
-			strcat(config_str, "\n");
-			strcat(config_str, "  full_path = ");
-			strcat(config_str, out_items[i].in_items[j].full_path);
-			strcat(config_str, "\n");
-		}
+struct stats_shard *stats_shard()
+{
+	if (!stats_local) {
+		stats_local = &stats[__atomic_fetch_add(&stats_next_shard, 1, __ATOMIC_RELAXED) % STATS_SHARDS];
 	}
-	len += strlen("\n");
-
-	return config_str;
+	return stats_local;
 }
 
-/*
- * ============================================================================
- * str_vec
- * ============================================================================
- *
- * Growable array of strings.
- */
-
-struct str_vec {
-	char** array;
-	size_t len;
-	size_t allocated;
-};
-
-int str_vec_new(struct str_vec *v)
+void stat_inc(enum stat_counter counter)
 {
-	const int DEFAULT_ALLOC_SIZE = 1024;
-	v->allocated = DEFAULT_ALLOC_SIZE;
-	v->len = 0;
-	v->array = malloc(v->allocated * sizeof(char*));
-	return !!v->array;
+	__atomic_fetch_add(&stats_shard()->counters[counter], 1, __ATOMIC_RELAXED);
 }
 
-void str_vec_free(struct str_vec *v)
+/*
+ * Counts an op which started at start, on CLOCK_MONOTONIC.  Returns how long
+ * it took, in nanoseconds.
+ */
+uint64_t stats_op(enum op op, const struct timespec *start)
 {
-	size_t i;
-	for (i = 0; i < v->len; i++) {
-		free(v->array[i]);
+	struct stats_shard *shard = stats_shard();
+	struct timespec end;
+	uint64_t ns;
+	int bucket = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
+	if (ns > 1) {
+		bucket = MIN(63 - __builtin_clzll(ns), STATS_BUCKETS - 1);
 	}
-	free(v->array);
-	v->array = NULL;
-	v->len = 0;
-	v->allocated = 0;
-	/*
-	 * Purposefully cannot append anymore (0 * 2 = 0).  have to call
-	 * str_vec_new() again to continue to use.
-	 */
+
+	__atomic_fetch_add(&shard->ops[op], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->latency[op][bucket], 1, __ATOMIC_RELAXED);
+	return ns;
 }
 
-int str_vec_append(struct str_vec *v, char *str)
+void stat_match(int match)
 {
-	/* cannot append on free()'d str_vec */
-	if (v->allocated == 0) {
-		return 0;
-	}
-
-	size_t str_len = strlen(str);
-	v->array[v->len] = malloc((str_len+1) * sizeof(char));
-	if (!v->array[v->len]) {
-		return 0;
-	}
-	strcpy(v->array[v->len], str);
-
-	v->len++;
-	if (v->len > v->allocated) {
-		v->allocated *= 2; /* TODO: research scaling 1.5 vs 2 */
-		v->array = realloc(v->array, v->allocated * sizeof(char*));
-		if (!v->array) {
-			return 0;
-		}
+	switch (match) {
+	case MATCH_ROOT:
+		stat_inc(STAT_MATCH_ROOT);
+		break;
+	case MATCH_CONTAINED:
+		stat_inc(STAT_MATCH_CONTAINED);
+		break;
+	case MATCH_ITEM:
+		stat_inc(STAT_MATCH_ITEM);
+		break;
+	case MATCH_VIRTUAL:
+		stat_inc(STAT_MATCH_VIRTUAL);
+		break;
+	default:
+		stat_inc(STAT_MATCH_MISS);
+		break;
 	}
-	return 1;
 }
 
-int str_vec_concat(struct str_vec *v1, struct str_vec *v2)
+uint64_t stat_sum(enum stat_counter counter)
 {
+	uint64_t sum = 0;
 	size_t i;
-	for (i = 0; i < v2->len; i++) {
-		if (str_vec_append(v1, v2->array[i]) < 0) {
-			return 0;
-		}
+	for (i = 0; i < STATS_SHARDS; i++) {
+		sum += __atomic_load_n(&stats[i].counters[counter], __ATOMIC_RELAXED);
 	}
-	return 1;
+	return sum;
 }
 
-int qsort_strcmp_wrap(const void *a, const void *b)
+/*
+ * Appends printf()-style output to *str, growing it as needed.  *str is
+ * freed and set to NULL on allocation failure.
+ */
+void stats_printf(char **str, size_t *len, size_t *allocated, const char *fmt, ...)
 {
-	return strcmp(*((char**) a), *((char**) b));
-}
+	va_list ap;
+	int n;
 
-void str_vec_sort(struct str_vec *v) {
-	if (v->len < 2) {
+	if (!*str) {
 		return;
 	}
-	qsort(v->array, v->len, sizeof(v->array[0]), qsort_strcmp_wrap);
-	return;
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(*str + *len, *allocated - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			return;
+		}
+		if (*len + n < *allocated) {
+			*len += n;
+			return;
+		}
+		char *new_str = realloc(*str, *allocated * 2);
+		if (!new_str) {
+			free(*str);
+			*str = NULL;
+			return;
+		}
+		*str = new_str;
+		*allocated *= 2;
+	}
 }
 
 /*
- * TODO: Just empties repeated items, does not remove.  Expects calling code to
- * check for empty strings.  That's ugly, see if we can cleanly fix.
+ * Renders the contents of /.brp_stats.  Returns them, to be freed by the
+ * caller, or NULL on allocation failure.
  */
-int str_vec_uniq(struct str_vec *v)
+char *stats_contents(size_t *len)
 {
-	if (v->len < 2) {
-		return 0;
+	static const char *units[] = { "ns", "us", "ms", "s" };
+	uint64_t ops[OP_COUNT];
+	uint64_t latency[OP_COUNT][STATS_BUCKETS];
+	size_t allocated = 4096;
+	char *str = malloc(allocated);
+	size_t i, op, bucket;
+
+	memset(ops, 0, sizeof(ops));
+	memset(latency, 0, sizeof(latency));
+	for (i = 0; i < STATS_SHARDS; i++) {
+		for (op = 0; op < OP_COUNT; op++) {
+			ops[op] += __atomic_load_n(&stats[i].ops[op], __ATOMIC_RELAXED);
+			for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+				latency[op][bucket] += __atomic_load_n(&stats[i].latency[op][bucket], __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	*len = 0;
+	if (str) {
+		str[0] = '\0';
 	}
 
-	str_vec_sort(v);
+	stats_printf(&str, len, &allocated, "[ops]\n");
+	for (op = 0; op < OP_COUNT; op++) {
+		stats_printf(&str, len, &allocated, "%s = %llu\n", op_names[op], (unsigned long long) ops[op]);
+	}
 
-	ssize_t i;
-	for (i = 1; i < v->len; i++) {
-		if (strcmp(v->array[i], v->array[i-1]) == 0) {
-			v->array[i-1][0] = '\0';
+	/*
+	 * Each bucket is labelled with its lower bound, e.g. "4us:10" is ten
+	 * requests which took from 4.096us up to 8.192us.
+	 */
+	stats_printf(&str, len, &allocated, "\n[latency]\n");
+	for (op = 0; op < OP_COUNT; op++) {
+		if (ops[op] == 0) {
+			continue;
+		}
+		stats_printf(&str, len, &allocated, "%s =", op_names[op]);
+		for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+			if (latency[op][bucket] > 0) {
+				stats_printf(&str, len, &allocated, " %llu%s:%llu",
+						(1ULL << bucket) >> (bucket / 10 * 10),
+						units[bucket / 10],
+						(unsigned long long) latency[op][bucket]);
+			}
 		}
+		stats_printf(&str, len, &allocated, "\n");
 	}
 
-	return 0;
+	stats_printf(&str, len, &allocated, "\n[counters]\n");
+	for (i = 0; i < STAT_COUNT; i++) {
+		stats_printf(&str, len, &allocated, "%s = %llu\n", stat_names[i], (unsigned long long) stat_sum(i));
+	}
+
+	return str;
 }
 
 /*
  * ============================================================================
- * miscellaneous/support
+ * lookup cache
  * ============================================================================
+ *
+ * A single `ls` or exec through brp results in a getattr, open and read for
+ * the same path, each of which would otherwise call corresponding() and pay
+ * for resolving every candidate in_item.  This memoizes
+ * corresponding()'s results, both hits and misses, for cache_ttl seconds.
+ *
+ * The cache is a fixed-size, CACHE_WAYS-way set-associative table so its
+ * memory usage is bounded by cache_size entries.  Within a set the least
+ * recently used entry is replaced.  Results depend on the calling user's
+ * permissions, and so the uid, gid and supplementary groups are part of the
+ * key.
+ *
+ * Entries point into a config's out_items, and so are only valid for the
+ * config they were populated from.  The config's generation is part of the
+ * key, and the cache is cleared whenever a new config replaces it.
  */
 
+struct cache_entry {
+	/* key: requested path, NULL if the slot is unused */
+	char *path;
+	uid_t uid;
+	gid_t gid;
+	/* caller_groups */
+	unsigned long groups;
+	unsigned long generation;
+	unsigned long hash;
+	/* when the entry was populated and last used */
+	time_t created;
+	unsigned long last_used;
+	/* corresponding() return value; <0 indicates a cached miss */
+	int ret;
+	/* corresponding() outputs, only meaningful if ret >= 0 */
+	struct stat stbuf;
+	struct out_item *out_item;
+	struct in_item *in_item;
+	size_t tail_offset;
+};
+
+/* protects everything below */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct cache_entry *cache;
+size_t cache_set_count = 0;
+unsigned long cache_clock = 0;
+
 /*
- * Like strncat, except:
- * - Do not use trailing null; track offset into buffer instead
- * - Able to skip set number of input bytes before writing into buffer
+ * Hash of the supplementary groups set_caller_fscreds() last gave the calling
+ * thread, which is implicitly part of the lookup and listing caches' keys.
+ * 0 for none, e.g. on brp's own threads.
  */
-void strcatoffset(char *buf, const char const *str, size_t *left_to_skip, size_t *written, size_t max)
-{
-	size_t str_len = strlen(str);
-	int i = 0;
+__thread unsigned long caller_groups = 0;
 
-	if ((*left_to_skip) >= str_len) {
-		(*left_to_skip) -= str_len;
-		return;
+/*
+ * djb2, see http://www.cse.yorku.ca/~oz/hash.html
+ */
+unsigned long hash_str(const char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+	while ((c = *str++)) {
+		hash = ((hash << 5) + hash) + c;
 	}
+	/*
+	 * Names which differ only in their last few characters, e.g. "bin1"
+	 * through "bin999", leave the low bits the hash tables index by in a
+	 * narrow range; mix the high bits down.
+	 */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bUL;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35UL;
+	hash ^= hash >> 16;
+	return hash;
+}
 
-	if ((*left_to_skip) > 0) {
-		i += (*left_to_skip);
-		(*left_to_skip) = 0;
+void cache_clear()
+{
+	size_t i;
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_set_count * CACHE_WAYS; i++) {
+		free(cache[i].path);
+		cache[i].path = NULL;
 	}
+	pthread_mutex_unlock(&cache_lock);
+}
 
-	for (; i < str_len && (*written) < max; i++, (*written)++) {
-		buf[(*written)] = str[i];
+void cache_init()
+{
+	cache_set_count = options.cache_size / CACHE_WAYS;
+	if (options.cache_ttl == 0 || cache_set_count == 0) {
+		cache_set_count = 0;
+		return;
+	}
+	cache = calloc(cache_set_count * CACHE_WAYS, sizeof(struct cache_entry));
+	if (!cache) {
+		fprintf(stderr, "brp: unable to allocate lookup cache, disabling\n");
+		cache_set_count = 0;
 	}
 }
 
 /*
- * Writing to this filesystem is only used as a way to signal that the
- * configuration and should be reparsed.  Thus, it does not matter which
- * writing function is called - they should all act the same.  They all call
- * this.
+ * Copies the cached entry for the given key into found and returns 1, or
+ * returns 0 if there is no valid entry.  found->path is not valid after
+ * this returns.
  */
-int write_attempt(const char* path)
+int cache_get(const char *path, unsigned long hash, uid_t uid, gid_t gid, unsigned long generation, struct cache_entry *found)
 {
-	/*
-	 * The *only* thing writable is the /reparse_config, and only by root.
-	 * When it is written to, it will cause brp to reparse its configuration.
-	 */
-	if (strcmp(path, "/reparse_config") == 0) {
-		struct fuse_context *context = fuse_get_context();
-		if (context->uid != 0) {
-			/* Non-root users cannot do anything with this file. */
-			return -EACCES;
-		} else {
-			parse_config();
-			return 0;
+	if (cache_set_count == 0) {
+		return 0;
+	}
+
+	int ret = 0;
+	struct cache_entry *set = &cache[(hash % cache_set_count) * CACHE_WAYS];
+	time_t now = time(NULL);
+	int i;
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (set[i].path && set[i].hash == hash && set[i].uid == uid &&
+				set[i].gid == gid && set[i].groups == caller_groups &&
+				set[i].generation == generation &&
+				strcmp(set[i].path, path) == 0) {
+			if (now - set[i].created >= options.cache_ttl) {
+				/* expired */
+				free(set[i].path);
+				set[i].path = NULL;
+				break;
+			}
+			set[i].last_used = ++cache_clock;
+			memcpy(found, &set[i], sizeof(struct cache_entry));
+			ret = 1;
+			break;
 		}
-	} else {
-		return -EACCES;
 	}
+	pthread_mutex_unlock(&cache_lock);
+	stat_inc(ret ? STAT_LOOKUP_HIT : STAT_LOOKUP_MISS);
+
+	return ret;
 }
 
 /*
- * Determines the real path to a file in a strata, treating absolute symlinks
- * as symlinks relative to the strata's root.  Returns >=0 on success, <0 on
- * failure.  If there is no resulting file/directory it is considered an error
- * (unlike, for example, readlink(2)).
- *
- * All incoming paths must be in STRATA_ROOT/<stratum>/.
- *
- * This is used over something like realpath() due to the need to have absolute
- * symlinks start at the symlink's stratum's root.  e.g. if a symlink at
- * "/bedrock/strata/foo/bar" symlinks to "/qux" that should be treated as
- * "/bedrock/strata/foo/qux".
+ * Drop any cached results for path, for all users, e.g. because what it
+ * resolved to is known to have gone away.
  */
-int brp_realpath(char *in_path, char *out_path, size_t bufsize)
+void cache_invalidate(const char *path, unsigned long hash)
 {
-	if (strlen(in_path) >= bufsize) {
-		return -ENAMETOOLONG;
+	if (cache_set_count == 0) {
+		return;
 	}
 
-	char *slash;
-	const int LOOP_MAX = 20;
-	int end = 0;
-	int loop = 0;
-	size_t offset;
-	ssize_t readlink_len;
-	struct stat stbuf;
-
-	char current_path[bufsize];
-	char link_path[bufsize];
-	char path_fragment[bufsize];
-	char stratum_prefix[bufsize];
+	struct cache_entry *set = &cache[(hash % cache_set_count) * CACHE_WAYS];
+	int i;
 
-	/*
-	 * Ensure incoming path is in stratum_prefix/<stratum>/, get stratum
-	 * prefix.
-	 */
-	if (strncmp(in_path, STRATA_ROOT, STRATA_ROOT_LEN) != 0) {
-		return -EINVAL;
-	}
-	slash = in_path + STRATA_ROOT_LEN + 1;
-	while (*slash != '/') {
-		slash++;
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (set[i].path && set[i].hash == hash && strcmp(set[i].path, path) == 0) {
+			free(set[i].path);
+			set[i].path = NULL;
+		}
 	}
-	strncpy(stratum_prefix, in_path, slash - in_path + 1);
-	stratum_prefix[slash - in_path + 1] = '\0';
-	size_t stratum_prefix_len = strlen(stratum_prefix);
-	offset = stratum_prefix_len+1;
-
-	strcpy(current_path, in_path);
+	pthread_mutex_unlock(&cache_lock);
+}
 
-	/*
-	 * Loop over every directory in a given file path, e.g. in
-	 * "/foo/bar/baz/" loop over "/foo" then "/foo/bar" then
-	 * "/foo/bar/baz", starting with the stratum_prefix.  If any directory
-	 * is found to be a symlink, resolve symlink then start over.
-	 */
-	while (1) {
-		/* find next file/directory in file path */
-		while (current_path[offset] != '/' && current_path[offset] != '\0') {
-			offset++;
-		}
-		/* on final item in file path, the file itself */
-		if (current_path[offset] == '\0') {
-			end = 1;
-		}
-		/* starting / */
-		if (offset == 0 && current_path[offset] == '/') {
-			offset++;
+/*
+ * Carry entries over from the config with generation from to the config with
+ * generation to, which is derived from it.  keep() decides whether each entry
+ * still holds for the new config, updating its out_item and in_item to point
+ * into it if so.  Everything else is dropped.
+ */
+void cache_migrate(unsigned long from, unsigned long to, int (*keep)(struct cache_entry *entry, void *arg), void *arg)
+{
+	size_t i;
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_set_count * CACHE_WAYS; i++) {
+		if (!cache[i].path) {
 			continue;
 		}
-		/* would overflow */
-		if (offset >= bufsize) {
-			return -ENAMETOOLONG;
+		if (cache[i].generation == from && keep(&cache[i], arg)) {
+			cache[i].generation = to;
+		} else {
+			free(cache[i].path);
+			cache[i].path = NULL;
 		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
 
-		strncpy(path_fragment, current_path, offset);
-		path_fragment[offset] = '\0';
+/*
+ * Store a corresponding() result.  Failing to allocate is not an error; the
+ * result simply is not cached.
+ */
+void cache_put(const char *path,
+		unsigned long hash,
+		uid_t uid,
+		gid_t gid,
+		unsigned long generation,
+		int ret,
+		const struct stat *stbuf,
+		struct out_item *out_item,
+		struct in_item *in_item,
+		size_t tail_offset)
+{
+	if (cache_set_count == 0) {
+		return;
+	}
 
-		if (lstat(path_fragment, &stbuf) != 0) {
-			return -ENOENT;
-		}
-		if (!S_ISLNK(stbuf.st_mode) && !end) {
-			offset++;
-			continue;
-		}
-		if (!S_ISLNK(stbuf.st_mode) && end) {
-			strcpy(out_path, current_path);
-			return 1;
+	char *path_copy = strdup(path);
+	if (!path_copy) {
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+
+	/* pick unused or least recently used slot in set */
+	struct cache_entry *set = &cache[(hash % cache_set_count) * CACHE_WAYS];
+	struct cache_entry *entry = &set[0];
+	int i;
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (!set[i].path) {
+			entry = &set[i];
+			break;
 		}
-		if (S_ISLNK(stbuf.st_mode)) {
-			if ((readlink_len = readlink(path_fragment, link_path, bufsize)) < 0) {
-				return -errno;
-			}
-			link_path[readlink_len] = '\0';
-			if (link_path[0] == '/') {
-				/* absolute symlink */
-				strcpy(out_path, stratum_prefix);
-				strcat(out_path, link_path+1);
-				strcat(out_path, current_path + offset);
-			} else {
-				/* relative symlink */
-				if ( (slash = strrchr(path_fragment, '/')) ) {
-					strncpy(out_path, path_fragment, slash - path_fragment + 1);
-					out_path[slash - path_fragment + 1] = '\0';
-				} else {
-					strcpy(out_path, "./");
-				}
-				strcat(out_path, link_path);
-				strcat(out_path, current_path + offset);
-			}
-			offset = stratum_prefix_len+1;
-			end = 0;
-			strcpy(current_path, out_path);
-			if ((loop++) >= LOOP_MAX) {
-				return -ELOOP;
-			}
+		if (set[i].last_used < entry->last_used) {
+			entry = &set[i];
 		}
 	}
+	free(entry->path);
+	entry->path = path_copy;
+	entry->hash = hash;
+	entry->uid = uid;
+	entry->gid = gid;
+	entry->groups = caller_groups;
+	entry->generation = generation;
+	entry->created = time(NULL);
+	entry->last_used = ++cache_clock;
+	entry->ret = ret;
+	if (ret >= 0) {
+		memcpy(&entry->stbuf, stbuf, sizeof(struct stat));
+		entry->out_item = out_item;
+		entry->in_item = in_item;
+		entry->tail_offset = tail_offset;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
 }
 
 /*
- * Like stat(2), except resolves symlinks with brp-specific resolve_symlink()
- * logic.
+ * ============================================================================
+ * path trie
+ * ============================================================================
+ *
+ * Every lookup needs to know which out_items (1) are directories containing
+ * the requested path, (2) are the requested path itself, and (3) are below
+ * the requested path, making it a virtual parent directory.  Rather than
+ * scanning every out_item for each of these, out_items are indexed by path
+ * component so that all three can be answered in one walk down the path.
+ *
+ * Each node retains out_item indexes in config order so that the first
+ * configured item still wins.
  */
-int brp_stat(char *path, struct stat *stbuf)
+
+int size_t_append(size_t **array, size_t *count, size_t value)
 {
-	char out_path[PATH_MAX+1];
-	int ret;
-	if ((ret = brp_realpath(path, out_path, PATH_MAX+1)) < 0) {
-		/* could not resolve symlink */
-		return ret;
-	} else if (!stbuf) {
-		/* no stbuf provided to populate */
+	size_t *new_array = realloc(*array, (*count + 1) * sizeof(size_t));
+	if (!new_array) {
 		return 0;
-	} else {
-		return lstat(out_path, stbuf);
 	}
+	*array = new_array;
+	(*array)[(*count)++] = value;
+	return 1;
+}
+
+int trie_name_cmp(const char *name, size_t name_len, struct trie_node *node)
+{
+	int ret = strncmp(name, node->name, MIN(name_len, node->name_len));
+	if (ret != 0) {
+		return ret;
+	}
+	return (name_len > node->name_len) - (name_len < node->name_len);
 }
 
 /*
- * Given an input path, finds the corresponding content to output (if any) and
- * populates various related fields (e.g. stat info) accordingly.
+ * Binary search node's children for the given component.  If not found,
+ * returns NULL and sets *insert_at to where it would be inserted.
  */
-int corresponding(char *in_path,
-		char* out_path,
-		size_t out_path_size,
-		struct stat *stbuf,
-		struct out_item **arg_out_item,
-		struct in_item **arg_in_item,
-		char **tail)
+struct trie_node *trie_child(struct trie_node *node, const char *name, size_t name_len, size_t *insert_at)
 {
-	/* handle root specially */
-	if (in_path[0] == '/' && in_path[1] == '\0') {
-		memcpy(stbuf, &parent_stat, sizeof(parent_stat));
-		return 0;
+	size_t low = 0;
+	size_t high = node->child_count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		int cmp = trie_name_cmp(name, name_len, &node->children[mid]);
+		if (cmp == 0) {
+			return &node->children[mid];
+		} else if (cmp < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	if (insert_at) {
+		*insert_at = low;
 	}
+	return NULL;
+}
 
-	size_t i, j;
-	size_t in_path_len = strlen(in_path);
-	char tmp_path[out_path_size+1];
+/*
+ * Returns the next path component at or after *path, advancing *path past
+ * it.  Empty components (e.g. from "//") are skipped.  Returns NULL if there
+ * are no more components.
+ */
+const char *next_component(const char **path, size_t *len)
+{
+	const char *start = *path;
+	while (*start == '/') {
+		start++;
+	}
+	if (*start == '\0') {
+		return NULL;
+	}
+	const char *end = start;
+	while (*end != '/' && *end != '\0') {
+		end++;
+	}
+	*len = end - start;
+	*path = end;
+	return start;
+}
 
-	/* check for a match on something contained in one of the configured
-	 * directories */
-	for (i = 0; i < out_item_count; i++) {
-		if (strncmp(in_path, out_items[i].path, out_items[i].path_len) == 0 &&
-				in_path[out_items[i].path_len] == '/' &&
-				out_items[i].file_type == FILE_TYPE_DIRECTORY) {
-			for (j = 0; j < out_items[i].in_item_count; j++) {
-				strncpy(tmp_path, out_items[i].in_items[j].full_path, out_path_size);
-				strncat(tmp_path, in_path + out_items[i].path_len, out_path_size - out_items[i].in_items[j].full_path_len);
-				if (strlen(tmp_path) == out_path_size) {
-					/* would have buffer overflowed, treat as bad value */
-					continue;
-				}
-				if (brp_realpath(tmp_path, out_path, out_path_size) >= 0 && lstat(out_path, stbuf) >= 0) {
-					*arg_out_item = &out_items[i];
-					*arg_in_item = &out_items[i].in_items[j];
-					*tail = in_path + out_items[i].path_len;
-					return 0;
-				}
+int trie_insert(struct config *conf, size_t item_index)
+{
+	struct trie_node *node = &conf->trie_root;
+	const char *path = conf->out_items[item_index].path;
+	const char *name;
+	size_t name_len;
+	size_t insert_at;
+
+	while ( (name = next_component(&path, &name_len)) ) {
+		if (!size_t_append(&node->below, &node->below_count, item_index)) {
+			return 0;
+		}
+		struct trie_node *child = trie_child(node, name, name_len, &insert_at);
+		if (!child) {
+			struct trie_node *children = realloc(node->children, (node->child_count + 1) * sizeof(struct trie_node));
+			if (!children) {
+				return 0;
 			}
+			node->children = children;
+			memmove(&node->children[insert_at+1], &node->children[insert_at],
+					(node->child_count - insert_at) * sizeof(struct trie_node));
+			node->child_count++;
+			child = &node->children[insert_at];
+			memset(child, 0, sizeof(struct trie_node));
+			child->name = strndup(name, name_len);
+			if (!child->name) {
+				return 0;
+			}
+			child->name_len = name_len;
 		}
+		node = child;
 	}
 
-	/*
-	 * Check for a match directly on one of the configured items.
-	 */
-	for (i = 0; i < out_item_count; i++) {
-		if (strncmp(out_items[i].path, in_path, in_path_len) == 0 &&
-				(out_items[i].path[in_path_len] == '\0')) {
-			for (j = 0; j < out_items[i].in_item_count; j++) {
-				if (brp_realpath(out_items[i].in_items[j].full_path, out_path, out_path_size) >=0) {
-					if (out_items[i].file_type == FILE_TYPE_DIRECTORY) {
-						memcpy(stbuf, &parent_stat, sizeof(parent_stat));
-					} else {
-						lstat(out_path, stbuf);
-					}
-					*arg_out_item = &out_items[i];
-					*arg_in_item = &out_items[i].in_items[j];
-					*tail = "";
-					return 0;
-				}
-			}
-		}
+	if (!size_t_append(&node->items, &node->item_count, item_index)) {
+		return 0;
+	}
+	if (conf->out_items[item_index].file_type == FILE_TYPE_DIRECTORY &&
+			!size_t_append(&node->dir_items, &node->dir_item_count, item_index)) {
+		return 0;
 	}
+	return 1;
+}
 
-	/*
-	 * Check for a match on a virtual parent directory of a configured
-	 * item.
-	 */
-	for (i = 0; i < out_item_count; i++) {
-		if (strncmp(out_items[i].path, in_path, in_path_len) == 0 &&
-				(out_items[i].path[in_path_len] == '/')) {
-			for (j = 0; j < out_items[i].in_item_count; j++) {
-				if (brp_realpath(out_items[i].in_items[j].full_path, out_path, out_path_size) >=0 &&
-						lstat(out_path, stbuf) >= 0) {
-					memcpy(stbuf, &parent_stat, sizeof(parent_stat));
-					*arg_out_item = &out_items[i];
-					*arg_in_item = &out_items[i].in_items[j];
-					*tail = "";
-					return 0;
-				}
-			}
-		}
+void trie_free(struct trie_node *node)
+{
+	size_t i;
+	for (i = 0; i < node->child_count; i++) {
+		free(node->children[i].name);
+		trie_free(&node->children[i]);
 	}
+	free(node->children);
+	free(node->items);
+	free(node->dir_items);
+	free(node->below);
+	memset(node, 0, sizeof(struct trie_node));
+}
 
-	return -ENOENT;
+/*
+ * Walks the trie along in_path.
+ *
+ * Any nodes along the way which have configured directories and still have
+ * more of in_path below them - that is, nodes for directories which contain
+ * in_path - are stored in containing, which must have room for one more
+ * node than there are components in in_path.
+ *
+ * Returns the node for in_path itself, or NULL if in_path is neither a
+ * configured item nor a virtual parent of one.
+ */
+struct trie_node *trie_walk(struct config *conf, const char *in_path, struct trie_node **containing, size_t *containing_count)
+{
+	struct trie_node *node = &conf->trie_root;
+	const char *name;
+	size_t name_len;
+
+	*containing_count = 0;
+	while ( (name = next_component(&in_path, &name_len)) ) {
+		if (node->dir_item_count > 0) {
+			containing[(*containing_count)++] = node;
+		}
+		if (! (node = trie_child(node, name, name_len, NULL)) ) {
+			return NULL;
+		}
+	}
+	return node;
 }
 
 /*
- * Apply relevant filter to getattr output.
+ * The out_items referenced by the containing nodes from trie_walk() may be
+ * spread across multiple nodes.  This iterates over them in config order.
+ * cursors should be zero-initialized with one entry per node.  Returns the
+ * next out_item index, or -1 once they are exhausted.
  */
-void stat_filter(struct stat *stbuf,
-		const char const *in_path,
-		int filter,
-		struct in_item *item,
-		const char *tail)
+ssize_t next_containing(struct trie_node **nodes, size_t *cursors, size_t count)
 {
-	/*
-	 * Remove an setuid/setgid properties and write properties  The
-	 * program we are wrapping could be setuid and owned by something
-	 * other than root, in which case this would have been an exploit.
-	 * Moreover, no one can write to these.
-	 */
-	stbuf->st_mode &= ~ (S_ISUID | S_ISGID | S_IWUSR | S_IWGRP | S_IWOTH);
+	ssize_t best = -1;
+	size_t best_node = 0;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if (cursors[i] < nodes[i]->dir_item_count &&
+				(best < 0 || nodes[i]->dir_items[cursors[i]] < best)) {
+			best = nodes[i]->dir_items[cursors[i]];
+			best_node = i;
+		}
+	}
+	if (best >= 0) {
+		cursors[best_node]++;
+	}
+	return best;
+}
 
-	if (S_ISDIR(stbuf->st_mode)) {
-		/* filters below only touch files */
-		return;
+/*
+ * Number of path components in path, for sizing trie_walk()'s containing
+ * argument.
+ */
+size_t component_count(const char *path)
+{
+	size_t count = 0;
+	for (; *path; path++) {
+		if (*path == '/') {
+			count++;
+		}
 	}
+	return count + 1;
+}
 
-	FILE *fp;
-	char line[PATH_MAX+1];
+/*
+ * ============================================================================
+ * directory name index
+ * ============================================================================
+ *
+ * Most lookups within configured directories are misses, e.g. a shell
+ * searching $PATH, and finding that out means trying every one of the
+ * directory's in_items.  While brp is watching the strata (see the
+ * "filesystem watching" section below) it instead keeps, for each
+ * FILE_TYPE_DIRECTORY out_item, an index of which in_items list which names,
+ * updated as they change.  A bloom filter in front of it answers most misses
+ * without touching the table.
+ *
+ * Indexes are built as root, and so list at least what any caller can see.
+ * A name no in_item lists does not exist for anyone.  One that is listed is
+ * still looked up as the caller, starting from the first in_item listing it.
+ */
 
-	switch (filter) {
+/* bloom filter bits per name, and bits set per name */
+#define BLOOM_BITS_PER_NAME 8
+#define BLOOM_HASHES 3
 
-	case FILTER_PASS:
-		break;
+struct name_entry {
+	struct name_entry *next;
+	unsigned long hash;
+	char *name;
+	/* bitmap of the in_items which list name */
+	uint64_t in_items[];
+};
 
-	case FILTER_BRC_WRAP:
-		stbuf->st_size = strlen("#!/bedrock/libexec/busybox sh\nexec /bedrock/bin/brc ")
-						+ item->stratum_len
-						+ strlen(" ")
-						+ item->stratum_path_len
-						+ strlen(tail)
-						+ strlen(" \"$@\"\n");
-		break;
+struct name_index {
+	pthread_rwlock_t lock;
+	/* consulted only once fully built, see name_index_validate() */
+	int valid;
+	size_t in_item_count;
+	/* uint64_t per name_entry bitmap */
+	size_t words;
+	/* hash table of names, bucket_count is a power of two */
+	struct name_entry **buckets;
+	size_t bucket_count;
+	size_t name_count;
+	/* bloom filter over the names, bloom_bits is a power of two */
+	uint64_t *bloom;
+	size_t bloom_bits;
+	/* names removed since the bloom filter was sized, which it still has */
+	size_t removed_count;
+};
 
-	case FILTER_EXEC:
-		fp = fopen(in_path, "r");
-		if (fp != NULL) {
-			while (fgets(line, PATH_MAX, fp) != NULL) {
-				if (strncmp(line, "Exec=", strlen("Exec=")) == 0 ||
-						strncmp(line, "TryExec=", strlen("TryExec=")) == 0 ||
-						strncmp(line, "ExecStart=", strlen("ExecStart=")) == 0 ||
-						strncmp(line, "ExecStop=", strlen("ExecStop=")) == 0 ||
-						strncmp(line, "ExecReload=", strlen("ExecReload=")) == 0) {
-					stbuf->st_size += strlen("/bedrock/bin/brc ");
-					stbuf->st_size += item->stratum_len;
-					stbuf->st_size += strlen(" ");
-				}
-			}
-			fclose(fp);
-		}
-		break;
+void bloom_add(struct name_index *index, unsigned long hash)
+{
+	unsigned long step = (hash >> 17) | 1;
+	int i;
+	for (i = 0; i < BLOOM_HASHES; i++, hash += step) {
+		size_t bit = hash & (index->bloom_bits - 1);
+		index->bloom[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+}
 
+int bloom_test(struct name_index *index, unsigned long hash)
+{
+	unsigned long step = (hash >> 17) | 1;
+	int i;
+	for (i = 0; i < BLOOM_HASHES; i++, hash += step) {
+		size_t bit = hash & (index->bloom_bits - 1);
+		if (!(index->bloom[bit / 64] & ((uint64_t)1 << (bit % 64)))) {
+			return 0;
+		}
 	}
+	return 1;
 }
 
 /*
- * Do read() and apply relevant filter.
+ * Resizes the hash table and bloom filter for the current number of names,
+ * dropping any removed names from the latter.  Expects index->lock to be
+ * held for writing.  Returns 0 or -ENOMEM.
  */
-int read_filter(const char *in_path,
-		int filter,
-		struct in_item *item,
-		const char *tail,
-		char *buf,
-		size_t size,
-		off_t offset)
+int name_index_resize(struct name_index *index)
 {
-	char *execs[] = {"TryExec=", "ExecStart=", "ExecStop=", "ExecReload=", "Exec="};
-	size_t exec_cnt = sizeof(execs) / sizeof(execs[0]);
-	int fd, ret;
-	const size_t line_max = PATH_MAX;
-	char line[line_max+1];
-	FILE *fp;
+	struct name_entry **buckets;
+	struct name_entry *entry;
+	struct name_entry *next;
+	uint64_t *bloom;
+	size_t bucket_count = 64;
+	size_t bloom_bits = 64 * BLOOM_BITS_PER_NAME;
+	size_t i;
 
-	switch (filter) {
+	while (bucket_count < index->name_count) {
+		bucket_count *= 2;
+	}
+	while (bloom_bits < index->name_count * 2 * BLOOM_BITS_PER_NAME) {
+		bloom_bits *= 2;
+	}
+	buckets = calloc(bucket_count, sizeof(struct name_entry *));
+	bloom = calloc(bloom_bits / 64, sizeof(uint64_t));
+	if (!buckets || !bloom) {
+		free(buckets);
+		free(bloom);
+		return -ENOMEM;
+	}
 
-	case FILTER_PASS:
-		if ((fd = open(in_path, O_RDONLY)) >= 0) {
-			ret = pread(fd, buf, size, offset);
-			close(fd);
-			return ret;
+	for (i = 0; i < index->bucket_count; i++) {
+		for (entry = index->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash & (bucket_count - 1)];
+			buckets[entry->hash & (bucket_count - 1)] = entry;
 		}
-		return fd;
-		break;
-
-	case FILTER_BRC_WRAP:
-		if (access(in_path, F_OK) == 0) {
-			size_t left_to_skip = offset;
-			size_t written = 0;
-			strcatoffset(buf, "#!/bedrock/libexec/busybox sh\nexec /bedrock/bin/brc ", &left_to_skip, &written, size);
-			strcatoffset(buf, item->stratum, &left_to_skip, &written, size);
-			strcatoffset(buf, " ", &left_to_skip, &written, size);
-			strcatoffset(buf, item->stratum_path, &left_to_skip, &written, size);
-			strcatoffset(buf, tail, &left_to_skip, &written, size);
-			strcatoffset(buf, " \"$@\"\n", &left_to_skip, &written, size);
-			return written;
-		} else {
-			return -EPERM;
+	}
+	free(index->buckets);
+	free(index->bloom);
+	index->buckets = buckets;
+	index->bucket_count = bucket_count;
+	index->bloom = bloom;
+	index->bloom_bits = bloom_bits;
+	index->removed_count = 0;
+
+	for (i = 0; i < bucket_count; i++) {
+		for (entry = buckets[i]; entry; entry = entry->next) {
+			bloom_add(index, entry->hash);
 		}
-		break;
+	}
+	return 0;
+}
 
-	case FILTER_EXEC:
-		if (access(in_path, F_OK) == 0) {
-			size_t left_to_skip = offset;
-			size_t written = 0;
-			fp = fopen(in_path, "r");
-			if (!fp) {
-				return -errno;
-			}
-			while (fgets(line, line_max, fp) != NULL) {
-				size_t i;
-				int found = 0;
-				for (i = 0; i < exec_cnt; i++) {
-					if (strncmp(line, execs[i], strlen(execs[i])) == 0) {
-						found = 1;
-						strcatoffset(buf, execs[i], &left_to_skip, &written, size);
-						strcatoffset(buf, "/bedrock/bin/brc ", &left_to_skip, &written, size);
-						strcatoffset(buf, item->stratum, &left_to_skip, &written, size);
-						strcatoffset(buf, " ", &left_to_skip, &written, size);
-						strcatoffset(buf, line + strlen(execs[i]), &left_to_skip, &written, size);
+/*
+ * Expects index->lock to be held.
+ */
+struct name_entry **name_index_find(struct name_index *index, const char *name, unsigned long hash)
+{
+	struct name_entry **link = &index->buckets[hash & (index->bucket_count - 1)];
+	for (; *link; link = &(*link)->next) {
+		if ((*link)->hash == hash && strcmp((*link)->name, name) == 0) {
+			break;
+		}
+	}
+	return link;
+}
+
+void name_index_init(struct name_index *index, size_t in_item_count)
+{
+	memset(index, 0, sizeof(struct name_index));
+	pthread_rwlock_init(&index->lock, NULL);
+	index->in_item_count = in_item_count;
+	index->words = (in_item_count + 63) / 64;
+}
+
+/*
+ * Empties the index and stops it from being consulted until it is
+ * validated again.
+ */
+void name_index_clear(struct name_index *index)
+{
+	struct name_entry *entry;
+	size_t i;
+
+	pthread_rwlock_wrlock(&index->lock);
+	index->valid = 0;
+	for (i = 0; i < index->bucket_count; i++) {
+		while ( (entry = index->buckets[i]) ) {
+			index->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	free(index->buckets);
+	free(index->bloom);
+	index->buckets = NULL;
+	index->bucket_count = 0;
+	index->bloom = NULL;
+	index->bloom_bits = 0;
+	index->name_count = 0;
+	index->removed_count = 0;
+	pthread_rwlock_unlock(&index->lock);
+}
+
+void name_index_free(struct name_index *index)
+{
+	name_index_clear(index);
+	pthread_rwlock_destroy(&index->lock);
+}
+
+/*
+ * Marks the index as complete.  Returns 0 or -ENOMEM, in which case it is
+ * not.
+ */
+int name_index_validate(struct name_index *index)
+{
+	int ret = 0;
+	pthread_rwlock_wrlock(&index->lock);
+	if (!index->buckets) {
+		ret = name_index_resize(index);
+	}
+	index->valid = ret == 0;
+	pthread_rwlock_unlock(&index->lock);
+	return ret;
+}
+
+/*
+ * Records that the given in_item lists name.  Expects index->lock to be held
+ * for writing.  Returns 0 or -ENOMEM.
+ */
+int name_index_add_locked(struct name_index *index, size_t in_item, const char *name)
+{
+	unsigned long hash = hash_str(name);
+	struct name_entry *entry;
+	size_t name_len;
+
+	if (!index->buckets || index->name_count >= index->bucket_count ||
+			index->name_count + index->removed_count >= index->bloom_bits / BLOOM_BITS_PER_NAME) {
+		if (name_index_resize(index) < 0) {
+			return -ENOMEM;
+		}
+	}
+
+	if (! (entry = *name_index_find(index, name, hash)) ) {
+		name_len = strlen(name);
+		entry = calloc(1, sizeof(struct name_entry) + index->words * sizeof(uint64_t) + name_len + 1);
+		if (!entry) {
+			return -ENOMEM;
+		}
+		entry->hash = hash;
+		entry->name = (char *)&entry->in_items[index->words];
+		memcpy(entry->name, name, name_len + 1);
+		entry->next = index->buckets[hash & (index->bucket_count - 1)];
+		index->buckets[hash & (index->bucket_count - 1)] = entry;
+		index->name_count++;
+		bloom_add(index, hash);
+	}
+	entry->in_items[in_item / 64] |= (uint64_t)1 << (in_item % 64);
+	return 0;
+}
+
+/*
+ * Records that the given in_item lists name.  On failure the index is
+ * invalidated, as it can no longer be trusted.
+ */
+void name_index_add(struct name_index *index, size_t in_item, const char *name)
+{
+	pthread_rwlock_wrlock(&index->lock);
+	if (index->valid && name_index_add_locked(index, in_item, name) < 0) {
+		index->valid = 0;
+	}
+	pthread_rwlock_unlock(&index->lock);
+}
+
+/*
+ * Records that the given in_item no longer lists name.
+ */
+void name_index_remove(struct name_index *index, size_t in_item, const char *name)
+{
+	struct name_entry **link;
+	struct name_entry *entry;
+	size_t i;
+
+	pthread_rwlock_wrlock(&index->lock);
+	if (index->buckets) {
+		link = name_index_find(index, name, hash_str(name));
+		if ( (entry = *link) ) {
+			entry->in_items[in_item / 64] &= ~((uint64_t)1 << (in_item % 64));
+			for (i = 0; i < index->words && !entry->in_items[i]; i++) {
+			}
+			if (i == index->words) {
+				*link = entry->next;
+				free(entry);
+				index->name_count--;
+				index->removed_count++;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&index->lock);
+}
+
+/*
+ * Adds the given names, as read from the directory of the given in_item, to
+ * the index.  Returns 0 or -ENOMEM.
+ */
+int name_index_add_names(struct name_index *index, size_t in_item, char **names, size_t count)
+{
+	int ret = 0;
+	size_t i;
+
+	pthread_rwlock_wrlock(&index->lock);
+	for (i = 0; ret == 0 && i < count; i++) {
+		if (strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0) {
+			continue;
+		}
+		ret = name_index_add_locked(index, in_item, names[i]);
+	}
+	pthread_rwlock_unlock(&index->lock);
+	return ret;
+}
+
+/*
+ * Returns the first of the given out_item's in_items which lists the first
+ * component of tail, -ENOENT if none do, or -ESTALE if there is no index to
+ * tell, in which case all of them must be tried.
+ */
+ssize_t name_index_first(struct config *conf, size_t out_item, const char *tail)
+{
+	struct name_index *indexes = __atomic_load_n(&conf->name_indexes, __ATOMIC_ACQUIRE);
+	struct name_index *index;
+	struct name_entry *entry;
+	const char *component;
+	size_t len;
+	ssize_t ret = -ESTALE;
+	size_t i;
+
+	if (!indexes || !(component = next_component(&tail, &len)) || len > NAME_MAX) {
+		return -ESTALE;
+	}
+	char name[len + 1];
+	memcpy(name, component, len);
+	name[len] = '\0';
+	unsigned long hash = hash_str(name);
+
+	index = &indexes[out_item];
+	pthread_rwlock_rdlock(&index->lock);
+	if (index->valid) {
+		ret = -ENOENT;
+		if (bloom_test(index, hash) && (entry = *name_index_find(index, name, hash))) {
+			for (i = 0; i < index->words && !entry->in_items[i]; i++) {
+			}
+			if (i < index->words) {
+				ret = i * 64 + __builtin_ctzll(entry->in_items[i]);
+			}
+		}
+	}
+	pthread_rwlock_unlock(&index->lock);
+	return ret;
+}
+
+/*
+ * ============================================================================
+ * brc-wrap
+ * ============================================================================
+ */
+
+size_t brc_wrap_len(struct in_item *item, const char *tail)
+{
+	return BRC_WRAP_PREFIX_LEN
+		+ item->stratum_len
+		+ 1
+		+ item->stratum_path_len
+		+ strlen(tail)
+		+ BRC_WRAP_SUFFIX_LEN;
+}
+
+/*
+ * Returns the FILTER_BRC_WRAP script for the given in_item and tail, or NULL
+ * if out of memory.  Up to the caller to free() it.
+ */
+char *brc_wrap_render(struct in_item *item, const char *tail, size_t *len)
+{
+	size_t tail_len = strlen(tail);
+	*len = brc_wrap_len(item, tail);
+	char *wrapper = malloc(*len);
+	if (!wrapper) {
+		return NULL;
+	}
+
+	char *p = wrapper;
+	memcpy(p, BRC_WRAP_PREFIX, BRC_WRAP_PREFIX_LEN);
+	p += BRC_WRAP_PREFIX_LEN;
+	memcpy(p, item->stratum, item->stratum_len);
+	p += item->stratum_len;
+	*p++ = ' ';
+	memcpy(p, item->stratum_path, item->stratum_path_len);
+	p += item->stratum_path_len;
+	memcpy(p, tail, tail_len);
+	p += tail_len;
+	memcpy(p, BRC_WRAP_SUFFIX, BRC_WRAP_SUFFIX_LEN);
+
+	return wrapper;
+}
+
+/*
+ * Copies up to size bytes of wrapper, starting at offset, into buf.  Returns
+ * the number of bytes copied.
+ */
+int brc_wrap_copy(const char *wrapper, size_t len, char *buf, size_t size, off_t offset)
+{
+	if (offset >= len) {
+		return 0;
+	}
+	size_t ret = MIN(len - offset, size);
+	memcpy(buf, wrapper + offset, ret);
+	return ret;
+}
+
+/*
+ * ============================================================================
+ * inode table
+ * ============================================================================
+ *
+ * The kernel refers to files by inode number.  brp tracks what each inode
+ * number refers to: the path it was looked up as and what that path resolved
+ * to, so that getattr, open and read can go straight to the resolved in_item
+ * rather than resolving the path from scratch.
+ *
+ * A node is created on the first lookup of a given name in a given directory
+ * and freed once the kernel has forgotten every lookup of it.  The kernel
+ * does not forget a node while a request on it or within it is in flight, and
+ * so nodes may be used without holding node_lock.  Their resolution fields,
+ * however, are updated by concurrent requests and are only accessed under
+ * node_lock.
+ */
+
+enum node_type {
+	NODE_ROOT,
+	NODE_REPARSE_CONFIG,
+	NODE_STATS,
+	NODE_ITEM,
+};
+
+struct node {
+	fuse_ino_t ino;
+	/* directory the node was looked up in and its name there */
+	fuse_ino_t parent;
+	char *name;
+	/* incoming path, e.g. "/bin/ls" */
+	char *path;
+	int type;
+	/* number of lookups the kernel has yet to forget */
+	uint64_t nlookup;
+	/*
+	 * What path resolved to, valid only for the config with the same
+	 * generation.  Reused for up to cache_ttl seconds.
+	 */
+	unsigned long generation;
+	time_t resolved;
+	int match;
+	struct out_item *out_item;
+	struct in_item *in_item;
+	size_t tail_offset;
+	/*
+	 * Identity of the backing file when it was last opened, to tell
+	 * whether the kernel's cached pages of it are still valid.  Any
+	 * change to its contents changes its ctime.
+	 */
+	int opened;
+	dev_t open_dev;
+	ino_t open_ino;
+	struct timespec open_ctime;
+	/* FILTER_BRC_WRAP output for the current resolution, if any */
+	char *wrapper;
+	size_t wrapper_len;
+	/* hash chains for lookups by inode number and by parent/name */
+	struct node *ino_next;
+	struct node *name_next;
+};
+
+/* protects everything below */
+pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct node **ino_buckets;
+struct node **name_buckets;
+size_t bucket_count = 0;
+size_t node_count = 0;
+fuse_ino_t next_ino = FUSE_ROOT_ID + 1;
+
+unsigned long node_name_hash(fuse_ino_t parent, const char *name)
+{
+	return hash_str(name) * 31 + parent;
+}
+
+/*
+ * Double the number of hash buckets.  Returns 0 if out of memory, in which
+ * case the existing buckets remain in use.
+ */
+int node_table_grow()
+{
+	size_t new_count = bucket_count > 0 ? bucket_count * 2 : 1024;
+	struct node **new_ino_buckets = calloc(new_count, sizeof(struct node *));
+	struct node **new_name_buckets = calloc(new_count, sizeof(struct node *));
+	struct node *node, *next;
+	size_t i, bucket;
+
+	if (!new_ino_buckets || !new_name_buckets) {
+		free(new_ino_buckets);
+		free(new_name_buckets);
+		return 0;
+	}
+
+	for (i = 0; i < bucket_count; i++) {
+		for (node = ino_buckets[i]; node; node = next) {
+			next = node->ino_next;
+			bucket = node->ino % new_count;
+			node->ino_next = new_ino_buckets[bucket];
+			new_ino_buckets[bucket] = node;
+		}
+		for (node = name_buckets[i]; node; node = next) {
+			next = node->name_next;
+			bucket = node_name_hash(node->parent, node->name) % new_count;
+			node->name_next = new_name_buckets[bucket];
+			new_name_buckets[bucket] = node;
+		}
+	}
+
+	free(ino_buckets);
+	free(name_buckets);
+	ino_buckets = new_ino_buckets;
+	name_buckets = new_name_buckets;
+	bucket_count = new_count;
+	return 1;
+}
+
+/*
+ * Expects node_lock to be held.
+ */
+struct node *node_find(fuse_ino_t ino)
+{
+	struct node *node;
+	for (node = ino_buckets[ino % bucket_count]; node; node = node->ino_next) {
+		if (node->ino == ino) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Expects node_lock to be held.
+ */
+struct node *node_find_name(fuse_ino_t parent, const char *name)
+{
+	struct node *node;
+	size_t bucket = node_name_hash(parent, name) % bucket_count;
+	for (node = name_buckets[bucket]; node; node = node->name_next) {
+		if (node->parent == parent && strcmp(node->name, name) == 0) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Expects node_lock to be held.  The root node is only indexed by inode
+ * number.
+ */
+void node_insert(struct node *node)
+{
+	if (node_count >= bucket_count) {
+		/* on failure, chains simply get longer */
+		node_table_grow();
+	}
+
+	size_t bucket = node->ino % bucket_count;
+	node->ino_next = ino_buckets[bucket];
+	ino_buckets[bucket] = node;
+
+	if (node->name) {
+		bucket = node_name_hash(node->parent, node->name) % bucket_count;
+		node->name_next = name_buckets[bucket];
+		name_buckets[bucket] = node;
+	}
+
+	node_count++;
+}
+
+/*
+ * Expects node_lock to be held.
+ */
+void node_remove(struct node *node)
+{
+	struct node **link;
+
+	for (link = &ino_buckets[node->ino % bucket_count]; *link; link = &(*link)->ino_next) {
+		if (*link == node) {
+			*link = node->ino_next;
+			break;
+		}
+	}
+
+	if (node->name) {
+		size_t bucket = node_name_hash(node->parent, node->name) % bucket_count;
+		for (link = &name_buckets[bucket]; *link; link = &(*link)->name_next) {
+			if (*link == node) {
+				*link = node->name_next;
+				break;
+			}
+		}
+	}
+
+	node_count--;
+}
+
+void node_free(struct node *node)
+{
+	free(node->wrapper);
+	free(node->name);
+	free(node->path);
+	free(node);
+}
+
+void node_table_init()
+{
+	if (!node_table_grow()) {
+		fprintf(stderr, "brp: unable to allocate inode table\n");
+		exit(1);
+	}
+
+	struct node *root = calloc(1, sizeof(struct node));
+	if (!root || !(root->path = strdup("/"))) {
+		fprintf(stderr, "brp: unable to allocate inode table\n");
+		exit(1);
+	}
+	root->ino = FUSE_ROOT_ID;
+	root->type = NODE_ROOT;
+	/* never forgotten */
+	root->nlookup = 1;
+	node_insert(root);
+}
+
+/*
+ * Returns the node for the given incoming path, or NULL if the kernel has not
+ * looked it up.  parent is set to the inode number of the path's parent
+ * directory, or 0 if that has not been looked up either.  Expects node_lock
+ * to be held.
+ */
+struct node *node_find_path(const char *path, fuse_ino_t *parent)
+{
+	struct node *node = node_find(FUSE_ROOT_ID);
+	const char *name;
+	size_t name_len;
+
+	*parent = 0;
+	while ( (name = next_component(&path, &name_len)) ) {
+		if (!node) {
+			*parent = 0;
+			return NULL;
+		}
+		char component[name_len + 1];
+		memcpy(component, name, name_len);
+		component[name_len] = '\0';
+		*parent = node->ino;
+		node = node_find_name(node->ino, component);
+	}
+	return node;
+}
+
+/*
+ * Returns the node with the given inode number, or NULL if there is none.
+ */
+struct node *node_get(fuse_ino_t ino)
+{
+	pthread_mutex_lock(&node_lock);
+	struct node *node = node_find(ino);
+	pthread_mutex_unlock(&node_lock);
+	return node;
+}
+
+/*
+ * Returns the node for name within parent, whose incoming path is path,
+ * creating it if this is the first lookup of it.  Counts a lookup against it
+ * which the kernel will later forget.  Returns NULL if out of memory.
+ */
+struct node *node_lookup(fuse_ino_t parent, const char *name, const char *path, int type)
+{
+	pthread_mutex_lock(&node_lock);
+
+	struct node *node = node_find_name(parent, name);
+	if (!node) {
+		node = calloc(1, sizeof(struct node));
+		if (!node || !(node->name = strdup(name)) || !(node->path = strdup(path))) {
+			if (node) {
+				node_free(node);
+			}
+			pthread_mutex_unlock(&node_lock);
+			return NULL;
+		}
+		node->ino = next_ino++;
+		node->parent = parent;
+		node->type = type;
+		node_insert(node);
+	}
+	node->nlookup++;
+
+	pthread_mutex_unlock(&node_lock);
+	return node;
+}
+
+/*
+ * The kernel no longer references nlookup of the lookups of ino.
+ */
+void node_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+	pthread_mutex_lock(&node_lock);
+
+	struct node *node = node_find(ino);
+	if (node && node->type != NODE_ROOT) {
+		if (node->nlookup > nlookup) {
+			node->nlookup -= nlookup;
+		} else {
+			node_remove(node);
+			node_free(node);
+		}
+	}
+
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * Record what the node's path resolved to within conf.
+ */
+void node_set_resolution(struct config *conf,
+		struct node *node,
+		int match,
+		struct out_item *out_item,
+		struct in_item *in_item,
+		size_t tail_offset)
+{
+	/*
+	 * The brc-wrap script only depends on the resolution, so render it
+	 * once here rather than on every read.
+	 */
+	char *wrapper = NULL;
+	size_t wrapper_len = 0;
+	if (out_item->filter == FILTER_BRC_WRAP &&
+			(match == MATCH_CONTAINED || (match == MATCH_ITEM && out_item->file_type == FILE_TYPE_NORMAL))) {
+		wrapper = brc_wrap_render(in_item, node->path + tail_offset, &wrapper_len);
+	}
+
+	pthread_mutex_lock(&node_lock);
+	if (node->generation > conf->generation) {
+		/* resolved against a newer config by another request meanwhile */
+		pthread_mutex_unlock(&node_lock);
+		free(wrapper);
+		return;
+	}
+	free(node->wrapper);
+	node->wrapper = wrapper;
+	node->wrapper_len = wrapper_len;
+	node->generation = conf->generation;
+	node->resolved = time(NULL);
+	node->match = match;
+	node->out_item = out_item;
+	node->in_item = in_item;
+	node->tail_offset = tail_offset;
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * Carry node resolutions over from the config with generation from to the
+ * config with generation to, which is derived from it, as cache_migrate()
+ * does for the lookup cache.  keep() is given each node's path and
+ * resolution, and updates out_item and in_item to point into the new config
+ * if it still holds.  Anything else is left as it was, and so is resolved
+ * afresh when next used.
+ */
+void node_migrate(unsigned long from,
+		unsigned long to,
+		int (*keep)(const char *path, int match, struct out_item **out_item, struct in_item **in_item, void *arg),
+		void *arg)
+{
+	struct node *node;
+	size_t i;
+
+	pthread_mutex_lock(&node_lock);
+	for (i = 0; i < bucket_count; i++) {
+		for (node = ino_buckets[i]; node; node = node->ino_next) {
+			if (node->type == NODE_ITEM && node->generation == from &&
+					keep(node->path, node->match, &node->out_item, &node->in_item, arg)) {
+				node->generation = to;
+			}
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * Record the identity of the file backing node as it is opened.  Returns 1
+ * if it is the same, unmodified file as when the node was last opened.
+ */
+int node_check_backing(struct node *node, const struct stat *stbuf)
+{
+	int same;
+
+	pthread_mutex_lock(&node_lock);
+	same = node->opened &&
+		node->open_dev == stbuf->st_dev &&
+		node->open_ino == stbuf->st_ino &&
+		node->open_ctime.tv_sec == stbuf->st_ctim.tv_sec &&
+		node->open_ctime.tv_nsec == stbuf->st_ctim.tv_nsec;
+	node->opened = 1;
+	node->open_dev = stbuf->st_dev;
+	node->open_ino = stbuf->st_ino;
+	node->open_ctime = stbuf->st_ctim;
+	pthread_mutex_unlock(&node_lock);
+
+	return same;
+}
+
+/*
+ * Copies the node's pre-rendered brc-wrap script into buf as with
+ * brc_wrap_copy().  Returns 0 if the node has none.
+ */
+int node_wrapper_copy(struct node *node, char *buf, size_t size, off_t offset, int *ret)
+{
+	int found = 0;
+	pthread_mutex_lock(&node_lock);
+	if (node->wrapper) {
+		*ret = brc_wrap_copy(node->wrapper, node->wrapper_len, buf, size, offset);
+		found = 1;
+	}
+	pthread_mutex_unlock(&node_lock);
+	return found;
+}
+
+/*
+ * ============================================================================
+ * kernel cache invalidation
+ * ============================================================================
+ *
+ * The kernel caches names, attributes and misses for entry_timeout,
+ * attr_timeout and negative_timeout seconds respectively.  When the config
+ * is reparsed any of these may have changed, and so brp tells the kernel to
+ * drop everything it may have cached rather than wait out the timeouts.  When
+ * a single stratum is enabled or disabled, only what that could have changed
+ * is dropped.
+ *
+ * Positive entries are known from the inode table.  Misses are not nodes, and
+ * so the names reported as missing are tracked here until they expire.
+ *
+ * libfuse requires these notifications not be sent from the request which
+ * triggers them, and so they are sent from a separate thread.
+ */
+
+struct negative {
+	fuse_ino_t parent;
+	char *name;
+	time_t expires;
+	struct negative *next;
+};
+
+/* protects everything below */
+pthread_mutex_t negative_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define NEGATIVE_BUCKETS (NEGATIVE_MAX / 4)
+struct negative *negative_buckets[NEGATIVE_BUCKETS];
+size_t negative_count = 0;
+
+/* used to send notifications; NULL until mounted */
+struct fuse_session *session;
+
+/*
+ * Expects negative_lock to be held.
+ */
+void negative_prune(time_t now)
+{
+	struct negative **link;
+	struct negative *entry;
+	size_t i;
+
+	for (i = 0; i < NEGATIVE_BUCKETS; i++) {
+		link = &negative_buckets[i];
+		while ( (entry = *link) ) {
+			if (entry->expires < now) {
+				*link = entry->next;
+				free(entry->name);
+				free(entry);
+				negative_count--;
+			} else {
+				link = &entry->next;
+			}
+		}
+	}
+}
+
+/*
+ * Track that name within parent is about to be reported to the kernel as not
+ * existing.  Returns 1 if it is tracked, in which case the kernel may cache
+ * the miss, or 0 if not.
+ */
+int negative_add(fuse_ino_t parent, const char *name)
+{
+	time_t now = time(NULL);
+	/* whole seconds, rounded up, with a second to spare */
+	time_t expires = now + (time_t) options.negative_timeout + 2;
+	size_t bucket = node_name_hash(parent, name) % NEGATIVE_BUCKETS;
+	struct negative *entry;
+	int ret = 0;
+
+	pthread_mutex_lock(&negative_lock);
+
+	for (entry = negative_buckets[bucket]; entry; entry = entry->next) {
+		if (entry->parent == parent && strcmp(entry->name, name) == 0) {
+			entry->expires = expires;
+			ret = 1;
+			goto out;
+		}
+	}
+
+	if (negative_count >= NEGATIVE_MAX) {
+		negative_prune(now);
+		if (negative_count >= NEGATIVE_MAX) {
+			goto out;
+		}
+	}
+
+	if (! (entry = malloc(sizeof(struct negative))) ) {
+		goto out;
+	}
+	if (! (entry->name = strdup(name)) ) {
+		free(entry);
+		goto out;
+	}
+	entry->parent = parent;
+	entry->expires = expires;
+	entry->next = negative_buckets[bucket];
+	negative_buckets[bucket] = entry;
+	negative_count++;
+	ret = 1;
+
+out:
+	pthread_mutex_unlock(&negative_lock);
+	return ret;
+}
+
+struct invalidation {
+	fuse_ino_t parent;
+	char *name;
+	/* 0 for misses */
+	fuse_ino_t ino;
+	/*
+	 * If the node's backing file was opened, its incoming path and the
+	 * identity recorded by node_check_backing(), NULL otherwise
+	 */
+	char *path;
+	dev_t open_dev;
+	ino_t open_ino;
+	struct timespec open_ctime;
+};
+
+/*
+ * Snapshot node into inval.  Returns 0 if out of memory.  Call with
+ * node_lock held.
+ */
+int invalidation_init(struct invalidation *inval, struct node *node)
+{
+	inval->parent = node->parent;
+	inval->ino = node->ino;
+	inval->path = NULL;
+	if (! (inval->name = strdup(node->name)) ) {
+		return 0;
+	}
+	if (node->opened) {
+		inval->path = strdup(node->path);
+		inval->open_dev = node->open_dev;
+		inval->open_ino = node->open_ino;
+		inval->open_ctime = node->open_ctime;
+	}
+	return 1;
+}
+
+struct config *config_get();
+void config_put(struct config *conf);
+int corresponding_scan(struct config *conf, char *in_path, struct stat *stbuf, struct out_item **arg_out_item, struct in_item **arg_in_item, char **tail);
+int in_item_stat(struct in_item *item, const char *tail, struct stat *stbuf);
+
+/*
+ * Have the kernel drop its attributes of inval's inode and, if the file now
+ * backing its path differs from the one it was last opened from, its cached
+ * pages.  Everything else keeps its pages, which brp_open() would otherwise
+ * let it keep via keep_cache.
+ */
+void invalidate_inode(struct config *conf, struct invalidation *inval)
+{
+	struct out_item *out_item;
+	struct in_item *in_item;
+	struct stat stbuf;
+	char *tail;
+	int changed = 0;
+
+	if (inval->path) {
+		int match = corresponding_scan(conf, inval->path, &stbuf, &out_item, &in_item, &tail);
+		changed = (match != MATCH_ITEM && match != MATCH_CONTAINED) ||
+			out_item->filter != FILTER_PASS ||
+			in_item_stat(in_item, tail, &stbuf) < 0 ||
+			inval->open_dev != stbuf.st_dev ||
+			inval->open_ino != stbuf.st_ino ||
+			inval->open_ctime.tv_sec != stbuf.st_ctim.tv_sec ||
+			inval->open_ctime.tv_nsec != stbuf.st_ctim.tv_nsec;
+	}
+
+	/* a negative offset invalidates only the attributes */
+	fuse_lowlevel_notify_inval_inode(session, inval->ino, changed ? 0 : -1, 0);
+}
+
+/* what invalidate_kernel_cache_thread() is to send */
+struct invalidation_batch {
+	struct invalidation *inval;
+	size_t inval_count;
+	struct negative *negatives;
+};
+
+void *invalidate_kernel_cache_thread(void *arg)
+{
+	struct invalidation_batch *batch = arg;
+	struct negative *entry;
+	struct config *conf = config_get();
+	size_t i;
+
+	/*
+	 * Errors are ignored; most commonly the kernel simply no longer has
+	 * the given item cached.
+	 */
+	for (i = 0; i < batch->inval_count; i++) {
+		invalidate_inode(conf, &batch->inval[i]);
+		fuse_lowlevel_notify_inval_entry(session, batch->inval[i].parent, batch->inval[i].name, strlen(batch->inval[i].name));
+		free(batch->inval[i].name);
+		free(batch->inval[i].path);
+	}
+	free(batch->inval);
+	config_put(conf);
+
+	while ( (entry = batch->negatives) ) {
+		batch->negatives = entry->next;
+		fuse_lowlevel_notify_inval_entry(session, entry->parent, entry->name, strlen(entry->name));
+		free(entry->name);
+		free(entry);
+	}
+
+	free(batch);
+	return NULL;
+}
+
+/*
+ * Returns the incoming path of name within the node with inode number
+ * parent, or NULL if it is unknown or out of memory.  The caller should
+ * free() it.
+ */
+char *negative_path(fuse_ino_t parent, const char *name)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&node_lock);
+	struct node *node = node_find(parent);
+	if (node && (path = malloc(strlen(node->path) + strlen(name) + 2))) {
+		strcpy(path, node->path);
+		if (node->type != NODE_ROOT) {
+			strcat(path, "/");
+		}
+		strcat(path, name);
+	}
+	pthread_mutex_unlock(&node_lock);
+	return path;
+}
+
+/*
+ * Have the kernel drop what it may have cached for every node not resolved
+ * within the config with generation keep, and for every tracked miss for
+ * whose path affected() returns 1.  If keep is 0, that is every node, and if
+ * affected is NULL, every miss.
+ */
+void invalidate_kernel_cache_except(unsigned long keep, int (*affected)(const char *path, void *arg), void *arg)
+{
+	struct invalidation_batch *batch;
+	struct negative **link;
+	struct negative *entry;
+	struct node *node;
+	pthread_t thread;
+	pthread_attr_t attr;
+	size_t i;
+
+	if (!session || !(batch = calloc(1, sizeof(struct invalidation_batch)))) {
+		return;
+	}
+
+	/*
+	 * Snapshot what to invalidate, as nodes may be forgotten while the
+	 * notifications are sent.
+	 */
+	pthread_mutex_lock(&node_lock);
+	batch->inval = malloc((node_count + 1) * sizeof(struct invalidation));
+	for (i = 0; batch->inval && i < bucket_count; i++) {
+		for (node = ino_buckets[i]; node; node = node->ino_next) {
+			if (node->type == NODE_ROOT || (keep && node->generation == keep)) {
+				continue;
+			}
+			if (invalidation_init(&batch->inval[batch->inval_count], node)) {
+				batch->inval_count++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+
+	/* take the misses about to be invalidated */
+	pthread_mutex_lock(&negative_lock);
+	for (i = 0; i < NEGATIVE_BUCKETS; i++) {
+		link = &negative_buckets[i];
+		while ( (entry = *link) ) {
+			char *path = affected ? negative_path(entry->parent, entry->name) : NULL;
+			if (affected && path && !affected(path, arg)) {
+				link = &entry->next;
+			} else {
+				*link = entry->next;
+				entry->next = batch->negatives;
+				batch->negatives = entry;
+				negative_count--;
+			}
+			free(path);
+		}
+	}
+	pthread_mutex_unlock(&negative_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, invalidate_kernel_cache_thread, batch) != 0) {
+		fprintf(stderr, "brp: unable to create thread to invalidate kernel cache\n");
+		for (i = 0; i < batch->inval_count; i++) {
+			free(batch->inval[i].name);
+		}
+		free(batch->inval);
+		while ( (entry = batch->negatives) ) {
+			batch->negatives = entry->next;
+			free(entry->name);
+			free(entry);
+		}
+		free(batch);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Have the kernel drop everything it may have cached from this filesystem.
+ */
+void invalidate_kernel_cache()
+{
+	invalidate_kernel_cache_except(0, NULL, NULL);
+}
+
+/*
+ * ============================================================================
+ * arena
+ * ============================================================================
+ *
+ * Bump allocator for many small allocations which are all freed at once, e.g.
+ * everything derived from the config.
+ */
+
+/*
+ * Chunks start small, as some arenas only ever hold a little, and double up
+ * to ARENA_CHUNK_SIZE.
+ */
+#define ARENA_MIN_CHUNK_SIZE (1024)
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t size;
+	max_align_t data[];
+};
+
+/*
+ * Returns size bytes of suitably aligned memory, or NULL if out of memory.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	const size_t align = sizeof(max_align_t);
+	struct arena_chunk *chunk = arena->chunks;
+
+	size = (size + align - 1) & ~(align - 1);
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = chunk ? MIN(chunk->size * 2, ARENA_CHUNK_SIZE) : ARENA_MIN_CHUNK_SIZE;
+		if (chunk_size < size) {
+			chunk_size = size;
+		}
+		if (! (chunk = malloc(sizeof(struct arena_chunk) + chunk_size)) ) {
+			return NULL;
+		}
+		chunk->used = 0;
+		chunk->size = chunk_size;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	void *ret = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *ret = arena_alloc(arena, len + 1);
+	if (ret) {
+		memcpy(ret, str, len);
+		ret[len] = '\0';
+	}
+	return ret;
+}
+
+/*
+ * Moves everything allocated from from into arena, leaving from empty.
+ */
+void arena_adopt(struct arena *arena, struct arena *from)
+{
+	struct arena_chunk **link = &arena->chunks;
+	while (*link) {
+		link = &(*link)->next;
+	}
+	*link = from->chunks;
+	from->chunks = NULL;
+}
+
+void arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+	while ( (chunk = arena->chunks) ) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+/*
+ * ============================================================================
+ * directory scan pool
+ * ============================================================================
+ *
+ * Listing a configured directory, or building its name index, means reading
+ * the corresponding directory in every stratum.  Strata may be on
+ * different filesystems, some of them slow, so rather than reading them one
+ * after another these threads can read them concurrently.  That only pays
+ * when reading them waits on I/O, so there are none by default.
+ *
+ * Directories are opened by the requesting thread, so that permissions are
+ * checked as the caller, and only read here.  Each scan's results are kept
+ * separately for the requester to merge in priority order.
+ */
+
+struct dir_scan {
+	/* directory to read, opened O_RDONLY; closed once read */
+	int fd;
+	/* names read, allocated from arena; NULL and 0 until read */
+	char **names;
+	size_t name_count;
+	struct arena arena;
+	/* 0 or -errno */
+	int ret;
+};
+
+struct dir_scan_batch {
+	struct dir_scan *scans;
+	size_t count;
+	/* next scan to start */
+	size_t next;
+	/* scans not yet finished */
+	size_t remaining;
+	/* pool threads working on this batch */
+	size_t users;
+	struct dir_scan_batch *next_batch;
+};
+
+/* protects everything below */
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_work_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t scan_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* batches with scans not yet started */
+struct dir_scan_batch *scan_batches;
+size_t scan_thread_count = 0;
+
+void dir_scan_free(struct dir_scan *scan)
+{
+	free(scan->names);
+	arena_free(&scan->arena);
+}
+
+void dir_scan_read(struct dir_scan *scan)
+{
+	size_t allocated = 0;
+	struct dirent *dir;
+
+	DIR *d = fdopendir(scan->fd);
+	if (!d) {
+		scan->ret = -errno;
+		close(scan->fd);
+		return;
+	}
+
+	errno = 0;
+	while ( (dir = readdir(d)) ) {
+		if (scan->name_count == allocated) {
+			allocated = allocated > 0 ? allocated * 2 : 64;
+			char **names = realloc(scan->names, allocated * sizeof(char *));
+			if (!names) {
+				scan->ret = -ENOMEM;
+				break;
+			}
+			scan->names = names;
+		}
+		if (! (scan->names[scan->name_count] = arena_strndup(&scan->arena, dir->d_name, strlen(dir->d_name))) ) {
+			scan->ret = -ENOMEM;
+			break;
+		}
+		scan->name_count++;
+	}
+	if (scan->ret == 0 && errno != 0) {
+		scan->ret = -errno;
+	}
+	closedir(d);
+}
+
+/*
+ * Works through batch's scans until none are left to start.  Expects
+ * scan_lock to be held, dropping it while scanning.
+ */
+void dir_scan_work(struct dir_scan_batch *batch)
+{
+	struct dir_scan_batch **link;
+
+	while (batch->next < batch->count) {
+		struct dir_scan *scan = &batch->scans[batch->next++];
+		if (batch->next == batch->count) {
+			for (link = &scan_batches; *link; link = &(*link)->next_batch) {
+				if (*link == batch) {
+					*link = batch->next_batch;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&scan_lock);
+		dir_scan_read(scan);
+		pthread_mutex_lock(&scan_lock);
+		batch->remaining--;
+	}
+}
+
+void *dir_scan_thread(void *arg)
+{
+	struct dir_scan_batch *batch;
+
+	(void)arg;
+
+	pthread_mutex_lock(&scan_lock);
+	for (;;) {
+		while (!scan_batches) {
+			pthread_cond_wait(&scan_work_cond, &scan_lock);
+		}
+		batch = scan_batches;
+		batch->users++;
+		dir_scan_work(batch);
+		batch->users--;
+		pthread_cond_broadcast(&scan_done_cond);
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads the given directories, concurrently if there are scan threads, and
+ * returns once all have been read.
+ */
+void dir_scan_run(struct dir_scan *scans, size_t count)
+{
+	struct dir_scan_batch batch;
+	struct dir_scan_batch **link;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		scans[i].names = NULL;
+		scans[i].name_count = 0;
+		scans[i].arena.chunks = NULL;
+		scans[i].ret = 0;
+	}
+
+	if (scan_thread_count == 0 || count < 2) {
+		for (i = 0; i < count; i++) {
+			dir_scan_read(&scans[i]);
+		}
+		return;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.scans = scans;
+	batch.count = count;
+	batch.remaining = count;
+
+	pthread_mutex_lock(&scan_lock);
+	for (link = &scan_batches; *link; link = &(*link)->next_batch) {
+	}
+	*link = &batch;
+	pthread_cond_broadcast(&scan_work_cond);
+
+	/* rather than idly waiting, help */
+	dir_scan_work(&batch);
+	while (batch.remaining > 0 || batch.users > 0) {
+		pthread_cond_wait(&scan_done_cond, &scan_lock);
+	}
+	pthread_mutex_unlock(&scan_lock);
+}
+
+/*
+ * Starts options.scan_threads threads, unless fewer than two are asked for,
+ * in which case directories are read by the requesting thread.
+ */
+void dir_scan_init()
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	unsigned int i;
+
+	if (options.scan_threads < 2) {
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < options.scan_threads; i++) {
+		if (pthread_create(&thread, &attr, dir_scan_thread, NULL) != 0) {
+			fprintf(stderr, "brp: unable to create directory scan thread\n");
+			break;
+		}
+		scan_thread_count++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * ============================================================================
+ * config management
+ * ============================================================================
+ */
+
+/* generation of the most recently parsed config */
+unsigned long config_generation = 0;
+
+void config_put(struct config *conf);
+
+void stratum_root_put(struct stratum_root *root)
+{
+	if (__atomic_sub_fetch(&root->refs, 1, __ATOMIC_SEQ_CST) > 0) {
+		return;
+	}
+	if (root->fd >= 0) {
+		close(root->fd);
+	}
+	free(root->name);
+	free(root);
+}
+
+/*
+ * Drops conf's references to its stratum roots, closing those no newer config
+ * uses, e.g. that of a stratum which has since been disabled, so that they do
+ * not keep it busy.  Called once nothing can resolve paths with conf anymore.
+ */
+void config_release_roots(struct config *conf)
+{
+	size_t i;
+
+	for (i = 0; i < conf->stratum_root_count; i++) {
+		stratum_root_put(conf->stratum_roots[i]);
+	}
+	free(conf->stratum_roots);
+	conf->stratum_roots = NULL;
+	conf->stratum_root_count = 0;
+}
+
+/*
+ * Adds root to conf's stratum roots.  Returns 0, or -1 if out of memory.
+ */
+int config_add_root(struct config *conf, struct stratum_root *root)
+{
+	struct stratum_root **roots = realloc(conf->stratum_roots, (conf->stratum_root_count + 1) * sizeof(struct stratum_root *));
+	if (!roots) {
+		return -1;
+	}
+	conf->stratum_roots = roots;
+	conf->stratum_roots[conf->stratum_root_count++] = root;
+	__atomic_add_fetch(&root->refs, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void config_free(struct config *conf)
+{
+	size_t i;
+
+	if (conf->name_indexes) {
+		for (i = 0; i < conf->out_item_count; i++) {
+			name_index_free(&conf->name_indexes[i]);
+		}
+		free(conf->name_indexes);
+	}
+
+	for (i = 0; i < conf->dir_times_count; i++) {
+		free(conf->dir_times[i].path);
+	}
+	free(conf->dir_times);
+
+	arena_free(&conf->arena);
+	if (conf->base) {
+		config_put(conf->base);
+	} else {
+		trie_free(&conf->trie_root);
+	}
+
+	config_release_roots(conf);
+	free(conf);
+}
+
+/*
+ * Returns an O_PATH file descriptor for the given stratum's root directory,
+ * opening it if this is the first time it was requested since the config was
+ * last parsed.  Returns -1 if it could not be opened, e.g. because the
+ * stratum is not enabled.
+ *
+ * Note that a descriptor for a directory does not pin mount points below it:
+ * anything a stratum later mounts within itself is still seen.  Anything
+ * mounted over the stratum root itself is only seen after a reparse, which
+ * brs triggers when enabling a stratum.
+ */
+int stratum_root_fd(struct config *conf, const char *stratum)
+{
+	size_t i;
+	for (i = 0; i < conf->stratum_root_count; i++) {
+		if (strcmp(conf->stratum_roots[i]->name, stratum) == 0) {
+			return conf->stratum_roots[i]->fd;
+		}
+	}
+
+	struct stratum_root *root = calloc(1, sizeof(struct stratum_root));
+	if (!root || ! (root->name = strdup(stratum)) ) {
+		free(root);
+		return -1;
+	}
+
+	/*
+	 * Only enabled strata are opened, so that a disabled stratum's root
+	 * is not kept busy by in_items which explicitly name it.
+	 */
+	char enabled_path[strlen(ENABLED_STRATA) + strlen(stratum) + 2];
+	strcpy(enabled_path, ENABLED_STRATA);
+	strcat(enabled_path, "/");
+	strcat(enabled_path, stratum);
+	struct stat stbuf;
+	char path[strlen(STRATA_ROOT) + strlen(stratum) + 1];
+	strcpy(path, STRATA_ROOT);
+	strcat(path, stratum);
+	if (stat(enabled_path, &stbuf) == 0 && S_ISREG(stbuf.st_mode)) {
+		root->fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		root->fd = -1;
+	}
+	if (config_add_root(conf, root) < 0) {
+		if (root->fd >= 0) {
+			close(root->fd);
+		}
+		free(root->name);
+		free(root);
+		return -1;
+	}
+	return root->fd;
+}
+
+/*
+ * Reads the whole file at path into a null-terminated malloc()'d buffer.
+ * Returns NULL on failure.
+ */
+char *read_file(const char *path)
+{
+	struct stat stbuf;
+	size_t len = 0;
+	ssize_t ret;
+	char *buf;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &stbuf) < 0 || ! (buf = malloc(stbuf.st_size + 1)) ) {
+		close(fd);
+		return NULL;
+	}
+	while (len < stbuf.st_size && (ret = read(fd, buf + len, stbuf.st_size - len)) != 0) {
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(buf);
+			close(fd);
+			return NULL;
+		}
+		len += ret;
+	}
+	buf[len] = '\0';
+	close(fd);
+	return buf;
+}
+
+int qsort_strcmp_wrap(const void *a, const void *b);
+
+/*
+ * Populates strata with the names of the enabled strata, sorted, as with
+ * `bri -l`: the regular files (not symlinks, which are aliases) in
+ * ENABLED_STRATA.  Returns the number found.  Strings and the array are
+ * allocated from arena.
+ */
+size_t enabled_strata(struct arena *arena, char ***strata)
+{
+	size_t count = 0;
+	size_t allocated = 0;
+	char **array = NULL;
+	struct stat stbuf;
+	struct dirent *dir;
+
+	*strata = NULL;
+	DIR *d = opendir(ENABLED_STRATA);
+	if (!d) {
+		return 0;
+	}
+
+	while ( (dir = readdir(d)) ) {
+		if (dir->d_name[0] == '.') {
+			continue;
+		}
+		if (fstatat(dirfd(d), dir->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0 ||
+				!S_ISREG(stbuf.st_mode)) {
+			continue;
+		}
+		if (count == allocated) {
+			allocated = allocated > 0 ? allocated * 2 : 16;
+			char **new_array = arena_alloc(arena, allocated * sizeof(char *));
+			if (!new_array) {
+				break;
+			}
+			if (count > 0) {
+				memcpy(new_array, array, count * sizeof(char *));
+			}
+			array = new_array;
+		}
+		if ( (array[count] = arena_strndup(arena, dir->d_name, strlen(dir->d_name))) ) {
+			count++;
+		}
+	}
+	closedir(d);
+
+	if (count > 1) {
+		qsort(array, count, sizeof(char *), qsort_strcmp_wrap);
+	}
+	*strata = array;
+	return count;
+}
+
+/*
+ * Value on the right side of an item's equals sign, e.g. "init:/sbin/init".
+ */
+struct conf_value {
+	/* NULL if no stratum was specified */
+	char *stratum;
+	char *path;
+	struct conf_value *next;
+};
+
+struct conf_item {
+	char *path;
+	int file_type;
+	int filter;
+	struct conf_value *values;
+	struct conf_item *next;
+};
+
+/*
+ * Splits off the next field from *line as awk does with FS="[=, ]+",
+ * null-terminating it in place.  Returns NULL once there are none left.
+ */
+char *next_field(char **line)
+{
+	char *start = *line;
+	if (!start) {
+		return NULL;
+	}
+	char *end = start + strcspn(start, "=, ");
+	if (*end == '\0') {
+		*line = NULL;
+	} else {
+		*end = '\0';
+		end++;
+		*line = end + strspn(end, "=, ");
+		if (**line == '\0') {
+			*line = NULL;
+		}
+	}
+	return start;
+}
+
+int is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+}
+
+void config_error(const char *msg)
+{
+	fprintf(stderr, "brp: Failed to parse config: %s\n", msg);
+}
+
+/*
+ * Populates in_item for path, which should not have a trailing slash, within
+ * stratum.  Returns 0 if out of memory.
+ */
+int in_item_init(struct config *conf, struct in_item *in_item, const char *stratum, const char *path, size_t path_len)
+{
+	in_item->stratum_len = strlen(stratum);
+	in_item->stratum = arena_strndup(&conf->arena, stratum, in_item->stratum_len);
+	in_item->stratum_path_len = path_len;
+	in_item->stratum_path = arena_strndup(&conf->arena, path, path_len);
+	in_item->full_path_len = STRATA_ROOT_LEN + in_item->stratum_len + path_len;
+	in_item->full_path = arena_alloc(&conf->arena, in_item->full_path_len + 1);
+	if (!in_item->stratum || !in_item->stratum_path || !in_item->full_path) {
+		return 0;
+	}
+	strcpy(in_item->full_path, STRATA_ROOT);
+	strcat(in_item->full_path, in_item->stratum);
+	strcat(in_item->full_path, in_item->stratum_path);
+
+	in_item->root_fd = stratum_root_fd(conf, in_item->stratum);
+	return 1;
+}
+
+/*
+ * Returns a new config with out_items populated from CONFIG and the list of
+ * enabled strata.
+ *
+ * For each item, the values which name a specific stratum come first, in the
+ * order they are listed.  Then, for each enabled stratum in order, each value
+ * which does not name a stratum.  Strata are ordered as listed in the
+ * [stratum-order] section, followed by any other enabled strata by name.
+ *
+ * Returns NULL and sets errno if the config cannot be read, having said why.
+ */
+struct config *parse_config()
+{
+	/*
+	 * Ensure we're using a root-modifiable-only configuration file, just in case.
+	 */
+	if (!config_trusted && !check_config_secure(CONFIG)) {
+		fprintf(stderr, "brp: config file at %s is not secure, refusing to use it.\n", CONFIG);
+		errno = EACCES;
+		return NULL;
+	}
+
+	/* temporary allocations, freed once out_items is populated */
+	struct arena scratch = { NULL };
+	struct config *conf = NULL;
+	int err;
+
+	char *contents = read_file(CONFIG);
+	if (!contents) {
+		config_error("unable to read config file");
+		goto fail;
+	}
+
+	char *line;
+	char *next_line;
+	char **existing;
+	size_t existing_count = enabled_strata(&scratch, &existing);
+
+	/* strata in priority order; at most every enabled stratum */
+	char **strata = arena_alloc(&scratch, (existing_count + 1) * sizeof(char *));
+	char *listed = arena_alloc(&scratch, existing_count + 1);
+	if (!strata || !listed) {
+		config_error("out of memory");
+		goto fail;
+	}
+	memset(listed, 0, existing_count + 1);
+	size_t stratum_count = 0;
+
+	/* [stratum-order] as written, at most one entry per line */
+	size_t line_count = 1;
+	for (line = contents; *line; line++) {
+		if (*line == '\n') {
+			line_count++;
+		}
+	}
+	char **order = arena_alloc(&scratch, line_count * sizeof(char *));
+	if (!order) {
+		config_error("out of memory");
+		goto fail;
+	}
+	size_t order_count = 0;
+
+	struct conf_item *items = NULL;
+	struct conf_item **items_tail = &items;
+	size_t item_count = 0;
+
+	const char *section = "";
+	size_t i, j;
+
+	for (line = contents; line; line = next_line) {
+		if ( (next_line = strchr(line, '\n')) ) {
+			*next_line++ = '\0';
+		}
+
+		/* empty line or comment, skip */
+		char *start = line;
+		while (is_blank(*start)) {
+			start++;
+		}
+		if (*start == '\0' || *start == '#' || *start == ';') {
+			continue;
+		}
+
+		/* section header */
+		if (*start == '[') {
+			char *end = start + strlen(start);
+			while (end > start && is_blank(end[-1])) {
+				end--;
+			}
+			if (end - start >= 2 && end[-1] == ']' && !memchr(start + 1, ']', end - start - 2)) {
+				end[-1] = '\0';
+				section = start + 1;
+				continue;
+			}
+		}
+
+		if (strcmp(section, "stratum-order") == 0) {
+			for (i = 0; i < order_count && strcmp(order[i], line) != 0; i++) {
+			}
+			if (i == order_count) {
+				order[order_count++] = line;
+			}
+			for (i = 0; i < existing_count; i++) {
+				if (strcmp(line, existing[i]) == 0 && !listed[i]) {
+					listed[i] = 1;
+					strata[stratum_count++] = existing[i];
+					break;
+				}
+			}
+			continue;
+		}
+
+		struct conf_item *item;
+		if (strcmp(section, "pass") == 0) {
+			item = arena_alloc(&scratch, sizeof(struct conf_item));
+			if (item) {
+				item->filter = FILTER_PASS;
+			}
+		} else if (strcmp(section, "brc-wrap") == 0) {
+			item = arena_alloc(&scratch, sizeof(struct conf_item));
+			if (item) {
+				item->filter = FILTER_BRC_WRAP;
+			}
+		} else if (strcmp(section, "exec-filter") == 0) {
+			item = arena_alloc(&scratch, sizeof(struct conf_item));
+			if (item) {
+				item->filter = FILTER_EXEC;
+			}
+		} else {
+			continue;
+		}
+		if (!item) {
+			config_error("out of memory");
+			goto fail;
+		}
+
+		char *fields = line;
+		char *field = next_field(&fields);
+		size_t len = strlen(field);
+		if (len > 0 && field[len-1] == '/') {
+			field[len-1] = '\0';
+			item->file_type = FILE_TYPE_DIRECTORY;
+		} else {
+			item->file_type = FILE_TYPE_NORMAL;
+		}
+		item->path = field;
+		item->values = NULL;
+		item->next = NULL;
+
+		struct conf_value **values_tail = &item->values;
+		while ( (field = next_field(&fields)) ) {
+			struct conf_value *value = arena_alloc(&scratch, sizeof(struct conf_value));
+			if (!value) {
+				config_error("out of memory");
+				goto fail;
+			}
+			/*
+			 * An empty prefix (":/path") is treated as unprefixed.
+			 */
+			char *colon = strchr(field, ':');
+			if (colon && colon != field) {
+				*colon = '\0';
+				value->stratum = field;
+				value->path = colon + 1;
+			} else {
+				value->stratum = NULL;
+				value->path = colon ? colon + 1 : field;
+			}
+			value->next = NULL;
+			*values_tail = value;
+			values_tail = &value->next;
+		}
+
+		*items_tail = item;
+		items_tail = &item->next;
+		item_count++;
+	}
+
+	/* enabled strata not in [stratum-order] go last */
+	for (i = 0; i < existing_count; i++) {
+		if (!listed[i]) {
+			strata[stratum_count++] = existing[i];
+		}
+	}
+
+	/*
+	 * Populate out_items.
+	 */
+	if (! (conf = calloc(1, sizeof(struct config))) ) {
+		config_error("out of memory");
+		goto fail;
+	}
+	conf->out_items = arena_alloc(&conf->arena, (item_count + 1) * sizeof(struct out_item));
+	conf->strata = arena_alloc(&conf->arena, (stratum_count + 1) * sizeof(char *));
+	conf->order = arena_alloc(&conf->arena, (order_count + 1) * sizeof(char *));
+	if (!conf->out_items || !conf->strata || !conf->order) {
+		config_error("out of memory");
+		goto fail;
+	}
+	for (i = 0; i < stratum_count; i++) {
+		if (! (conf->strata[i] = arena_strndup(&conf->arena, strata[i], strlen(strata[i]))) ) {
+			config_error("out of memory");
+			goto fail;
+		}
+	}
+	conf->stratum_count = stratum_count;
+	for (i = 0; i < order_count; i++) {
+		if (! (conf->order[i] = arena_strndup(&conf->arena, order[i], strlen(order[i]))) ) {
+			config_error("out of memory");
+			goto fail;
+		}
+	}
+	conf->order_count = order_count;
+
+	struct conf_item *item;
+	for (item = items; item; item = item->next) {
+		struct out_item *out_item = &conf->out_items[conf->out_item_count++];
+		struct conf_value *value;
+
+		out_item->path = arena_strndup(&conf->arena, item->path, strlen(item->path));
+		out_item->path_len = strlen(item->path);
+		out_item->file_type = item->file_type;
+		out_item->filter = item->filter;
+
+		out_item->prefixed_count = 0;
+		out_item->unprefixed_count = 0;
+		for (value = item->values; value; value = value->next) {
+			/* strip trailing slash */
+			size_t path_len = strlen(value->path);
+			if (path_len > 0 && value->path[path_len-1] == '/') {
+				value->path[path_len-1] = '\0';
+			}
+			if (value->stratum) {
+				out_item->prefixed_count++;
+			} else {
+				out_item->unprefixed_count++;
+			}
+		}
+		out_item->in_item_count = 0;
+		out_item->in_items = arena_alloc(&conf->arena,
+				(out_item->prefixed_count + out_item->unprefixed_count * stratum_count + 1) * sizeof(struct in_item));
+		out_item->unprefixed_paths = arena_alloc(&conf->arena, (out_item->unprefixed_count + 1) * sizeof(char *));
+		if (!out_item->path || !out_item->in_items || !out_item->unprefixed_paths) {
+			config_error("out of memory");
+			goto fail;
+		}
+
+		/* first pass for explicit strata, then each stratum in order */
+		j = 0;
+		for (i = 0; i <= stratum_count; i++) {
+			for (value = item->values; value; value = value->next) {
+				const char *stratum;
+				if (i == 0 && value->stratum) {
+					stratum = value->stratum;
+				} else if (i > 0 && !value->stratum) {
+					stratum = strata[i-1];
+				} else {
+					continue;
+				}
+
+				struct in_item *in_item = &out_item->in_items[out_item->in_item_count++];
+				if (!in_item_init(conf, in_item, stratum, value->path, strlen(value->path))) {
+					config_error("out of memory");
+					goto fail;
+				}
+				if (i == 1) {
+					out_item->unprefixed_paths[j++] = in_item->stratum_path;
+				}
+			}
+		}
+		/* no strata to have expanded them for */
+		for (value = item->values; j < out_item->unprefixed_count; value = value->next) {
+			if (!value->stratum &&
+					! (out_item->unprefixed_paths[j++] = arena_strndup(&conf->arena, value->path, strlen(value->path))) ) {
+				config_error("out of memory");
+				goto fail;
+			}
+		}
+	}
+
+	arena_free(&scratch);
+	free(contents);
+
+	/*
+	 * Index out_items by path component.
+	 */
+	for (j = 0; j < conf->out_item_count; j++) {
+		if (!trie_insert(conf, j)) {
+			fprintf(stderr, "brp: Failed to index config\n");
+			config_free(conf);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	conf->generation = ++config_generation;
+	clock_gettime(CLOCK_REALTIME, &conf->created);
+	return conf;
+
+fail:
+	err = errno;
+	if (conf) {
+		config_free(conf);
+	}
+	arena_free(&scratch);
+	free(contents);
+	errno = err;
+	return NULL;
+}
+
+/*
+ * What changed between two configs when a stratum was enabled or disabled,
+ * for carrying lookup cache entries over from one to the other.
+ */
+struct stratum_change {
+	struct config *old;
+	struct config *conf;
+	/*
+	 * For each out_item, where each of its old in_items is in the new
+	 * config, or -1 if it was replaced or removed.  NULL if the out_item
+	 * was unaffected.
+	 */
+	ssize_t **remap;
+	/*
+	 * For each out_item, the index of its first new in_item for the
+	 * stratum, or -1 if it has none.
+	 */
+	ssize_t *first_changed;
+	/* the above are allocated from this */
+	struct arena arena;
+};
+
+/*
+ * Returns 1 if the stratum named name is stratum or an alias of it.
+ * stratum_stat is that of stratum's root, or NULL if unavailable.
+ */
+int stratum_is(const char *name, const char *stratum, const struct stat *stratum_stat)
+{
+	if (strcmp(name, stratum) == 0) {
+		return 1;
+	}
+	if (!stratum_stat) {
+		return 0;
+	}
+
+	struct stat stbuf;
+	char path[strlen(STRATA_ROOT) + strlen(name) + 1];
+	strcpy(path, STRATA_ROOT);
+	strcat(path, name);
+	return stat(path, &stbuf) == 0 &&
+		stbuf.st_dev == stratum_stat->st_dev &&
+		stbuf.st_ino == stratum_stat->st_ino;
+}
+
+/*
+ * Returns 1 if name is one of the count strings in list.
+ */
+int str_in(char **list, size_t count, const char *name)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if (strcmp(list[i], name) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns a new config derived from old with stratum enabled or disabled,
+ * without rereading CONFIG.  Only the in_items for that stratum, or an alias
+ * of it, are created or removed, in priority order; everything else is shared
+ * with old.  Enabling an already enabled stratum refreshes its in_items, e.g.
+ * to see something newly mounted over its root.
+ *
+ * As with a full reparse, whether the stratum is enabled is taken from
+ * ENABLED_STRATA, and so it must agree with enable.
+ *
+ * Populates change for cache_migrate(); the caller should arena_free() its
+ * arena once done.  Returns NULL and sets errno on failure.
+ */
+struct config *config_change_stratum(struct config *old, const char *stratum, int enable, struct stratum_change *change)
+{
+	size_t i, j, k, u;
+	struct stat stbuf;
+
+	memset(change, 0, sizeof(struct stratum_change));
+	change->old = old;
+
+	char enabled_path[strlen(ENABLED_STRATA) + strlen(stratum) + 2];
+	strcpy(enabled_path, ENABLED_STRATA);
+	strcat(enabled_path, "/");
+	strcat(enabled_path, stratum);
+	if ((lstat(enabled_path, &stbuf) == 0 && S_ISREG(stbuf.st_mode)) != enable) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	char root_path[strlen(STRATA_ROOT) + strlen(stratum) + 1];
+	strcpy(root_path, STRATA_ROOT);
+	strcat(root_path, stratum);
+	struct stat root_stat;
+	struct stat *root_statp = stat(root_path, &root_stat) == 0 ? &root_stat : NULL;
+
+	struct config *conf = calloc(1, sizeof(struct config));
+	if (!conf) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	__atomic_add_fetch(&old->refs, 1, __ATOMIC_SEQ_CST);
+	conf->base = old;
+	conf->depth = old->depth + 1;
+
+	/*
+	 * The other strata's roots are shared; the changed stratum's is
+	 * reopened if it is still referenced, and otherwise closed once old
+	 * is no longer in use.
+	 */
+	for (i = 0; i < old->stratum_root_count; i++) {
+		if (!stratum_is(old->stratum_roots[i]->name, stratum, root_statp) &&
+				config_add_root(conf, old->stratum_roots[i]) < 0) {
+			goto oom;
+		}
+	}
+	conf->trie_root = old->trie_root;
+	conf->order = old->order;
+	conf->order_count = old->order_count;
+
+	/*
+	 * Enabled strata in priority order: those listed in [stratum-order],
+	 * then any others by name.
+	 */
+	char *name = arena_strndup(&conf->arena, stratum, strlen(stratum));
+	conf->strata = arena_alloc(&conf->arena, (old->stratum_count + 2) * sizeof(char *));
+	ssize_t *old_index = arena_alloc(&change->arena, (old->stratum_count + 2) * sizeof(ssize_t));
+	if (!name || !conf->strata || !old_index) {
+		goto oom;
+	}
+	for (i = 0; i < old->order_count; i++) {
+		if (strcmp(old->order[i], stratum) == 0) {
+			if (enable) {
+				conf->strata[conf->stratum_count++] = name;
+			}
+		} else if (str_in(old->strata, old->stratum_count, old->order[i])) {
+			conf->strata[conf->stratum_count++] = old->order[i];
+		}
+	}
+	size_t listed = conf->stratum_count;
+	for (i = 0; i < old->stratum_count; i++) {
+		if (strcmp(old->strata[i], stratum) != 0 &&
+				!str_in(old->order, old->order_count, old->strata[i])) {
+			conf->strata[conf->stratum_count++] = old->strata[i];
+		}
+	}
+	if (enable && !str_in(old->order, old->order_count, stratum)) {
+		conf->strata[conf->stratum_count++] = name;
+	}
+	qsort(conf->strata + listed, conf->stratum_count - listed, sizeof(char *), qsort_strcmp_wrap);
+
+	/* where each stratum's in_items were in old, -1 for the changed one */
+	for (k = 0; k < conf->stratum_count; k++) {
+		old_index[k] = -1;
+		for (i = 0; conf->strata[k] != name && i < old->stratum_count; i++) {
+			if (strcmp(old->strata[i], conf->strata[k]) == 0) {
+				old_index[k] = i;
+				break;
+			}
+		}
+	}
+
+	conf->out_items = arena_alloc(&conf->arena, (old->out_item_count + 1) * sizeof(struct out_item));
+	change->remap = arena_alloc(&change->arena, (old->out_item_count + 1) * sizeof(ssize_t *));
+	change->first_changed = arena_alloc(&change->arena, (old->out_item_count + 1) * sizeof(ssize_t));
+	if (!conf->out_items || !change->remap || !change->first_changed) {
+		goto oom;
+	}
+	memcpy(conf->out_items, old->out_items, old->out_item_count * sizeof(struct out_item));
+	conf->out_item_count = old->out_item_count;
+
+	for (i = 0; i < conf->out_item_count; i++) {
+		struct out_item *old_item = &old->out_items[i];
+		struct out_item *item = &conf->out_items[i];
+		size_t prefixed = old_item->prefixed_count;
+		size_t unprefixed = old_item->unprefixed_count;
+
+		change->remap[i] = NULL;
+		change->first_changed[i] = -1;
+
+		char matches[prefixed + 1];
+		int affected = unprefixed > 0;
+		for (j = 0; j < prefixed; j++) {
+			matches[j] = stratum_is(old_item->in_items[j].stratum, stratum, root_statp);
+			affected |= matches[j];
+		}
+		if (!affected) {
+			continue;
+		}
+
+		item->in_item_count = prefixed + unprefixed * conf->stratum_count;
+		item->in_items = arena_alloc(&conf->arena, (item->in_item_count + 1) * sizeof(struct in_item));
+		ssize_t *remap = arena_alloc(&change->arena, (old_item->in_item_count + 1) * sizeof(ssize_t));
+		if (!item->in_items || !remap) {
+			goto oom;
+		}
+		for (j = 0; j < old_item->in_item_count; j++) {
+			remap[j] = -1;
+		}
+		change->remap[i] = remap;
+
+		ssize_t first = -1;
+		for (j = 0; j < prefixed; j++) {
+			item->in_items[j] = old_item->in_items[j];
+			if (matches[j]) {
+				item->in_items[j].root_fd = stratum_root_fd(conf, item->in_items[j].stratum);
+				if (first < 0) {
+					first = j;
+				}
+			} else {
+				remap[j] = j;
+			}
+		}
+		for (k = 0; k < conf->stratum_count; k++) {
+			for (u = 0; u < unprefixed; u++) {
+				size_t to = prefixed + k * unprefixed + u;
+				if (old_index[k] < 0) {
+					const char *path = old_item->unprefixed_paths[u];
+					if (!in_item_init(conf, &item->in_items[to], name, path, strlen(path))) {
+						goto oom;
 					}
+					if (first < 0) {
+						first = to;
+					}
+				} else {
+					size_t from = prefixed + old_index[k] * unprefixed + u;
+					item->in_items[to] = old_item->in_items[from];
+					remap[from] = to;
+				}
+			}
+		}
+		change->first_changed[i] = first;
+	}
+
+	conf->generation = ++config_generation;
+	clock_gettime(CLOCK_REALTIME, &conf->created);
+	change->conf = conf;
+	return conf;
+
+oom:
+	config_free(conf);
+	arena_free(&change->arena);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/*
+ * Returns 1 if, in the config change->conf, corresponding_scan() of path
+ * would consider any of the changed in_items before in_item within out_item,
+ * having matched as match.  If match is negative, returns 1 if it would
+ * consider any changed in_items at all.
+ */
+int stratum_change_precedes(struct stratum_change *change, const char *path, int match, size_t out_item, size_t in_item)
+{
+	struct trie_node *containing[component_count(path) + 1];
+	size_t containing_count;
+	struct trie_node *node = trie_walk(change->conf, path, containing, &containing_count);
+	ssize_t *first = change->first_changed;
+	ssize_t k;
+	size_t i;
+
+	/* one spare, as C has no zero-length arrays */
+	size_t cursors[containing_count + 1];
+	memset(cursors, 0, sizeof(cursors));
+	while ( (k = next_containing(containing, cursors, containing_count)) >= 0) {
+		if (match == MATCH_CONTAINED && k == out_item) {
+			return first[k] >= 0 && first[k] < in_item;
+		} else if (first[k] >= 0) {
+			return 1;
+		}
+	}
+	if (!node) {
+		return match >= 0;
+	}
+
+	for (i = 0; i < node->item_count; i++) {
+		k = node->items[i];
+		if (match == MATCH_ITEM && k == out_item) {
+			return first[k] >= 0 && first[k] < in_item;
+		} else if (first[k] >= 0) {
+			return 1;
+		}
+	}
+
+	for (i = 0; i < node->below_count; i++) {
+		k = node->below[i];
+		if (match == MATCH_VIRTUAL && k == out_item) {
+			return first[k] >= 0 && first[k] < in_item;
+		} else if (first[k] >= 0) {
+			return 1;
+		}
+	}
+
+	/* not found where expected; err on the side of dropping it */
+	return match >= 0;
+}
+
+/*
+ * node_migrate() callback for a stratum_change, and the part of
+ * stratum_change_keep() for successful results.  A resolution is kept if its
+ * in_item is still there and no new in_item would be found before it.
+ */
+int stratum_change_remap(const char *path, int match, struct out_item **out_item, struct in_item **in_item, void *arg)
+{
+	struct stratum_change *change = arg;
+
+	size_t i = *out_item - change->old->out_items;
+	size_t j = *in_item - change->old->out_items[i].in_items;
+	ssize_t to = change->remap[i] ? change->remap[i][j] : (ssize_t)j;
+	if (to < 0 || stratum_change_precedes(change, path, match, i, to)) {
+		return 0;
+	}
+	*out_item = &change->conf->out_items[i];
+	*in_item = &(*out_item)->in_items[to];
+	return 1;
+}
+
+/*
+ * cache_migrate() callback for a stratum_change.  Results which could not have
+ * been affected by the change are kept.
+ */
+int stratum_change_keep(struct cache_entry *entry, void *arg)
+{
+	if (entry->ret < 0) {
+		return !stratum_change_precedes(arg, entry->path, -1, 0, 0);
+	}
+	return stratum_change_remap(entry->path, entry->ret, &entry->out_item, &entry->in_item, arg);
+}
+
+/*
+ * invalidate_kernel_cache_except() callback for a stratum_change.  A miss
+ * only becomes a hit if the stratum brought new in_items for it.
+ */
+int stratum_change_affects_miss(const char *path, void *arg)
+{
+	return stratum_change_precedes(arg, path, -1, 0, 0);
+}
+
+/*
+ * Returns 1 if listing path, as listing_scan() does, reads any out_item whose
+ * in_items were added or removed by the change.
+ */
+int stratum_change_lists(struct stratum_change *change, const char *path)
+{
+	struct trie_node *containing[component_count(path) + 1];
+	size_t containing_count;
+	struct trie_node *node = trie_walk(change->conf, path, containing, &containing_count);
+	ssize_t k;
+
+	if (node && node->dir_item_count > 0) {
+		containing[containing_count++] = node;
+	}
+	size_t cursors[containing_count + 1];
+	memset(cursors, 0, sizeof(cursors));
+	while ( (k = next_containing(containing, cursors, containing_count)) >= 0) {
+		if (change->remap[k]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Return a pointer to a string describing the current configuration.  Up to
+ * the calling program to free() it.  This is used when /reparse_config is read
+ * to show the current configuration.  It is useful for debugging.
+ */
+char* config_contents(struct config *conf)
+{
+	int i, j;
+
+	size_t len = 0;
+	for (i = 0; i < conf->out_item_count; i++) {
+		len += strlen("path = ");
+		len += strlen(conf->out_items[i].path);
+		len += strlen("\n");
+
+		len += strlen("type = ");
+		switch (conf->out_items[i].file_type) {
+		case FILE_TYPE_NORMAL:
+			len += strlen("normal");
+			break;
+		case FILE_TYPE_DIRECTORY:
+			len += strlen("directory");
+			break;
+		}
+		len += strlen("\n");
+
+		len += strlen("filter = ");
+		switch (conf->out_items[i].filter) {
+		case FILTER_PASS:
+			len += strlen("pass");
+			break;
+		case FILTER_BRC_WRAP:
+			len += strlen("brc-wrap");
+			break;
+		case FILTER_EXEC:
+			len += strlen("exec");
+			break;
+		}
+		len += strlen("\n");
+
+		for (j = 0; j < conf->out_items[i].in_item_count; j++) {
+			len += strlen("  stratum = ");
+			len += strlen(conf->out_items[i].in_items[j].stratum);
+			len += strlen("\n");
+			len += strlen("  stratum_path = ");
+			len += strlen(conf->out_items[i].in_items[j].stratum_path);
+			len += strlen("\n");
+			len += strlen("  full_path = ");
+			len += strlen(conf->out_items[i].in_items[j].full_path);
+			len += strlen("\n");
+		}
+	}
+	len += strlen("\n");
+
+	char cache_str[128];
+	pthread_mutex_lock(&cache_lock);
+	snprintf(cache_str, sizeof(cache_str), "cache_hits = %llu\ncache_misses = %llu\n",
+			(unsigned long long) stat_sum(STAT_LOOKUP_HIT),
+			(unsigned long long) stat_sum(STAT_LOOKUP_MISS));
+	pthread_mutex_unlock(&cache_lock);
+	len += strlen(cache_str);
+
+	char *config_str = malloc((len+1) * sizeof(char));
+	if (!config_str) {
+		return NULL;
+	}
+	config_str[0] = '\0';
+
+	for (i = 0; i < conf->out_item_count; i++) {
+		strcat(config_str, "path = ");
+		strcat(config_str, conf->out_items[i].path);
+		strcat(config_str, "\n");
+
+		strcat(config_str, "type = ");
+		switch (conf->out_items[i].file_type) {
+		case FILE_TYPE_NORMAL:
+			strcat(config_str, "normal");
+			break;
+		case FILE_TYPE_DIRECTORY:
+			strcat(config_str, "directory");
+			break;
+		}
+		strcat(config_str, "\n");
+
+		strcat(config_str, "filter = ");
+		switch (conf->out_items[i].filter) {
+		case FILTER_PASS:
+			strcat(config_str, "pass");
+			break;
+		case FILTER_BRC_WRAP:
+			strcat(config_str, "brc-wrap");
+			break;
+		case FILTER_EXEC:
+			strcat(config_str, "exec");
+			break;
+		}
+		strcat(config_str, "\n");
+
+		for (j = 0; j < conf->out_items[i].in_item_count; j++) {
+			strcat(config_str, "  stratum = ");
+			strcat(config_str, conf->out_items[i].in_items[j].stratum);
+			strcat(config_str, "\n");
+			strcat(config_str, "  stratum_path = ");
+			strcat(config_str, conf->out_items[i].in_items[j].stratum_path);
+			strcat(config_str, "\n");
+			strcat(config_str, "  full_path = ");
+			strcat(config_str, conf->out_items[i].in_items[j].full_path);
+			strcat(config_str, "\n");
+		}
+	}
+	strcat(config_str, cache_str);
+
+	return config_str;
+}
+
+/*
+ * ============================================================================
+ * config snapshots
+ * ============================================================================
+ *
+ * Requests are served by multiple threads while the config may be reparsed
+ * at any time.  Rather than locking the config, each request takes a
+ * reference to whichever config is current as it starts with config_get()
+ * and drops it with config_put() once done.  A reparse builds an entirely new
+ * config off to the side and swaps it in with config_publish().  Requests
+ * already in flight finish with the config they started with, which is freed
+ * once the last of them drops its reference.
+ */
+
+struct config *current_config;
+
+/* threads between loading current_config and referencing it */
+unsigned long config_acquiring = 0;
+
+/*
+ * Takes another reference to a config already referenced by the caller.
+ */
+void config_ref(struct config *conf)
+{
+	__atomic_add_fetch(&conf->users, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&conf->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+struct config *config_get()
+{
+	struct config *conf;
+
+	__atomic_add_fetch(&config_acquiring, 1, __ATOMIC_SEQ_CST);
+	conf = __atomic_load_n(&current_config, __ATOMIC_SEQ_CST);
+	config_ref(conf);
+	__atomic_sub_fetch(&config_acquiring, 1, __ATOMIC_SEQ_CST);
+
+	return conf;
+}
+
+void config_put(struct config *conf)
+{
+	/*
+	 * A config which is no longer current never gains users again, so
+	 * this happens at most once.
+	 */
+	if (__atomic_sub_fetch(&conf->users, 1, __ATOMIC_SEQ_CST) == 0) {
+		config_release_roots(conf);
+	}
+	if (__atomic_sub_fetch(&conf->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+		config_free(conf);
+	}
+}
+
+/*
+ * Make conf the current config.  Only one thread may publish at a time.
+ */
+void config_publish(struct config *conf)
+{
+	struct config *old;
+
+	conf->users = 1;
+	conf->refs = 1;
+	old = __atomic_exchange_n(&current_config, conf, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Another thread may have loaded the old pointer in config_get() but
+	 * not yet referenced it.  Any such thread is only a few instructions
+	 * away from doing so; wait for it before dropping the reference which
+	 * kept the old config alive while it was current.
+	 */
+	while (__atomic_load_n(&config_acquiring, __ATOMIC_SEQ_CST) != 0) {
+		sched_yield();
+	}
+	if (old) {
+		config_put(old);
+	}
+}
+
+/*
+ * ============================================================================
+ * directory listing cache
+ * ============================================================================
+ *
+ * Listing a directory such as /bin means listing the corresponding directory
+ * in every stratum, then merging them.  The result is kept and shared with
+ * later opens of the same directory by the same user until one of the
+ * backing directories changes.  Whether any have is told by their identity
+ * and ctime, which changes whenever an entry is added, removed or renamed or
+ * the directory's permissions change.  The filesystem watcher also drops
+ * listings as it notices changes.
+ */
+
+#define LISTING_CACHE_MAX 64
+
+/*
+ * A backing directory as of when it was listed.
+ */
+struct listing_stamp {
+	struct in_item *in_item;
+	/* where in the listing's path the in_item's tail starts */
+	size_t tail_offset;
+	/* 0, or -errno if it could not be opened */
+	int ret;
+	dev_t dev;
+	ino_t ino;
+	mode_t mode;
+	struct timespec ctime;
+};
+
+struct listing {
+	/* key; as with the lookup cache, what is listed depends on the caller */
+	char *path;
+	unsigned long hash;
+	uid_t uid;
+	gid_t gid;
+	unsigned long groups;
+	unsigned long generation;
+	/* sorted, without duplicates */
+	char **names;
+	size_t name_count;
+	/* whether any backing directory was found */
+	int found;
+	/* whether it may be reused at all */
+	int cacheable;
+	struct listing_stamp *stamps;
+	size_t stamp_count;
+	/* listing whose names this one extends and holds a reference to */
+	struct listing *base;
+	/* path, stamps and any names not from base */
+	struct arena arena;
+	/* open directories using this listing, plus one while cached */
+	unsigned long refs;
+	unsigned long last_used;
+};
+
+/* protects everything below */
+pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct listing *listings[LISTING_CACHE_MAX];
+size_t listing_count = 0;
+unsigned long listing_clock = 0;
+
+void listing_put(struct listing *listing)
+{
+	if (__atomic_sub_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	if (listing->base) {
+		listing_put(listing->base);
+	}
+	free(listing->names);
+	arena_free(&listing->arena);
+	free(listing);
+}
+
+int qsort_strcmp_wrap(const void *a, const void *b)
+{
+	return strcmp(*((char**) a), *((char**) b));
+}
+
+/*
+ * Sorts the listing's names and removes duplicates.
+ */
+void listing_sort(struct listing *listing)
+{
+	size_t i, j;
+
+	if (listing->name_count < 2) {
+		return;
+	}
+	qsort(listing->names, listing->name_count, sizeof(char *), qsort_strcmp_wrap);
+	for (i = 1, j = 1; i < listing->name_count; i++) {
+		if (strcmp(listing->names[i], listing->names[j-1]) != 0) {
+			listing->names[j++] = listing->names[i];
+		}
+	}
+	listing->name_count = j;
+}
+
+/*
+ * Appends name, which must outlive the listing.  Returns 0 or -ENOMEM.
+ */
+int listing_append(struct listing *listing, char *name, size_t *allocated)
+{
+	if (listing->name_count == *allocated) {
+		size_t new_allocated = *allocated > 0 ? *allocated * 2 : 64;
+		char **names = realloc(listing->names, new_allocated * sizeof(char *));
+		if (!names) {
+			return -ENOMEM;
+		}
+		listing->names = names;
+		*allocated = new_allocated;
+	}
+	listing->names[listing->name_count++] = name;
+	return 0;
+}
+
+/*
+ * Returns a reference to the cached listing for the given key, if any.  It
+ * may be stale; see list_directory().
+ */
+struct listing *listing_cache_get(const char *path, unsigned long hash, uid_t uid, gid_t gid, unsigned long generation)
+{
+	struct listing *ret = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&listing_lock);
+	for (i = 0; i < listing_count; i++) {
+		struct listing *listing = listings[i];
+		if (listing->hash == hash && listing->uid == uid && listing->gid == gid &&
+				listing->groups == caller_groups &&
+				listing->generation == generation && strcmp(listing->path, path) == 0) {
+			listing->last_used = ++listing_clock;
+			__atomic_add_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL);
+			ret = listing;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&listing_lock);
+	return ret;
+}
+
+/*
+ * Expects listing_lock to be held.
+ */
+void listing_cache_remove_at(size_t i)
+{
+	listing_put(listings[i]);
+	listings[i] = listings[--listing_count];
+}
+
+/*
+ * Caches listing, replacing any other listing for the same key and evicting
+ * the least recently used one if full.
+ */
+void listing_cache_add(struct listing *listing)
+{
+	size_t lru = 0;
+	size_t i;
+
+	pthread_mutex_lock(&listing_lock);
+	for (i = 0; i < listing_count; i++) {
+		struct listing *other = listings[i];
+		if (other->hash == listing->hash && other->uid == listing->uid &&
+				other->gid == listing->gid && other->groups == listing->groups &&
+				strcmp(other->path, listing->path) == 0) {
+			listing_cache_remove_at(i);
+			break;
+		}
+	}
+	if (listing_count == LISTING_CACHE_MAX) {
+		for (i = 1; i < listing_count; i++) {
+			if (listings[i]->last_used < listings[lru]->last_used) {
+				lru = i;
+			}
+		}
+		listing_cache_remove_at(lru);
+	}
+	listing->last_used = ++listing_clock;
+	__atomic_add_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL);
+	listings[listing_count++] = listing;
+	pthread_mutex_unlock(&listing_lock);
+}
+
+/*
+ * Drops listing from the cache, if it is still there.
+ */
+void listing_cache_remove(struct listing *listing)
+{
+	size_t i;
+	pthread_mutex_lock(&listing_lock);
+	for (i = 0; i < listing_count; i++) {
+		if (listings[i] == listing) {
+			listing_cache_remove_at(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&listing_lock);
+}
+
+/*
+ * Drops any cached listings of path, for all users.
+ */
+void listing_invalidate(const char *path)
+{
+	unsigned long hash = hash_str(path);
+	size_t i;
+
+	pthread_mutex_lock(&listing_lock);
+	for (i = 0; i < listing_count; ) {
+		if (listings[i]->hash == hash && strcmp(listings[i]->path, path) == 0) {
+			listing_cache_remove_at(i);
+		} else {
+			i++;
+		}
+	}
+	pthread_mutex_unlock(&listing_lock);
+}
+
+/*
+ * Carry listings over from the config with generation from to the config with
+ * generation to, which is derived from it, as cache_migrate() does for the
+ * lookup cache.  Their stamps' in_items must be shared by both configs.
+ */
+void listing_migrate(unsigned long from, unsigned long to, int (*keep)(struct listing *listing, void *arg), void *arg)
+{
+	size_t i;
+
+	pthread_mutex_lock(&listing_lock);
+	for (i = 0; i < listing_count; ) {
+		if (listings[i]->generation == from && keep(listings[i], arg)) {
+			listings[i]->generation = to;
+			i++;
+		} else {
+			listing_cache_remove_at(i);
+		}
+	}
+	pthread_mutex_unlock(&listing_lock);
+}
+
+/*
+ * listing_migrate() callback for a stratum_change.  Listings which read only
+ * out_items whose in_items are unchanged, and so shared with the new config,
+ * are kept.
+ */
+int stratum_change_keep_listing(struct listing *listing, void *arg)
+{
+	return !stratum_change_lists(arg, listing->path);
+}
+
+void listing_clear()
+{
+	pthread_mutex_lock(&listing_lock);
+	while (listing_count > 0) {
+		listing_cache_remove_at(listing_count - 1);
+	}
+	pthread_mutex_unlock(&listing_lock);
+}
+
+/*
+ * ============================================================================
+ * miscellaneous/support
+ * ============================================================================
+ */
+
+int qsort_gid_cmp(const void *a, const void *b)
+{
+	gid_t x = *(const gid_t *) a;
+	gid_t y = *(const gid_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Hashes the set of groups, regardless of their order, which is sorted.
+ * Returns 0 for none.
+ */
+unsigned long hash_groups(gid_t *groups, size_t count)
+{
+	/* FNV-1a over the gids */
+	unsigned long hash = 2166136261UL;
+	size_t i;
+
+	if (count == 0) {
+		return 0;
+	}
+	qsort(groups, count, sizeof(gid_t), qsort_gid_cmp);
+	for (i = 0; i < count; i++) {
+		hash = (hash ^ groups[i]) * 16777619UL;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * Have the kernel check permissions for filesystem calls made by this thread
+ * as though they were made by the user who made the FUSE request, including
+ * supplementary groups.  This only affects the calling thread so that
+ * requests from different users may be served concurrently.
+ *
+ * Also sets caller_groups, so that what is cached for one set of groups is
+ * not served to another.
+ */
+int set_caller_fscreds(fuse_req_t req)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	gid_t groups[GROUPS_MAX];
+	int group_count = fuse_req_getgroups(req, GROUPS_MAX, groups);
+
+	if (group_count < 0) {
+		/* e.g. /proc is unavailable; fall back to no supplementary groups */
+		group_count = 0;
+	} else if (group_count > GROUPS_MAX) {
+		group_count = GROUPS_MAX;
+	}
+
+	if (set_thread_fscreds(context->uid, context->gid, group_count, groups) < 0) {
+		return -EPERM;
+	}
+	caller_groups = hash_groups(groups, group_count);
+	return 0;
+}
+
+/*
+ * brp_openat() for kernels without openat2(2).
+ */
+int brp_openat_walk(int root_fd, const char *path, int flags)
+{
+	const int LOOP_MAX = 40;
+	int loop = 0;
+	size_t depth = 0;
+	int cur;
+	int fd;
+	struct stat stbuf;
+	ssize_t readlink_len;
+
+	/* what is left to resolve */
+	char remaining[PATH_MAX+1];
+	char link_path[PATH_MAX+1];
+	char name[NAME_MAX+1];
+	const char *rest;
+	const char *component;
+	size_t component_len;
+
+	if (strlen(path) > PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+	strcpy(remaining, path);
+	rest = remaining;
+
+	if ((cur = openat(root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		return -errno;
+	}
+
+	while ( (component = next_component(&rest, &component_len)) ) {
+		if (component_len > NAME_MAX) {
+			close(cur);
+			return -ENAMETOOLONG;
+		}
+		memcpy(name, component, component_len);
+		name[component_len] = '\0';
+
+		const char *after = rest;
+		while (*after == '/') {
+			after++;
+		}
+		int last = (*after == '\0');
+
+		if (strcmp(name, ".") == 0) {
+			continue;
+		}
+		if (strcmp(name, "..") == 0) {
+			/* cannot go above the stratum root */
+			if (depth > 0) {
+				fd = openat(cur, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+				close(cur);
+				if (fd < 0) {
+					return -errno;
+				}
+				cur = fd;
+				depth--;
+			}
+			continue;
+		}
+
+		if ((fd = openat(cur, name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0 ||
+				fstat(fd, &stbuf) < 0) {
+			fd = -errno;
+			close(cur);
+			return fd;
+		}
+
+		if (S_ISLNK(stbuf.st_mode)) {
+			if ((loop++) >= LOOP_MAX) {
+				close(fd);
+				close(cur);
+				return -ELOOP;
+			}
+			readlink_len = readlinkat(fd, "", link_path, PATH_MAX);
+			close(fd);
+			if (readlink_len < 0) {
+				fd = -errno;
+				close(cur);
+				return fd;
+			}
+			link_path[readlink_len] = '\0';
+			if (readlink_len + strlen(rest) > PATH_MAX) {
+				close(cur);
+				return -ENAMETOOLONG;
+			}
+			/* splice symlink contents in place of the symlink */
+			memmove(remaining + readlink_len, rest, strlen(rest) + 1);
+			memcpy(remaining, link_path, readlink_len);
+			rest = remaining;
+			if (link_path[0] == '/') {
+				/* absolute symlink, relative to stratum root */
+				close(cur);
+				if ((cur = openat(root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+					return -errno;
+				}
+				depth = 0;
+			}
+			continue;
+		}
+
+		if (!last) {
+			close(cur);
+			if (!S_ISDIR(stbuf.st_mode)) {
+				close(fd);
+				return -ENOTDIR;
+			}
+			cur = fd;
+			depth++;
+			continue;
+		}
+
+		/* final component, which is not a symlink */
+		if (flags & O_PATH) {
+			close(cur);
+			return fd;
+		}
+		close(fd);
+		fd = openat(cur, name, flags | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			fd = -errno;
+		}
+		close(cur);
+		return fd;
+	}
+
+	/* path ended on the stratum root or a "." or ".." */
+	if (flags & O_PATH) {
+		return cur;
+	}
+	fd = openat(cur, ".", flags | O_CLOEXEC);
+	if (fd < 0) {
+		fd = -errno;
+	}
+	close(cur);
+	return fd;
+}
+
+/*
+ * Opens path within the stratum whose root directory is root_fd, treating
+ * absolute symlinks as relative to the stratum's root.  The final component
+ * is dereferenced if it is a symlink.  Returns the file descriptor on
+ * success, -errno on failure.  flags are as with open(2); O_PATH is
+ * sufficient for fstat(2) or as a directory file descriptor.
+ *
+ * This is used over opening the path under STRATA_ROOT directly due to the
+ * need to have absolute symlinks start at the symlink's stratum's root.  e.g.
+ * if a symlink at "/bedrock/strata/foo/bar" symlinks to "/qux" that should be
+ * treated as "/bedrock/strata/foo/qux".  ".." cannot escape the stratum root.
+ *
+ * Where available the kernel does this for us via openat2(2) and
+ * RESOLVE_IN_ROOT in a single syscall.  Otherwise, fall back to walking the
+ * path one component at a time relative to directory file descriptors.
+ */
+int brp_openat(int root_fd, const char *path, int flags)
+{
+	const int RETRY_MAX = 4;
+	int fd;
+	int retry;
+
+	if (root_fd < 0) {
+		return -ENOENT;
+	}
+
+	stat_inc(STAT_OPENAT);
+	if (have_openat2) {
+		struct open_how how;
+		memset(&how, 0, sizeof(how));
+		how.flags = flags | O_CLOEXEC;
+		how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+		for (retry = 0; retry < RETRY_MAX; retry++) {
+			stat_inc(STAT_OPENAT2);
+			fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+			if (fd >= 0) {
+				return fd;
+			}
+			/*
+			 * EAGAIN indicates a concurrent rename raced the
+			 * lookup; try again.
+			 */
+			if (errno != EAGAIN) {
+				break;
+			}
+		}
+		if (errno == ENOSYS) {
+			have_openat2 = 0;
+		} else if (errno != EAGAIN) {
+			return -errno;
+		}
+	}
+
+	stat_inc(STAT_OPENAT_WALK);
+	return brp_openat_walk(root_fd, path, flags);
+}
+
+/*
+ * Opens the given in_item, with tail appended to its path, via brp_openat().
+ */
+int in_item_open(struct in_item *item, const char *tail, int flags)
+{
+	size_t tail_len = strlen(tail);
+	if (item->stratum_path_len + tail_len > PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+	char path[item->stratum_path_len + tail_len + 2];
+	memcpy(path, item->stratum_path, item->stratum_path_len);
+	memcpy(path + item->stratum_path_len, tail, tail_len + 1);
+	if (path[0] == '\0') {
+		strcpy(path, "/");
+	}
+	return brp_openat(item->root_fd, path, flags);
+}
+
+/*
+ * Like stat(2) on the given in_item with tail appended to its path.  stbuf
+ * may be NULL to only check for existence.
+ */
+int in_item_stat(struct in_item *item, const char *tail, struct stat *stbuf)
+{
+	int fd;
+	int ret = 0;
+	struct stat tmp_stbuf;
+
+	if ((fd = in_item_open(item, tail, O_PATH)) < 0) {
+		return fd;
+	}
+	if (fstat(fd, stbuf ? stbuf : &tmp_stbuf) < 0) {
+		ret = -errno;
+	}
+	close(fd);
+	return ret;
+}
+
+/*
+ * Given an input path, finds the corresponding content to output (if any) and
+ * populates various related fields (e.g. stat info) accordingly.  The content
+ * itself can then be opened with in_item_open(in_item, tail, ...).  Returns
+ * how in_path matched, see enum match, or -errno.
+ *
+ * This does the actual work; see corresponding() for the cached version.
+ */
+int corresponding_scan(struct config *conf,
+		char *in_path,
+		struct stat *stbuf,
+		struct out_item **arg_out_item,
+		struct in_item **arg_in_item,
+		char **tail)
+{
+	/* handle root specially */
+	if (in_path[0] == '/' && in_path[1] == '\0') {
+		memcpy(stbuf, &parent_stat, sizeof(parent_stat));
+		return MATCH_ROOT;
+	}
+
+	size_t i, j;
+	ssize_t k;
+
+	struct trie_node *containing[component_count(in_path)];
+	size_t containing_count;
+	struct trie_node *node = trie_walk(conf, in_path, containing, &containing_count);
+
+	/* check for a match on something contained in one of the configured
+	 * directories */
+	size_t cursors[containing_count + 1];
+	memset(cursors, 0, sizeof(cursors));
+	while ( (k = next_containing(containing, cursors, containing_count)) >= 0) {
+		i = k;
+		/*
+		 * in_items which do not list the first component of the rest
+		 * of the path cannot contain it.
+		 */
+		ssize_t first = name_index_first(conf, i, in_path + conf->out_items[i].path_len);
+		if (first == -ENOENT) {
+			stat_inc(STAT_NAME_INDEX_SKIP);
+			continue;
+		}
+		for (j = first >= 0 ? first : 0; j < conf->out_items[i].in_item_count; j++) {
+			if (in_item_stat(&conf->out_items[i].in_items[j], in_path + conf->out_items[i].path_len, stbuf) >= 0) {
+				*arg_out_item = &conf->out_items[i];
+				*arg_in_item = &conf->out_items[i].in_items[j];
+				*tail = in_path + conf->out_items[i].path_len;
+				return MATCH_CONTAINED;
+			}
+		}
+	}
+
+	if (!node) {
+		return -ENOENT;
+	}
+
+	/*
+	 * Check for a match directly on one of the configured items.
+	 */
+	for (k = 0; k < node->item_count; k++) {
+		i = node->items[k];
+		for (j = 0; j < conf->out_items[i].in_item_count; j++) {
+			if (in_item_stat(&conf->out_items[i].in_items[j], "", stbuf) >= 0) {
+				if (conf->out_items[i].file_type == FILE_TYPE_DIRECTORY) {
+					memcpy(stbuf, &parent_stat, sizeof(parent_stat));
+				}
+				*arg_out_item = &conf->out_items[i];
+				*arg_in_item = &conf->out_items[i].in_items[j];
+				/* empty, but within in_path for the lookup cache */
+				*tail = in_path + strlen(in_path);
+				return MATCH_ITEM;
+			}
+		}
+	}
+
+	/*
+	 * Check for a match on a virtual parent directory of a configured
+	 * item.
+	 */
+	for (k = 0; k < node->below_count; k++) {
+		i = node->below[k];
+		for (j = 0; j < conf->out_items[i].in_item_count; j++) {
+			if (in_item_stat(&conf->out_items[i].in_items[j], "", NULL) >= 0) {
+				memcpy(stbuf, &parent_stat, sizeof(parent_stat));
+				*arg_out_item = &conf->out_items[i];
+				*arg_in_item = &conf->out_items[i].in_items[j];
+				/* empty, but within in_path for the lookup cache */
+				*tail = in_path + strlen(in_path);
+				return MATCH_VIRTUAL;
+			}
+		}
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * corresponding_scan() with the lookup cache in front of it.  uid and gid are
+ * those of the user the request is being made on behalf of.
+ */
+int corresponding(struct config *conf,
+		char *in_path,
+		uid_t uid,
+		gid_t gid,
+		struct stat *stbuf,
+		struct out_item **arg_out_item,
+		struct in_item **arg_in_item,
+		char **tail)
+{
+	unsigned long hash = hash_str(in_path);
+	struct cache_entry entry;
+	int ret;
+
+	if (cache_get(in_path, hash, uid, gid, conf->generation, &entry)) {
+		stat_match(entry.ret);
+		if (entry.ret < 0) {
+			return entry.ret;
+		}
+		memcpy(stbuf, &entry.stbuf, sizeof(struct stat));
+		*arg_out_item = entry.out_item;
+		*arg_in_item = entry.in_item;
+		*tail = in_path + entry.tail_offset;
+		return entry.ret;
+	}
+
+	ret = corresponding_scan(conf, in_path, stbuf, arg_out_item, arg_in_item, tail);
+	stat_match(ret);
+
+	/*
+	 * The root is handled specially by corresponding_scan() and does not
+	 * populate the out_item/in_item/tail fields; there is nothing to cache.
+	 */
+	if (in_path[0] == '/' && in_path[1] == '\0') {
+		return ret;
+	}
+
+	if (ret >= 0) {
+		cache_put(in_path, hash, uid, gid, conf->generation, ret, stbuf, *arg_out_item, *arg_in_item, *tail - in_path);
+	} else {
+		cache_put(in_path, hash, uid, gid, conf->generation, ret, NULL, NULL, NULL, 0);
+	}
+
+	return ret;
+}
+
+/*
+ * ============================================================================
+ * exec-filter transform cache
+ * ============================================================================
+ *
+ * FILTER_EXEC output has to be generated from the whole backing file, both
+ * to know its size for getattr and to find where any given read offset falls
+ * within it.  Rather than regenerating it on every getattr and read, the
+ * filtered output is cached, keyed on the identity of the backing file and
+ * the stratum it is being filtered for.  A modified backing file has a new
+ * mtime and/or size and thus misses.
+ *
+ * The cache is bounded to filter_cache_size bytes, evicting the least
+ * recently used output.  Output larger than that only has its size cached;
+ * open files keep their own copy of the output, taken at open, instead.
+ */
+
+struct transform {
+	/* key */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+	char *stratum;
+	unsigned long hash;
+	/* filtered output */
+	char *data;
+	size_t len;
+	/* hash chain and least recently used list, most recent first */
+	struct transform *hash_next;
+	struct transform *lru_prev;
+	struct transform *lru_next;
+};
+
+/* protects everything below */
+pthread_mutex_t transform_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define TRANSFORM_BUCKETS 256
+struct transform *transform_buckets[TRANSFORM_BUCKETS];
+struct transform *transform_lru_head;
+struct transform *transform_lru_tail;
+size_t transform_bytes = 0;
+
+unsigned long transform_hash(const struct stat *stbuf, const char *stratum)
+{
+	return hash_str(stratum) ^ (stbuf->st_ino * 31 + stbuf->st_dev);
+}
+
+size_t transform_cost(struct transform *t)
+{
+	return sizeof(struct transform) + (t->data ? t->len : 0) + strlen(t->stratum) + 1;
+}
+
+void transform_free(struct transform *t)
+{
+	free(t->stratum);
+	free(t->data);
+	free(t);
+}
+
+/*
+ * Expects transform_lock to be held.
+ */
+void transform_lru_unlink(struct transform *t)
+{
+	if (t->lru_prev) {
+		t->lru_prev->lru_next = t->lru_next;
+	} else {
+		transform_lru_head = t->lru_next;
+	}
+	if (t->lru_next) {
+		t->lru_next->lru_prev = t->lru_prev;
+	} else {
+		transform_lru_tail = t->lru_prev;
+	}
+	t->lru_prev = t->lru_next = NULL;
+}
+
+/*
+ * Expects transform_lock to be held.
+ */
+void transform_lru_push(struct transform *t)
+{
+	t->lru_prev = NULL;
+	t->lru_next = transform_lru_head;
+	if (transform_lru_head) {
+		transform_lru_head->lru_prev = t;
+	} else {
+		transform_lru_tail = t;
+	}
+	transform_lru_head = t;
+}
+
+/*
+ * Expects transform_lock to be held.
+ */
+void transform_remove(struct transform *t)
+{
+	struct transform **link;
+	for (link = &transform_buckets[t->hash % TRANSFORM_BUCKETS]; *link; link = &(*link)->hash_next) {
+		if (*link == t) {
+			*link = t->hash_next;
+			break;
+		}
+	}
+	transform_lru_unlink(t);
+	transform_bytes -= transform_cost(t);
+}
+
+/*
+ * Expects transform_lock to be held.
+ */
+struct transform *transform_find(const struct stat *stbuf, const char *stratum, unsigned long hash)
+{
+	struct transform *t;
+	for (t = transform_buckets[hash % TRANSFORM_BUCKETS]; t; t = t->hash_next) {
+		if (t->hash == hash &&
+				t->dev == stbuf->st_dev &&
+				t->ino == stbuf->st_ino &&
+				t->mtime.tv_sec == stbuf->st_mtim.tv_sec &&
+				t->mtime.tv_nsec == stbuf->st_mtim.tv_nsec &&
+				t->size == stbuf->st_size &&
+				strcmp(t->stratum, stratum) == 0) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Appends len bytes of str to the growable buffer *data.
+ */
+int buf_append(char **data, size_t *len, size_t *allocated, const char *str, size_t str_len)
+{
+	if (*len + str_len > *allocated) {
+		size_t new_allocated = *allocated > 0 ? *allocated : 4096;
+		while (*len + str_len > new_allocated) {
+			new_allocated *= 2;
+		}
+		char *new_data = realloc(*data, new_allocated);
+		if (!new_data) {
+			return 0;
+		}
+		*data = new_data;
+		*allocated = new_allocated;
+	}
+	memcpy(*data + *len, str, str_len);
+	*len += str_len;
+	return 1;
+}
+
+/*
+ * Generate the FILTER_EXEC output for the file open at fd, provided by the
+ * given stratum: [Try]Exec[Start|Stop|Reload]= values are wrapped with brc.
+ * Takes ownership of fd.  Returns 0 or -errno.
+ */
+int exec_filter_render(int fd, const char *stratum, char **data, size_t *len)
+{
+	const char *execs[] = {"TryExec=", "ExecStart=", "ExecStop=", "ExecReload=", "Exec="};
+	const size_t exec_cnt = sizeof(execs) / sizeof(execs[0]);
+	const size_t line_max = PATH_MAX;
+	char line[line_max+1];
+	size_t stratum_len = strlen(stratum);
+	size_t allocated = 0;
+	size_t i;
+	int ok = 1;
+
+	FILE *fp = fdopen(fd, "r");
+	if (!fp) {
+		int ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	*data = NULL;
+	*len = 0;
+	while (ok && fgets(line, line_max, fp) != NULL) {
+		int found = 0;
+		for (i = 0; i < exec_cnt; i++) {
+			size_t exec_len = strlen(execs[i]);
+			if (strncmp(line, execs[i], exec_len) == 0) {
+				found = 1;
+				ok = ok && buf_append(data, len, &allocated, execs[i], exec_len);
+				ok = ok && buf_append(data, len, &allocated, "/bedrock/bin/brc ", strlen("/bedrock/bin/brc "));
+				ok = ok && buf_append(data, len, &allocated, stratum, stratum_len);
+				ok = ok && buf_append(data, len, &allocated, " ", 1);
+				ok = ok && buf_append(data, len, &allocated, line + exec_len, strlen(line + exec_len));
+			}
+		}
+		if (!found) {
+			ok = ok && buf_append(data, len, &allocated, line, strlen(line));
+		}
+	}
+	fclose(fp);
+
+	if (!ok) {
+		free(*data);
+		*data = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Copies up to size bytes of the FILTER_EXEC output for the given in_item and
+ * tail, starting at offset, into buf.  buf may be NULL to only get the total
+ * output size.  Sets *total to the size of the whole output.  If whole is not
+ * NULL, it is instead set to a malloc()'d copy of the whole output, which the
+ * caller should free().  Returns the number of bytes copied or -errno.
+ */
+int exec_filter_output(struct in_item *item, const char *tail, char *buf, size_t size, off_t offset, size_t *total, char **whole)
+{
+	struct stat stbuf;
+	struct transform *t;
+	char *data;
+	size_t len;
+	int fd;
+	int ret;
+
+	if ((fd = in_item_open(item, tail, O_RDONLY)) < 0) {
+		return fd;
+	}
+	if (fstat(fd, &stbuf) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	unsigned long hash = transform_hash(&stbuf, item->stratum);
+
+	pthread_mutex_lock(&transform_lock);
+	if ( (t = transform_find(&stbuf, item->stratum, hash)) && (t->data || (!buf && !whole)) ) {
+		transform_lru_unlink(t);
+		transform_lru_push(t);
+		close(fd);
+		stat_inc(STAT_FILTER_HIT);
+		if (whole && ! (*whole = malloc(t->len + 1)) ) {
+			pthread_mutex_unlock(&transform_lock);
+			return -ENOMEM;
+		} else if (whole) {
+			memcpy(*whole, t->data, t->len);
+		}
+		goto copy;
+	}
+	pthread_mutex_unlock(&transform_lock);
+	stat_inc(STAT_FILTER_MISS);
+
+	if ((ret = exec_filter_render(fd, item->stratum, &data, &len)) < 0) {
+		return ret;
+	}
+
+	/*
+	 * Output too large to cache still has its size cached, as getattr
+	 * asks for that far more often than open reads the output.  Reads
+	 * of open files are served from the copy taken at open.
+	 */
+	t = calloc(1, sizeof(struct transform));
+	if (!t || !(t->stratum = strdup(item->stratum))) {
+		free(t);
+		free(data);
+		return -ENOMEM;
+	}
+	t->dev = stbuf.st_dev;
+	t->ino = stbuf.st_ino;
+	t->mtime = stbuf.st_mtim;
+	t->size = stbuf.st_size;
+	t->hash = hash;
+	t->data = data;
+	t->len = len;
+
+	ret = 0;
+	if (buf && offset < len) {
+		ret = MIN(len - offset, size);
+		memcpy(buf, data + offset, ret);
+	}
+	*total = len;
+
+	pthread_mutex_lock(&transform_lock);
+	if (transform_cost(t) > options.filter_cache_size) {
+		/* the caller's copy, if it wants one, or nobody's */
+		if (whole) {
+			*whole = data;
+		} else {
+			free(data);
+		}
+		t->data = NULL;
+	} else if (whole && (*whole = malloc(len + 1))) {
+		memcpy(*whole, data, len);
+	} else if (whole) {
+		ret = -ENOMEM;
+	}
+
+	if (transform_find(&stbuf, item->stratum, hash) || transform_cost(t) > options.filter_cache_size) {
+		/* another thread got here first, or even the size does not fit */
+		transform_free(t);
+	} else {
+		while (transform_bytes + transform_cost(t) > options.filter_cache_size) {
+			struct transform *victim = transform_lru_tail;
+			transform_remove(victim);
+			transform_free(victim);
+		}
+		t->hash_next = transform_buckets[hash % TRANSFORM_BUCKETS];
+		transform_buckets[hash % TRANSFORM_BUCKETS] = t;
+		transform_lru_push(t);
+		transform_bytes += transform_cost(t);
+	}
+	pthread_mutex_unlock(&transform_lock);
+	return ret;
+
+copy:
+	ret = 0;
+	if (buf && offset < t->len) {
+		ret = MIN(t->len - offset, size);
+		memcpy(buf, t->data + offset, ret);
+	}
+	*total = t->len;
+	pthread_mutex_unlock(&transform_lock);
+	return ret;
+}
+
+int exec_filter(struct in_item *item, const char *tail, char *buf, size_t size, off_t offset, size_t *total)
+{
+	return exec_filter_output(item, tail, buf, size, offset, total, NULL);
+}
+
+/*
+ * Apply relevant filter to getattr output.
+ */
+void stat_filter(struct stat *stbuf,
+		int filter,
+		struct in_item *item,
+		const char *tail)
+{
+	/*
+	 * Remove an setuid/setgid properties and write properties  The
+	 * program we are wrapping could be setuid and owned by something
+	 * other than root, in which case this would have been an exploit.
+	 * Moreover, no one can write to these.
+	 */
+	stbuf->st_mode &= ~ (S_ISUID | S_ISGID | S_IWUSR | S_IWGRP | S_IWOTH);
+
+	if (S_ISDIR(stbuf->st_mode)) {
+		/* filters below only touch files */
+		return;
+	}
+
+	size_t total;
+
+	switch (filter) {
+
+	case FILTER_PASS:
+		break;
+
+	case FILTER_BRC_WRAP:
+		stbuf->st_size = brc_wrap_len(item, tail);
+		break;
+
+	case FILTER_EXEC:
+		if (exec_filter(item, tail, NULL, 0, 0, &total) >= 0) {
+			stbuf->st_size = total;
+		}
+		break;
+
+	}
+}
+
+/*
+ * Scrambles a value into an inode number, avoiding 0, which the kernel
+ * treats as no inode at all, and FUSE_ROOT_ID, which is the root's.
+ */
+ino_t ino_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x > FUSE_ROOT_ID ? x : x + FUSE_ROOT_ID + 1;
+}
+
+void timespec_max(struct timespec *to, const struct timespec *from)
+{
+	if (from->tv_sec > to->tv_sec || (from->tv_sec == to->tv_sec && from->tv_nsec > to->tv_nsec)) {
+		*to = *from;
+	}
+}
+
+/*
+ * Raises stbuf's times to those of any of the backing directories of the
+ * given out_item, starting with in_items[first], which are newer.
+ */
+void stat_merge_times(struct out_item *out_item, size_t first, const char *tail, struct stat *stbuf)
+{
+	struct stat dir_stbuf;
+	size_t j;
+
+	for (j = first; j < out_item->in_item_count; j++) {
+		if (in_item_stat(&out_item->in_items[j], tail, &dir_stbuf) >= 0 && S_ISDIR(dir_stbuf.st_mode)) {
+			timespec_max(&stbuf->st_mtim, &dir_stbuf.st_mtim);
+			timespec_max(&stbuf->st_ctim, &dir_stbuf.st_ctim);
+		}
+	}
+}
+
+/* protects every config's dir_times */
+pthread_mutex_t dir_times_lock = PTHREAD_MUTEX_INITIALIZER;
+/* bumped whenever any may have changed; see dir_times_put() */
+unsigned long dir_times_changes = 0;
+
+/*
+ * Copies the times kept for the virtual directory path into stbuf and
+ * returns 1, or returns 0 if there are none.  Either way, changes is set for
+ * dir_times_put().
+ */
+int dir_times_get(struct config *conf, const char *path, struct stat *stbuf, unsigned long *changes)
+{
+	int ret = 0;
+	size_t i;
+
+	pthread_mutex_lock(&dir_times_lock);
+	*changes = dir_times_changes;
+	for (i = 0; conf->dir_times_valid && i < conf->dir_times_count; i++) {
+		if (strcmp(conf->dir_times[i].path, path) == 0) {
+			stbuf->st_mtim = conf->dir_times[i].mtime;
+			stbuf->st_ctim = conf->dir_times[i].ctime;
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dir_times_lock);
+	return ret;
+}
+
+/*
+ * Keeps the times in stbuf for the virtual directory path, unless anything
+ * changed since they were read, as told by changes from dir_times_get().
+ * Failing to allocate is not an error.
+ */
+void dir_times_put(struct config *conf, const char *path, const struct stat *stbuf, unsigned long changes)
+{
+	struct dir_times *dir_times;
+	size_t i;
+
+	pthread_mutex_lock(&dir_times_lock);
+	if (!conf->dir_times_valid || changes != dir_times_changes) {
+		goto out;
+	}
+	/* another request may have got here first */
+	for (i = 0; i < conf->dir_times_count; i++) {
+		if (strcmp(conf->dir_times[i].path, path) == 0) {
+			goto out;
+		}
+	}
+	if (! (dir_times = realloc(conf->dir_times, (conf->dir_times_count + 1) * sizeof(struct dir_times))) ) {
+		goto out;
+	}
+	conf->dir_times = dir_times;
+	if ( (dir_times[conf->dir_times_count].path = strdup(path)) ) {
+		dir_times[conf->dir_times_count].mtime = stbuf->st_mtim;
+		dir_times[conf->dir_times_count].ctime = stbuf->st_ctim;
+		conf->dir_times_count++;
+	}
+out:
+	pthread_mutex_unlock(&dir_times_lock);
+}
+
+/*
+ * A backing directory of the out_item at item_path now has the times in
+ * stbuf; raise those of the virtual directories above it to match.
+ */
+void dir_times_raise(struct config *conf, const char *item_path, const struct stat *stbuf)
+{
+	size_t i;
+
+	pthread_mutex_lock(&dir_times_lock);
+	dir_times_changes++;
+	for (i = 0; i < conf->dir_times_count; i++) {
+		const char *path = conf->dir_times[i].path;
+		size_t len = strlen(path);
+		if (len == 1 || (strncmp(path, item_path, len) == 0 && item_path[len] == '/')) {
+			timespec_max(&conf->dir_times[i].mtime, &stbuf->st_mtim);
+			timespec_max(&conf->dir_times[i].ctime, &stbuf->st_ctim);
+		}
+	}
+	pthread_mutex_unlock(&dir_times_lock);
+}
+
+/*
+ * Drops all of conf's virtual directory times, and sets whether they may be
+ * kept from now on.
+ */
+void dir_times_reset(struct config *conf, int valid)
+{
+	size_t i;
+
+	pthread_mutex_lock(&dir_times_lock);
+	dir_times_changes++;
+	for (i = 0; i < conf->dir_times_count; i++) {
+		free(conf->dir_times[i].path);
+	}
+	free(conf->dir_times);
+	conf->dir_times = NULL;
+	conf->dir_times_count = 0;
+	conf->dir_times_valid = valid;
+	pthread_mutex_unlock(&dir_times_lock);
+}
+
+/*
+ * Returns the inode number stat_identity() gives path, which matched as
+ * given and whose backing file's stat information is in stbuf.
+ */
+ino_t stat_ino(const char *path, int match, const struct stat *stbuf)
+{
+	if (!S_ISDIR(stbuf->st_mode)) {
+		return ino_mix(stbuf->st_ino ^ ((uint64_t) stbuf->st_dev * 0x9e3779b97f4a7c15ULL));
+	}
+	return match == MATCH_ROOT ? FUSE_ROOT_ID : ino_mix(hash_str(path));
+}
+
+/*
+ * Fills in the parts of path's stat information which do not come from a
+ * single backing file, given how path matched (see enum match).
+ *
+ * Files keep an inode number derived from the device and inode of the file
+ * backing them, so that it is stable across remounts and changes exactly
+ * when the file is replaced.  Directories may merge several backing
+ * directories, and virtual ones have none, so their inode number is derived
+ * from their path instead and their times are the newest of the directories
+ * they merge.  Virtual directories' contents also depend on the config, so
+ * they are at least as new as it is.
+ */
+void stat_identity(struct config *conf,
+		const char *path,
+		int match,
+		struct out_item *out_item,
+		struct in_item *in_item,
+		const char *tail,
+		struct stat *stbuf)
+{
+	struct trie_node *containing[component_count(path)];
+	size_t containing_count;
+	struct trie_node *node;
+	unsigned long changes;
+	size_t k;
+
+	stbuf->st_ino = stat_ino(path, match, stbuf);
+	if (!S_ISDIR(stbuf->st_mode)) {
+		return;
+	}
+
+	switch (match) {
+	case MATCH_CONTAINED:
+	case MATCH_ITEM:
+		if (match == MATCH_ITEM) {
+			/* only the backing directories' times are meaningful */
+			memset(&stbuf->st_mtim, 0, sizeof(stbuf->st_mtim));
+			memset(&stbuf->st_ctim, 0, sizeof(stbuf->st_ctim));
+		}
+		stat_merge_times(out_item, in_item - out_item->in_items, tail, stbuf);
+		break;
+
+	case MATCH_ROOT:
+	case MATCH_VIRTUAL:
+		/*
+		 * Merging every backing directory below is too much for each
+		 * stat(), especially of the root, so it is done once and then
+		 * kept up to date by the filesystem watcher.
+		 */
+		if (dir_times_get(conf, path, stbuf, &changes)) {
+			break;
+		}
+		stbuf->st_mtim = stbuf->st_ctim = conf->created;
+		if ( (node = trie_walk(conf, path, containing, &containing_count)) ) {
+			for (k = 0; k < node->below_count; k++) {
+				stat_merge_times(&conf->out_items[node->below[k]], 0, "", stbuf);
+			}
+		}
+		dir_times_put(conf, path, stbuf, changes);
+		break;
+	}
+}
+
+/*
+ * Do read() and apply relevant filter.
+ */
+int read_filter(int filter,
+		struct in_item *item,
+		const char *tail,
+		char *buf,
+		size_t size,
+		off_t offset)
+{
+	int fd, ret;
+	size_t total;
+	char *wrapper;
+	size_t wrapper_len;
+
+	switch (filter) {
+
+	case FILTER_PASS:
+		if ((fd = in_item_open(item, tail, O_RDONLY)) >= 0) {
+			ret = pread(fd, buf, size, offset);
+			if (ret < 0) {
+				ret = -errno;
+			}
+			close(fd);
+			return ret;
+		}
+		return fd;
+		break;
+
+	case FILTER_BRC_WRAP:
+		if (! (wrapper = brc_wrap_render(item, tail, &wrapper_len)) ) {
+			return -ENOMEM;
+		}
+		ret = brc_wrap_copy(wrapper, wrapper_len, buf, size, offset);
+		free(wrapper);
+		return ret;
+		break;
+
+	case FILTER_EXEC:
+		return exec_filter(item, tail, buf, size, offset, &total);
+		break;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Like corresponding() for the node's path, except that if the node was
+ * resolved recently and what it resolved to is still there, that is reused
+ * rather than resolving the path again.  tail points into node->path.
+ */
+int node_resolve(struct config *conf,
+		struct node *node,
+		uid_t uid,
+		gid_t gid,
+		struct stat *stbuf,
+		struct out_item **out_item,
+		struct in_item **in_item,
+		char **tail)
+{
+	unsigned long generation;
+	time_t resolved;
+	int match;
+	size_t tail_offset;
+	int ret;
+
+	pthread_mutex_lock(&node_lock);
+	generation = node->generation;
+	resolved = node->resolved;
+	match = node->match;
+	*out_item = node->out_item;
+	*in_item = node->in_item;
+	tail_offset = node->tail_offset;
+	pthread_mutex_unlock(&node_lock);
+
+	if (generation == conf->generation && time(NULL) - resolved < options.cache_ttl) {
+		*tail = node->path + tail_offset;
+		switch (match) {
+		case MATCH_CONTAINED:
+		case MATCH_ITEM:
+			if (in_item_stat(*in_item, *tail, stbuf) >= 0) {
+				if (match == MATCH_ITEM && (*out_item)->file_type == FILE_TYPE_DIRECTORY) {
+					memcpy(stbuf, &parent_stat, sizeof(parent_stat));
+				}
+				return match;
+			}
+			break;
+		case MATCH_VIRTUAL:
+			if (in_item_stat(*in_item, *tail, NULL) >= 0) {
+				memcpy(stbuf, &parent_stat, sizeof(parent_stat));
+				return match;
+			}
+			break;
+		}
+		/* what the node resolved to has gone away; so has any cached copy */
+		cache_invalidate(node->path, hash_str(node->path));
+	}
+
+	ret = corresponding(conf, node->path, uid, gid, stbuf, out_item, in_item, tail);
+	if (ret >= 0) {
+		node_set_resolution(conf, node, ret, *out_item, *in_item, *tail - node->path);
+	}
+	return ret;
+}
+
+/*
+ * Opens the given in_item with tail appended to its path and records its
+ * state in stamp.  Returns the O_PATH file descriptor, or -errno.
+ */
+int listing_stamp(struct listing_stamp *stamp, struct in_item *in_item, const char *tail)
+{
+	struct stat stbuf;
+	int fd;
+
+	memset(stamp, 0, sizeof(struct listing_stamp));
+	stamp->in_item = in_item;
+	if ((fd = in_item_open(in_item, tail, O_PATH)) < 0) {
+		stamp->ret = fd;
+		return fd;
+	}
+	if (fstat(fd, &stbuf) < 0) {
+		stamp->ret = -errno;
+		close(fd);
+		return stamp->ret;
+	}
+	stamp->dev = stbuf.st_dev;
+	stamp->ino = stbuf.st_ino;
+	stamp->mode = stbuf.st_mode;
+	stamp->ctime = stbuf.st_ctim;
+	return fd;
+}
+
+/*
+ * Whether none of the listing's backing directories have changed since.
+ * Expects the config the listing was made from to be in use.
+ */
+int listing_valid(struct listing *listing)
+{
+	struct listing_stamp now;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < listing->stamp_count; i++) {
+		struct listing_stamp *then = &listing->stamps[i];
+		if ( (fd = listing_stamp(&now, then->in_item, listing->path + then->tail_offset)) >= 0) {
+			close(fd);
+		}
+		if (now.ret != then->ret || now.dev != then->dev || now.ino != then->ino ||
+				now.mode != then->mode || now.ctime.tv_sec != then->ctime.tv_sec ||
+				now.ctime.tv_nsec != then->ctime.tv_nsec) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Lists the backing directories of in_path within the configured directories
+ * containing it, per trie_walk().  Returns NULL if out of memory.
+ */
+struct listing *listing_scan(struct config *conf, const char *in_path, uid_t uid, gid_t gid, struct trie_node **containing, size_t containing_count)
+{
+	struct listing *listing;
+	struct dir_scan *scans = NULL;
+	size_t scan_count = 0;
+	int scanned = 0;
+	size_t allocated = 0;
+	size_t stamp_count = 0;
+	time_t now = time(NULL);
+	size_t i, j;
+	ssize_t k;
+	int fd;
+
+	if (! (listing = calloc(1, sizeof(struct listing))) ) {
+		return NULL;
+	}
+	listing->refs = 1;
+	listing->uid = uid;
+	listing->gid = gid;
+	listing->groups = caller_groups;
+	listing->generation = conf->generation;
+	listing->hash = hash_str(in_path);
+	listing->cacheable = 1;
+
+	size_t cursors[containing_count + 1];
+	memset(cursors, 0, sizeof(cursors));
+	while ( (k = next_containing(containing, cursors, containing_count)) >= 0) {
+		stamp_count += conf->out_items[k].in_item_count;
+	}
+	listing->path = arena_strndup(&listing->arena, in_path, strlen(in_path));
+	listing->stamps = arena_alloc(&listing->arena, (stamp_count + 1) * sizeof(struct listing_stamp));
+	scans = malloc((stamp_count + 1) * sizeof(struct dir_scan));
+	if (!listing->path || !listing->stamps || !scans) {
+		goto oom;
+	}
+
+	/*
+	 * Open the backing directories as the caller, in priority order, then
+	 * read them all at once.
+	 */
+	memset(cursors, 0, sizeof(cursors));
+	while ( (k = next_containing(containing, cursors, containing_count)) >= 0) {
+		i = k;
+		for (j = 0; j < conf->out_items[i].in_item_count; j++) {
+			struct listing_stamp *stamp = &listing->stamps[listing->stamp_count++];
+			size_t tail_offset = conf->out_items[i].path_len;
+			fd = listing_stamp(stamp, &conf->out_items[i].in_items[j], in_path + tail_offset);
+			stamp->tail_offset = tail_offset;
+			if (fd < 0) {
+				continue;
+			}
+			/*
+			 * Changes within the same clock tick as listing would
+			 * not show in the ctime.
+			 */
+			if (stamp->ctime.tv_sec >= now - 1) {
+				listing->cacheable = 0;
+			}
+			if (!S_ISDIR(stamp->mode)) {
+				close(fd);
+				const char *name = strrchr(in_path, '/') ? strrchr(in_path, '/') + 1 : in_path;
+				char *copy = arena_strndup(&listing->arena, name, strlen(name));
+				if (!copy || listing_append(listing, copy, &allocated) < 0) {
+					goto oom;
+				}
+				listing->found = 1;
+				continue;
+			}
+
+			int dir_fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			close(fd);
+			if (dir_fd < 0) {
+				/* e.g. the caller may not read it; not worth keeping */
+				listing->cacheable = 0;
+				continue;
+			}
+			scans[scan_count++].fd = dir_fd;
+		}
+	}
+
+	dir_scan_run(scans, scan_count);
+	scanned = 1;
+
+	for (i = 0; i < scan_count; i++) {
+		if (scans[i].ret < 0) {
+			listing->cacheable = 0;
+			if (scans[i].ret == -ENOMEM) {
+				goto oom;
+			}
+			continue;
+		}
+		for (j = 0; j < scans[i].name_count; j++) {
+			if (listing_append(listing, scans[i].names[j], &allocated) < 0) {
+				goto oom;
+			}
+		}
+		arena_adopt(&listing->arena, &scans[i].arena);
+		listing->found = 1;
+	}
+	for (i = 0; i < scan_count; i++) {
+		dir_scan_free(&scans[i]);
+	}
+	free(scans);
+
+	listing_sort(listing);
+	return listing;
+
+oom:
+	for (i = 0; i < scan_count; i++) {
+		if (scanned) {
+			dir_scan_free(&scans[i]);
+		} else {
+			close(scans[i].fd);
+		}
+	}
+	free(scans);
+	listing_put(listing);
+	return NULL;
+}
+
+/*
+ * Sets *listing to a reference to the listing of the directory at in_path,
+ * which the caller should listing_put() once done.  Returns 0, or -ENOENT if
+ * there is no such directory.
+ */
+int list_directory(struct config *conf, const char *in_path, uid_t uid, gid_t gid, struct listing **listing)
+{
+	struct listing *backing = NULL;
+	struct listing *merged;
+	size_t allocated = 0;
+	size_t i, j;
+	ssize_t k;
+
+	struct trie_node *containing[component_count(in_path) + 1];
+	size_t containing_count;
+	struct trie_node *node = trie_walk(conf, in_path, containing, &containing_count);
+
+	/*
+	 * Check for contents of one of the configured directories, either
+	 * in_path itself or one containing it.
+	 */
+	if (node && node->dir_item_count > 0) {
+		containing[containing_count++] = node;
+	}
+	if (containing_count > 0) {
+		backing = listing_cache_get(in_path, hash_str(in_path), uid, gid, conf->generation);
+		if (backing && !listing_valid(backing)) {
+			listing_cache_remove(backing);
+			listing_put(backing);
+			backing = NULL;
+		}
+		stat_inc(backing ? STAT_LISTING_HIT : STAT_LISTING_MISS);
+		if (!backing) {
+			if (! (backing = listing_scan(conf, in_path, uid, gid, containing, containing_count)) ) {
+				return -ENOMEM;
+			}
+			if (backing->cacheable) {
+				listing_cache_add(backing);
+			}
+		}
+	}
+
+	/*
+	 * Children of in_path in the trie are configured items or virtual
+	 * parent directories.  List those which have at least one configured
+	 * item at or below them which resolves.
+	 */
+	int root = in_path[0] == '/' && in_path[1] == '\0';
+	char *children[node ? node->child_count + 1 : 1];
+	size_t child_count = 0;
+	for (i = 0; node && i < node->child_count; i++) {
+		struct trie_node *child = &node->children[i];
+		int found = 0;
+		for (k = 0; !found && k < child->item_count + child->below_count; k++) {
+			size_t item = k < child->item_count ? child->items[k] : child->below[k - child->item_count];
+			for (j = 0; !found && j < conf->out_items[item].in_item_count; j++) {
+				found = in_item_stat(&conf->out_items[item].in_items[j], "", NULL) >= 0;
+			}
+		}
+		if (found) {
+			children[child_count++] = child->name;
+		}
+	}
+
+	if (child_count == 0 && !root) {
+		if (!backing || !backing->found) {
+			if (backing) {
+				listing_put(backing);
+			}
+			return -ENOENT;
+		}
+		*listing = backing;
+		return 0;
+	}
+
+	/*
+	 * Otherwise the listing is specific to this open, borrowing names
+	 * from the backing directories' listing.
+	 */
+	if (! (merged = calloc(1, sizeof(struct listing))) ) {
+		if (backing) {
+			listing_put(backing);
+		}
+		return -ENOMEM;
+	}
+	merged->refs = 1;
+	merged->base = backing;
+	for (i = 0; backing && i < backing->name_count; i++) {
+		if (listing_append(merged, backing->names[i], &allocated) < 0) {
+			goto oom;
+		}
+	}
+	for (i = 0; i < child_count; i++) {
+		char *copy = arena_strndup(&merged->arena, children[i], strlen(children[i]));
+		if (!copy || listing_append(merged, copy, &allocated) < 0) {
+			goto oom;
+		}
+	}
+	/*
+	 * Handle reparse_config and .brp_stats on root
+	 */
+	if (root && (listing_append(merged, "reparse_config", &allocated) < 0 ||
+			listing_append(merged, ".brp_stats", &allocated) < 0)) {
+		goto oom;
+	}
+	listing_sort(merged);
+	*listing = merged;
+	return 0;
+
+oom:
+	listing_put(merged);
+	return -ENOMEM;
+}
+
+/*
+ * ============================================================================
+ * config reload
+ * ============================================================================
+ *
+ * Writing to /reparse_config has brp reparse its config.  This is done on its
+ * own thread so that requests continue to be served from the current config
+ * in the meantime, even when running single-threaded.  The request which
+ * asked for the reparse is only replied to once the new config is in place,
+ * so anything the writer does after its write returns sees the new config.
+ * Writes which arrive while a reparse is underway are batched into the next
+ * one.
+ *
+ * Writing "+<stratum>" or "-<stratum>" rather than anything else only adds or
+ * removes that stratum; see config_change_stratum().  These are applied in
+ * the order they were written unless a full reparse is also pending, which
+ * covers them.
+ *
+ * The same changes may also be requested from within brp, by the filesystem
+ * watcher below, in which case there is nobody to reply to.
+ */
+
+struct reload_waiter {
+	/* NULL if requested from within brp */
+	fuse_req_t req;
+	/* bytes to report as written, or -1 to reply with attributes */
+	ssize_t written;
+	/* '+' or '-' to enable or disable stratum, '\0' for a full reparse */
+	char change;
+	char *stratum;
+	/* -errno to reply with once done */
+	int ret;
+	struct reload_waiter *next;
+};
+
+/* protects reload_waiters */
+pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+struct reload_waiter *reload_waiters;
+struct reload_waiter **reload_waiters_tail = &reload_waiters;
+
+void watch_config(struct config *conf);
+void index_request();
+
+/*
+ * Hands waiter to the reload thread, which takes ownership of it.
+ */
+void reload_queue(struct reload_waiter *waiter)
+{
+	waiter->next = NULL;
+	pthread_mutex_lock(&reload_lock);
+	*reload_waiters_tail = waiter;
+	reload_waiters_tail = &waiter->next;
+	pthread_cond_signal(&reload_cond);
+	pthread_mutex_unlock(&reload_lock);
+}
+
+/*
+ * Queues a change as if change and stratum had been written to
+ * /reparse_config, without waiting for it to be applied.  Returns 0 or
+ * -errno.
+ */
+int reload_request(char change, const char *stratum)
+{
+	struct reload_waiter *waiter = calloc(1, sizeof(struct reload_waiter));
+	if (!waiter) {
+		return -ENOMEM;
+	}
+	if (stratum && !(waiter->stratum = strdup(stratum))) {
+		free(waiter);
+		return -ENOMEM;
+	}
+	waiter->change = change;
+	reload_queue(waiter);
+	return 0;
+}
+
+/*
+ * Enable or disable a stratum on top of the current config, old.  Returns 0
+ * or -errno.
+ */
+int reload_change_stratum(struct config *old, struct reload_waiter *waiter)
+{
+	struct stratum_change change;
+
+	/*
+	 * Both brs and the filesystem watcher may ask for the same change;
+	 * whichever comes second has nothing left to do when disabling.  An
+	 * already enabled stratum is still refreshed, as brs may have mounted
+	 * over its root since it was enabled; this is cheap compared to a
+	 * reparse.
+	 */
+	if (waiter->change == '-' && !str_in(old->strata, old->stratum_count, waiter->stratum)) {
+		return 0;
+	}
+
+	struct config *conf = config_change_stratum(old, waiter->stratum, waiter->change == '+', &change);
+	if (!conf) {
+		return -errno;
+	}
+
+	/*
+	 * Carry over cache entries, node resolutions and listings before
+	 * anyone can use the new config, so that it never starts out with an
+	 * empty cache.
+	 */
+	cache_migrate(old->generation, conf->generation, stratum_change_keep, &change);
+	node_migrate(old->generation, conf->generation, stratum_change_remap, &change);
+	listing_migrate(old->generation, conf->generation, stratum_change_keep_listing, &change);
+	config_publish(conf);
+	/*
+	 * Only now that the new config is in use, so that the kernel does not
+	 * look the same things up again in the old one.
+	 */
+	invalidate_kernel_cache_except(conf->generation, stratum_change_affects_miss, &change);
+	arena_free(&change.arena);
+	return 0;
+}
+
+void reload_reply(struct reload_waiter *waiter)
+{
+	int ret = waiter->ret;
+
+	if (!waiter->req) {
+		/* reload_thread() reports failing to reparse */
+		if (ret < 0 && waiter->change) {
+			fprintf(stderr, "brp: unable to %s stratum \"%s\": %s\n",
+				waiter->change == '+' ? "enable" : "disable",
+				waiter->stratum, strerror(-ret));
+		}
+		return;
+	}
+
+	if (ret < 0) {
+		fuse_reply_err(waiter->req, -ret);
+	} else if (waiter->written >= 0) {
+		fuse_reply_write(waiter->req, waiter->written);
+	} else {
+		fuse_reply_attr(waiter->req, &reparse_stat, options.attr_timeout);
+	}
+}
+
+void *reload_thread(void *arg)
+{
+	struct reload_waiter *waiters;
+	struct reload_waiter *waiter;
+	/* waiters only a full reparse takes care of */
+	struct reload_waiter *covered;
+	struct config *conf;
+	int full;
+	int ret;
+
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&reload_lock);
+		while (!reload_waiters) {
+			pthread_cond_wait(&reload_cond, &reload_lock);
+		}
+		waiters = reload_waiters;
+		reload_waiters = NULL;
+		reload_waiters_tail = &reload_waiters;
+		pthread_mutex_unlock(&reload_lock);
+
+		full = 0;
+		for (waiter = waiters; waiter; waiter = waiter->next) {
+			waiter->ret = 0;
+			full |= !waiter->change;
+		}
+
+		/*
+		 * Each stratum change shares what it can with the config it
+		 * was derived from, which keeps that alive.  Rather than
+		 * letting such chains grow indefinitely, start afresh with a
+		 * full reparse once they get long.
+		 */
+		covered = waiters;
+		for (waiter = waiters; !full && waiter; waiter = waiter->next) {
+			conf = config_get();
+			if (conf->depth >= RELOAD_MAX_DEPTH) {
+				full = 1;
+			} else {
+				waiter->ret = reload_change_stratum(conf, waiter);
+				covered = waiter->next;
+			}
+			config_put(conf);
+		}
+
+		/*
+		 * Stratum changes carried over what they could, and dropped
+		 * the rest, above.
+		 *
+		 * A config which cannot be parsed, e.g. because it is being
+		 * replaced or memory is short, must not take down the mount;
+		 * the current one is kept instead, and a later change to it
+		 * tries again.
+		 */
+		if (full && (conf = parse_config())) {
+			config_publish(conf);
+			/* entries for the old config can no longer be hit */
+			cache_clear();
+			listing_clear();
+			invalidate_kernel_cache();
+		} else if (full) {
+			ret = -errno;
+			fprintf(stderr, "brp: unable to reparse config, keeping the current one: %s\n", strerror(-ret));
+			for (waiter = covered; waiter; waiter = waiter->next) {
+				waiter->ret = ret;
+			}
+		}
+
+		conf = config_get();
+		watch_config(conf);
+		config_put(conf);
+		index_request();
+
+		while ( (waiter = waiters) ) {
+			waiters = waiter->next;
+			reload_reply(waiter);
+			free(waiter->stratum);
+			free(waiter);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Writing to this filesystem is only used as a way to signal that the
+ * configuration and should be reparsed.  Thus, it does not matter which
+ * writing function is called - they should all act the same.  They all call
+ * this.  buf is what was written, if anything.
+ *
+ * Returns 0 if a reparse was queued, in which case req is replied to by the
+ * reload thread: with written as the number of bytes written, or with the
+ * node's attributes if written is -1.  Otherwise returns -errno and the
+ * caller should reply.
+ */
+int write_attempt(fuse_req_t req, struct node *node, const char *buf, size_t size, ssize_t written)
+{
+	/*
+	 * The *only* thing writable is the /reparse_config, and only by root.
+	 * When it is written to, it will cause brp to reparse its configuration.
+	 */
+	if (node->type != NODE_REPARSE_CONFIG || fuse_req_ctx(req)->uid != 0) {
+		/* Non-root users cannot do anything with this file. */
+		return -EACCES;
+	}
+
+	struct reload_waiter *waiter = calloc(1, sizeof(struct reload_waiter));
+	if (!waiter) {
+		return -ENOMEM;
+	}
+	waiter->req = req;
+	waiter->written = written;
+
+	if (buf && size > 0 && (buf[0] == '+' || buf[0] == '-')) {
+		const char *name = buf + 1;
+		size_t len = size - 1;
+		while (len > 0 && (is_blank(name[len-1]) || name[len-1] == '\n')) {
+			len--;
+		}
+		if (len == 0 || len > NAME_MAX || memchr(name, '/', len) || memchr(name, '\0', len) ||
+				(len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+			free(waiter);
+			return -EINVAL;
+		}
+		if (! (waiter->stratum = strndup(name, len)) ) {
+			free(waiter);
+			return -ENOMEM;
+		}
+		waiter->change = buf[0];
+	}
+
+	reload_queue(waiter);
+	return 0;
+}
+
+/*
+ * ============================================================================
+ * filesystem watching
+ * ============================================================================
+ *
+ * Rather than waiting to be told, brp watches for changes with inotify(7):
+ *
+ * - Rewriting CONFIG reparses it, as if written to /reparse_config.
+ * - Adding or removing a stratum's file in ENABLED_STRATA enables or disables
+ *   it, as if "+<stratum>" or "-<stratum>" were written.
+ * - Changes within the strata's directories the config names drop what brp
+ *   and the kernel have cached about the affected paths, so that, e.g., a
+ *   newly installed executable shows up immediately regardless of cache_ttl
+ *   and the kernel's timeouts.  They also keep the name indexes up to date.
+ *
+ * Only the directories the config names are watched, not their
+ * subdirectories; changes deeper down are still only noticed once the
+ * caches expire.  For configured directories which do not exist, where they
+ * would appear is watched instead.  Watches are set up again whenever the
+ * config is reloaded.
+ */
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+	IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+ * Something affected by changes in a watched directory.
+ */
+struct watch_target {
+	/*
+	 * Incoming path to invalidate, e.g. "/bin" for a directory item or
+	 * "/pin/bin/vim" for a file item, or NULL for none.
+	 */
+	char *path;
+	/* limits this to changes to the given name within the directory */
+	char *name;
+	/* out_item whose name index lists the directory, or -1 */
+	ssize_t out_item;
+	/*
+	 * Which of out_item's in_items the directory is, or -1 if it is
+	 * instead the closest existing parent of a missing one, in which case
+	 * name appearing means out_item's index must be rebuilt.
+	 */
+	ssize_t in_item;
+};
+
+/*
+ * A watched directory within a stratum.  Several items may share one.
+ */
+struct watch {
+	int wd;
+	struct watch_target *targets;
+	size_t target_count;
+};
+
+/* protects everything below */
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int watch_fd = -1;
+int config_wd = -1;
+int enabled_wd = -1;
+struct watch *watches;
+size_t watch_count;
+/* config the watches and its name indexes are for; holds a reference */
+struct config *watched_config;
+
+void watch_free(struct watch *watch)
+{
+	size_t i;
+	for (i = 0; i < watch->target_count; i++) {
+		free(watch->targets[i].path);
+		free(watch->targets[i].name);
+	}
+	free(watch->targets);
+}
+
+int watch_str_eq(const char *a, const char *b)
+{
+	return a && b ? strcmp(a, b) == 0 : a == b;
+}
+
+/*
+ * Adds a watch on the directory fd, unless there already is one, and adds
+ * target to it.  Expects watch_lock to be held.  Returns 0 or -errno.
+ */
+int watch_add(struct watch **new_watches, size_t *new_count, int fd, const struct watch_target *target)
+{
+	struct watch *watch = NULL;
+	struct watch_target *targets;
+	struct watch_target *added;
+	char proc_path[64];
+	size_t i;
+	int wd;
+
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	if ( (wd = inotify_add_watch(watch_fd, proc_path, WATCH_MASK | IN_MASK_ADD)) < 0) {
+		return -errno;
+	}
+
+	for (i = 0; i < *new_count; i++) {
+		if ((*new_watches)[i].wd == wd) {
+			watch = &(*new_watches)[i];
+			break;
+		}
+	}
+	if (!watch) {
+		struct watch *grown = realloc(*new_watches, (*new_count + 1) * sizeof(struct watch));
+		if (!grown) {
+			return -ENOMEM;
+		}
+		*new_watches = grown;
+		watch = &grown[(*new_count)++];
+		memset(watch, 0, sizeof(struct watch));
+		watch->wd = wd;
+	}
+
+	for (i = 0; i < watch->target_count; i++) {
+		if (watch_str_eq(watch->targets[i].path, target->path) &&
+				watch_str_eq(watch->targets[i].name, target->name) &&
+				watch->targets[i].out_item == target->out_item &&
+				watch->targets[i].in_item == target->in_item) {
+			return 0;
+		}
+	}
+	targets = realloc(watch->targets, (watch->target_count + 1) * sizeof(struct watch_target));
+	if (!targets) {
+		return -ENOMEM;
+	}
+	watch->targets = targets;
+	added = &targets[watch->target_count];
+	memcpy(added, target, sizeof(struct watch_target));
+	added->path = target->path ? strdup(target->path) : NULL;
+	added->name = target->name ? strdup(target->name) : NULL;
+	if ((target->path && !added->path) || (target->name && !added->name)) {
+		free(added->path);
+		free(added->name);
+		return -ENOMEM;
+	}
+	watch->target_count++;
+	return 0;
+}
+
+/*
+ * Watches the closest existing parent of the given in_item's missing
+ * directory for it appearing.  Expects watch_lock to be held.  Returns 0 or
+ * -errno.
+ */
+int watch_missing(struct watch **new_watches, size_t *new_count, struct in_item *item, size_t out_item)
+{
+	struct watch_target target = { NULL, NULL, out_item, -1 };
+	struct stat stbuf;
+	char path[item->stratum_path_len + 1];
+	char *slash;
+	int fd;
+	int ret;
+
+	if (item->root_fd < 0) {
+		/* the stratum is unavailable until the next reparse anyway */
+		return 0;
+	}
+
+	memcpy(path, item->stratum_path, item->stratum_path_len + 1);
+	while ( (slash = strrchr(path, '/')) ) {
+		*slash = '\0';
+		fd = brp_openat(item->root_fd, path[0] ? path : "/", O_PATH | O_DIRECTORY);
+		if (fd == -ENOENT) {
+			continue;
+		} else if (fd < 0) {
+			return fd;
+		}
+		/*
+		 * Anything else in the way, e.g. a dangling symlink, may be
+		 * fixed without slash + 1 appearing.
+		 */
+		if (fstatat(fd, slash + 1, &stbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+			close(fd);
+			return -ENOTDIR;
+		}
+		target.name = slash + 1;
+		ret = watch_add(new_watches, new_count, fd, &target);
+		close(fd);
+		return ret;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Watches the given directory out_item's in_items and (re)builds its name
+ * index.  Each directory is watched before it is listed so that no changes
+ * are missed.  If any cannot be, the index is left invalid, and so is not
+ * consulted.  Expects watch_lock to be held.
+ */
+void watch_index(struct config *conf, struct watch **new_watches, size_t *new_count, size_t i)
+{
+	struct out_item *out_item = &conf->out_items[i];
+	struct name_index *index = conf->name_indexes ? &conf->name_indexes[i] : NULL;
+	struct watch_target target = { out_item->path, NULL, i, 0 };
+	struct dir_scan *scans = NULL;
+	size_t scan_items[out_item->in_item_count + 1];
+	size_t scan_count = 0;
+	int valid = index != NULL;
+	size_t j;
+	int fd;
+
+	if (index) {
+		name_index_clear(index);
+		if (! (scans = malloc((out_item->in_item_count + 1) * sizeof(struct dir_scan))) ) {
+			valid = 0;
+		}
+	}
+
+	for (j = 0; j < out_item->in_item_count; j++) {
+		struct in_item *in_item = &out_item->in_items[j];
+		if ( (fd = in_item_open(in_item, "", O_RDONLY | O_DIRECTORY)) == -ENOENT) {
+			if (watch_missing(new_watches, new_count, in_item, i) < 0) {
+				valid = 0;
+			}
+			/* it may have appeared before the watch was in place */
+			fd = in_item_open(in_item, "", O_RDONLY | O_DIRECTORY);
+		}
+		if (fd < 0) {
+			valid &= fd == -ENOENT;
+			continue;
+		}
+
+		target.in_item = j;
+		if (watch_add(new_watches, new_count, fd, &target) < 0) {
+			valid = 0;
+		}
+		if (valid) {
+			scan_items[scan_count] = j;
+			scans[scan_count++].fd = fd;
+		} else {
+			close(fd);
+		}
+	}
+
+	/* everything is watched, so now it can all be read at once */
+	dir_scan_run(scans, scan_count);
+	for (j = 0; j < scan_count; j++) {
+		if (valid && (scans[j].ret < 0 ||
+				name_index_add_names(index, scan_items[j], scans[j].names, scans[j].name_count) < 0)) {
+			valid = 0;
+		}
+		dir_scan_free(&scans[j]);
+	}
+	free(scans);
+
+	if (valid) {
+		name_index_validate(index);
+	}
+}
+
+/*
+ * Watches the directories conf unions, and stops watching any others.  The
+ * name indexes of the config previously watched are no longer kept up to
+ * date, and so are cleared.
+ */
+void watch_config(struct config *conf)
+{
+	struct watch *new_watches = NULL;
+	size_t new_count = 0;
+	size_t i, j;
+
+	pthread_mutex_lock(&watch_lock);
+	if (watch_fd < 0 || conf == watched_config ||
+			(watched_config && conf->generation < watched_config->generation)) {
+		pthread_mutex_unlock(&watch_lock);
+		return;
+	}
+
+	if (!conf->name_indexes) {
+		struct name_index *indexes = calloc(conf->out_item_count + 1, sizeof(struct name_index));
+		for (i = 0; indexes && i < conf->out_item_count; i++) {
+			name_index_init(&indexes[i], conf->out_items[i].in_item_count);
+		}
+		__atomic_store_n(&conf->name_indexes, indexes, __ATOMIC_RELEASE);
+	}
+
+	/*
+	 * Watches on the same directories are kept rather than removed and
+	 * added again, so that no changes are missed in between.
+	 */
+	for (i = 0; i < conf->out_item_count; i++) {
+		struct out_item *out_item = &conf->out_items[i];
+		if (out_item->file_type == FILE_TYPE_DIRECTORY) {
+			watch_index(conf, &new_watches, &new_count, i);
+			continue;
+		}
+		for (j = 0; j < out_item->in_item_count; j++) {
+			struct in_item *in_item = &out_item->in_items[j];
+			const char *slash = strrchr(in_item->stratum_path, '/');
+			if (!slash || slash[1] == '\0') {
+				continue;
+			}
+			char dir[slash - in_item->stratum_path + 2];
+			memcpy(dir, in_item->stratum_path, slash - in_item->stratum_path);
+			dir[slash - in_item->stratum_path] = '\0';
+			int fd = brp_openat(in_item->root_fd, dir[0] ? dir : "/", O_PATH | O_DIRECTORY);
+			if (fd >= 0) {
+				struct watch_target target = { out_item->path, (char *)slash + 1, -1, -1 };
+				watch_add(&new_watches, &new_count, fd, &target);
+				close(fd);
+			}
+		}
+	}
+
+	for (i = 0; i < watch_count; i++) {
+		for (j = 0; j < new_count && new_watches[j].wd != watches[i].wd; j++) {
+		}
+		if (j == new_count && watches[i].wd != config_wd && watches[i].wd != enabled_wd) {
+			inotify_rm_watch(watch_fd, watches[i].wd);
+		}
+		watch_free(&watches[i]);
+	}
+	free(watches);
+	watches = new_watches;
+	watch_count = new_count;
+
+	if (watched_config) {
+		for (i = 0; watched_config->name_indexes && i < watched_config->out_item_count; i++) {
+			name_index_clear(&watched_config->name_indexes[i]);
+		}
+		dir_times_reset(watched_config, 0);
+		config_put(watched_config);
+	}
+	config_ref(conf);
+	watched_config = conf;
+	dir_times_reset(conf, 1);
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/*
+ * Drops everything cached about the given incoming path, by brp and by the
+ * kernel, so that it is looked up afresh on next access.
+ */
+void invalidate_path(const char *path)
+{
+	struct invalidation inval;
+	struct node *node;
+	fuse_ino_t parent;
+	int found = 0;
+
+	cache_invalidate(path, hash_str(path));
+	listing_invalidate(path);
+
+	pthread_mutex_lock(&node_lock);
+	node = node_find_path(path, &parent);
+	if (node) {
+		node->resolved = 0;
+		found = session && invalidation_init(&inval, node);
+	}
+	pthread_mutex_unlock(&node_lock);
+
+	if (!session) {
+		return;
+	}
+	/* errors are ignored, as in invalidate_kernel_cache_thread() */
+	if (found) {
+		struct config *conf = config_get();
+		invalidate_inode(conf, &inval);
+		config_put(conf);
+		free(inval.name);
+		free(inval.path);
+	}
+	if (parent) {
+		const char *name = strrchr(path, '/') + 1;
+		fuse_lowlevel_notify_inval_entry(session, parent, name, strlen(name));
+	}
+}
+
+/*
+ * Drops everything cached about every incoming path, by brp and by the
+ * kernel.
+ */
+void invalidate_all()
+{
+	struct node *node;
+	size_t i;
+
+	cache_clear();
+	listing_clear();
+	pthread_mutex_lock(&node_lock);
+	for (i = 0; i < bucket_count; i++) {
+		for (node = ino_buckets[i]; node; node = node->ino_next) {
+			node->resolved = 0;
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+	invalidate_kernel_cache();
+}
+
+/*
+ * Something was lost, so treat everything as having changed.
+ */
+void watch_overflow()
+{
+	size_t i;
+
+	pthread_mutex_lock(&watch_lock);
+	for (i = 0; watched_config && i < watched_config->out_item_count; i++) {
+		if (watched_config->out_items[i].file_type == FILE_TYPE_DIRECTORY) {
+			watch_index(watched_config, &watches, &watch_count, i);
+		}
+	}
+	if (watched_config) {
+		dir_times_reset(watched_config, 1);
+	}
+	pthread_mutex_unlock(&watch_lock);
+
+	invalidate_all();
+}
+
+/*
+ * Brings the config in line with a stratum's file in ENABLED_STRATA having
+ * been added or removed.
+ */
+void watch_enabled(const char *name)
+{
+	struct config *conf;
+	struct stat stbuf;
+	int enabled, was_enabled;
+
+	if (name[0] == '.') {
+		return;
+	}
+
+	char path[strlen(ENABLED_STRATA) + strlen(name) + 2];
+	strcpy(path, ENABLED_STRATA);
+	strcat(path, "/");
+	strcat(path, name);
+	enabled = lstat(path, &stbuf) == 0 && S_ISREG(stbuf.st_mode);
+
+	conf = config_get();
+	was_enabled = str_in(conf->strata, conf->stratum_count, name);
+	config_put(conf);
+
+	if (enabled != was_enabled) {
+		reload_request(enabled ? '+' : '-', name);
+	}
+}
+
+/*
+ * Updates the name indexes for and invalidates the incoming paths affected
+ * by an event on one of the watched strata directories.
+ */
+void watch_backing(struct inotify_event *event)
+{
+	struct watch *watch;
+	struct name_index *index;
+	struct stat stbuf;
+	char **paths = NULL;
+	size_t path_count = 0;
+	size_t *rebuild = NULL;
+	size_t rebuild_count = 0;
+	size_t i, j, k;
+
+	pthread_mutex_lock(&watch_lock);
+	for (i = 0; i < watch_count && watches[i].wd != event->wd; i++) {
+	}
+	if (i == watch_count) {
+		pthread_mutex_unlock(&watch_lock);
+		return;
+	}
+	watch = &watches[i];
+	paths = malloc(2 * watch->target_count * sizeof(char *));
+	rebuild = malloc(watch->target_count * sizeof(size_t));
+
+	for (j = 0; j < watch->target_count; j++) {
+		struct watch_target *target = &watch->targets[j];
+		if (target->name && event->len > 0 && strcmp(target->name, event->name) != 0) {
+			continue;
+		}
+
+		/*
+		 * Whatever changed within a backing directory changed its
+		 * times, and so those of the virtual directories above it.
+		 * Anything else is rare enough to start afresh.
+		 */
+		if (target->out_item >= 0 && target->in_item >= 0) {
+			struct out_item *out_item = &watched_config->out_items[target->out_item];
+			if (in_item_stat(&out_item->in_items[target->in_item], "", &stbuf) >= 0 && S_ISDIR(stbuf.st_mode)) {
+				dir_times_raise(watched_config, out_item->path, &stbuf);
+			}
+		} else {
+			dir_times_reset(watched_config, 1);
+		}
+
+		if (target->out_item >= 0 && watched_config->name_indexes) {
+			index = &watched_config->name_indexes[target->out_item];
+			if (target->in_item >= 0 && event->len > 0) {
+				if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+					name_index_add(index, target->in_item, event->name);
+				} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					name_index_remove(index, target->in_item, event->name);
+				}
+			} else if (target->in_item < 0 || (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+				/* a missing directory appeared, or a watched one went away */
+				name_index_clear(index);
+				dir_times_reset(watched_config, 1);
+				for (k = 0; rebuild && k < rebuild_count && rebuild[k] != target->out_item; k++) {
+				}
+				if (rebuild && k == rebuild_count) {
+					rebuild[rebuild_count++] = target->out_item;
+				}
+			}
+		}
+
+		/*
+		 * Gather the paths to invalidate for afterwards, as that
+		 * notifies the kernel, which may in turn call back into brp.
+		 */
+		if (!target->path || !paths) {
+			continue;
+		}
+		if (!target->name && event->len > 0) {
+			size_t path_len = strlen(target->path);
+			size_t name_len = strlen(event->name);
+			char *path = malloc(path_len + name_len + 2);
+			if (path) {
+				memcpy(path, target->path, path_len);
+				path[path_len] = '/';
+				memcpy(path + path_len + 1, event->name, name_len + 1);
+				paths[path_count++] = path;
+			}
+		}
+		if ( (paths[path_count] = strdup(target->path)) ) {
+			path_count++;
+		}
+	}
+
+	/* this may grow watches, and so is done last */
+	for (k = 0; k < rebuild_count; k++) {
+		watch_index(watched_config, &watches, &watch_count, rebuild[k]);
+	}
+	pthread_mutex_unlock(&watch_lock);
+	free(rebuild);
+
+	/*
+	 * Which paths a directory appearing or going away affects is not
+	 * tracked, but it is rare.
+	 */
+	if (rebuild_count > 0) {
+		invalidate_all();
+	}
+
+	for (i = 0; i < path_count; i++) {
+		invalidate_path(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+
+	if (rebuild_count > 0 || path_count > 0) {
+		index_request();
+	}
+}
+
+void *watch_thread(void *arg)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	ssize_t len;
+	char *p;
+
+	(void)arg;
+
+	for (;;) {
+		len = read(watch_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "brp: unable to read inotify events: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *)p;
+			if (event->mask & IN_Q_OVERFLOW) {
+				watch_overflow();
+			} else if (event->mask & IN_IGNORED) {
+				continue;
+			} else if (event->wd == config_wd) {
+				if (event->len > 0 && strcmp(event->name, CONFIG_NAME) == 0 &&
+						check_config_secure(CONFIG)) {
+					reload_request('\0', NULL);
+				}
+			} else if (event->wd == enabled_wd) {
+				if (event->len > 0) {
+					watch_enabled(event->name);
+				}
+			} else {
+				watch_backing(event);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts watching, unless disabled or unsupported, in which case brp only
+ * reloads when told to.
+ */
+void watch_init()
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct config *conf;
+
+	if (!options.watch) {
+		return;
+	}
+
+	if ( (watch_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+		fprintf(stderr, "brp: unable to watch for changes: %s\n", strerror(errno));
+		return;
+	}
+	config_wd = inotify_add_watch(watch_fd, CONFIG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+	enabled_wd = inotify_add_watch(watch_fd, ENABLED_STRATA, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+
+	conf = config_get();
+	watch_config(conf);
+	config_put(conf);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, watch_thread, NULL) != 0) {
+		fprintf(stderr, "brp: unable to create thread to watch for changes\n");
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * ============================================================================
+ * command index
+ * ============================================================================
+ *
+ * brp publishes which stratum provides each file in its [brc-wrap] items in
+ * BRP_INDEX, so that, e.g., `bri -w` does not need to go through brp and
+ * read the wrapper script to find out.  See libbedrock.h for the format and
+ * the reading side.
+ *
+ * The index is rebuilt in the background whenever the config is reloaded or
+ * the watched directories change.  brp keeps the file mapped and updates it
+ * in place, under its seq count, so long as the new contents fit; otherwise
+ * it writes a bigger file, renames it into place, and marks the old one
+ * retired.
+ */
+
+/* protects the two below, and index publishing against index_shutdown() */
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t index_cond = PTHREAD_COND_INITIALIZER;
+int index_requested = 0;
+int index_stopped = 0;
+
+/* BRP_INDEX as last written, only used by the index thread */
+struct brp_index_header *index_map = NULL;
+size_t index_map_size = 0;
+uint64_t index_generation = 0;
+
+/*
+ * Index contents being gathered.  String offsets are relative to strings
+ * until index_layout() places them.
+ */
+struct index_build {
+	struct brp_index_entry *entries;
+	size_t entry_count;
+	size_t entry_alloc;
+	char *strings;
+	size_t strings_len;
+	size_t strings_alloc;
+};
+
+/*
+ * Appends the concatenation of a and b to build->strings.  Returns its
+ * offset, or -1 on allocation failure.
+ */
+ssize_t index_string(struct index_build *build, const char *a, const char *b)
+{
+	size_t a_len = strlen(a);
+	size_t b_len = strlen(b);
+	size_t offset = build->strings_len;
+
+	if (offset + a_len + b_len + 1 > build->strings_alloc) {
+		size_t new_alloc = build->strings_alloc ? build->strings_alloc * 2 : 4096;
+		while (new_alloc < offset + a_len + b_len + 1) {
+			new_alloc *= 2;
+		}
+		char *new_strings = realloc(build->strings, new_alloc);
+		if (!new_strings) {
+			return -1;
+		}
+		build->strings = new_strings;
+		build->strings_alloc = new_alloc;
+	}
+	memcpy(build->strings + offset, a, a_len);
+	memcpy(build->strings + offset + a_len, b, b_len + 1);
+	build->strings_len += a_len + b_len + 1;
+	return offset;
+}
+
+/*
+ * Resolves path as brp would for root, and adds what provides it if it is a
+ * [brc-wrap] file.  Returns 0 or -ENOMEM.
+ */
+int index_add(struct config *conf, struct index_build *build, char *path)
+{
+	struct out_item *out_item;
+	struct in_item *in_item;
+	struct brp_index_entry *entry;
+	struct stat stbuf;
+	char *tail;
+	ssize_t offsets[3];
+
+	if (corresponding_scan(conf, path, &stbuf, &out_item, &in_item, &tail) < 0 ||
+			out_item->filter != FILTER_BRC_WRAP || S_ISDIR(stbuf.st_mode)) {
+		return 0;
+	}
+
+	if (build->entry_count == build->entry_alloc) {
+		size_t new_alloc = build->entry_alloc ? build->entry_alloc * 2 : 256;
+		struct brp_index_entry *new_entries = realloc(build->entries, new_alloc * sizeof(struct brp_index_entry));
+		if (!new_entries) {
+			return -ENOMEM;
+		}
+		build->entries = new_entries;
+		build->entry_alloc = new_alloc;
+	}
+
+	if ( (offsets[0] = index_string(build, path, "")) < 0 ||
+			(offsets[1] = index_string(build, in_item->stratum, "")) < 0 ||
+			(offsets[2] = index_string(build, in_item->stratum_path, tail)) < 0) {
+		return -ENOMEM;
+	}
+
+	entry = &build->entries[build->entry_count++];
+	entry->next = 0;
+	entry->hash = brp_index_hash(path);
+	entry->path = offsets[0];
+	entry->stratum = offsets[1];
+	entry->stratum_path = offsets[2];
+	entry->filter = BRP_INDEX_FILTER_BRC_WRAP;
+	return 0;
+}
+
+/*
+ * Gathers the index contents for conf.  Returns 0 or -errno.
+ */
+int index_gather(struct config *conf, struct index_build *build)
+{
+	struct out_item *out_item;
+	struct listing *listing;
+	size_t i, j, k;
+	int ret = 0;
+
+	for (i = 0; ret == 0 && i < conf->out_item_count; i++) {
+		out_item = &conf->out_items[i];
+		if (out_item->filter != FILTER_BRC_WRAP) {
+			continue;
+		}
+		/* items sharing a path are covered by the first of them */
+		for (j = 0; j < i; j++) {
+			if (strcmp(conf->out_items[j].path, out_item->path) == 0) {
+				break;
+			}
+		}
+		if (j < i) {
+			continue;
+		}
+
+		if (out_item->file_type != FILE_TYPE_DIRECTORY) {
+			char path[out_item->path_len + 1];
+			strcpy(path, out_item->path);
+			ret = index_add(conf, build, path);
+			continue;
+		}
+
+		if (list_directory(conf, out_item->path, 0, 0, &listing) < 0) {
+			continue;
+		}
+		for (k = 0; ret == 0 && k < listing->name_count; k++) {
+			const char *name = listing->names[k];
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+				continue;
+			}
+			char path[out_item->path_len + strlen(name) + 2];
+			sprintf(path, "%s/%s", out_item->path, name);
+			ret = index_add(conf, build, path);
+		}
+		listing_put(listing);
+	}
+
+	return ret;
+}
+
+/*
+ * Lays the gathered contents out as the file should be.  Returns the
+ * contents, to be freed by the caller, or NULL on allocation failure.
+ */
+char *index_layout(struct index_build *build, size_t *len)
+{
+	struct brp_index_header *header;
+	uint64_t *buckets;
+	struct brp_index_entry *entries;
+	size_t bucket_count = build->entry_count > 0 ? build->entry_count : 1;
+	size_t buckets_offset = sizeof(struct brp_index_header);
+	size_t entries_offset = buckets_offset + bucket_count * sizeof(uint64_t);
+	size_t strings_offset = entries_offset + build->entry_count * sizeof(struct brp_index_entry);
+	size_t i;
+	char *buf;
+
+	*len = strings_offset + build->strings_len;
+	if (! (buf = calloc(1, *len)) ) {
+		return NULL;
+	}
+
+	header = (struct brp_index_header *) buf;
+	memcpy(header->magic, BRP_INDEX_MAGIC, sizeof(header->magic));
+	header->version = BRP_INDEX_VERSION;
+	header->generation = ++index_generation;
+	header->buckets = buckets_offset;
+	header->bucket_count = bucket_count;
+	header->entry_count = build->entry_count;
+
+	buckets = (uint64_t *) (buf + buckets_offset);
+	entries = (struct brp_index_entry *) (buf + entries_offset);
+	for (i = 0; i < build->entry_count; i++) {
+		entries[i] = build->entries[i];
+		entries[i].path += strings_offset;
+		entries[i].stratum += strings_offset;
+		entries[i].stratum_path += strings_offset;
+		entries[i].next = buckets[entries[i].hash % bucket_count];
+		buckets[entries[i].hash % bucket_count] = entries_offset + i * sizeof(struct brp_index_entry);
+	}
+	memcpy(buf + strings_offset, build->strings, build->strings_len);
+
+	return buf;
+}
+
+/*
+ * Maps the index file at path for writing, if it looks like one.
+ */
+struct brp_index_header *index_map_file(const char *path, size_t *size)
+{
+	struct brp_index_header *header;
+	struct stat stbuf;
+	int fd;
+
+	if ( (fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &stbuf) < 0 || (size_t) stbuf.st_size < sizeof(struct brp_index_header)) {
+		close(fd);
+		return NULL;
+	}
+	header = mmap(NULL, stbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return NULL;
+	}
+	if (memcmp(header->magic, BRP_INDEX_MAGIC, sizeof(header->magic)) != 0) {
+		munmap(header, stbuf.st_size);
+		return NULL;
+	}
+	*size = stbuf.st_size;
+	return header;
+}
+
+void index_seq_begin(struct brp_index_header *header)
+{
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void index_seq_end(struct brp_index_header *header)
+{
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Tells any readers of the mapped index file to move on to its replacement,
+ * and unmaps it.
+ */
+void index_retire(struct brp_index_header *header, size_t size)
+{
+	index_seq_begin(header);
+	__atomic_store_n(&header->retired, 1, __ATOMIC_RELEASE);
+	index_seq_end(header);
+	munmap(header, size);
+}
+
+/*
+ * Makes buf the contents of BRP_INDEX.  Returns 0 or -errno.
+ */
+int index_publish(const char *buf, size_t len)
+{
+	struct brp_index_header *old = index_map;
+	size_t old_size = index_map_size;
+	struct brp_index_header *header;
+	size_t size;
+	size_t skip = offsetof(struct brp_index_header, generation);
+	long page_size = sysconf(_SC_PAGESIZE);
+	int fd;
+
+	if (index_map && len <= index_map_size) {
+		index_seq_begin(index_map);
+		memcpy((char *) index_map + skip, buf + skip, len - skip);
+		index_seq_end(index_map);
+		return 0;
+	}
+
+	/*
+	 * Leave room to grow, so that the common case of a few executables
+	 * being added is done in place.
+	 */
+	size = len + len / 2;
+	size = (size + page_size - 1) / page_size * page_size;
+
+	if ( (fd = open(BRP_INDEX ".new", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		return -errno;
+	}
+	if (ftruncate(fd, size) < 0) {
+		int ret = -errno;
+		close(fd);
+		unlink(BRP_INDEX ".new");
+		return ret;
+	}
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		int ret = -errno;
+		unlink(BRP_INDEX ".new");
+		return ret;
+	}
+	memcpy(header, buf, len);
+
+	/* left behind by a previous brp, its readers need to move on too */
+	if (!old) {
+		old = index_map_file(BRP_INDEX, &old_size);
+	}
+
+	if (rename(BRP_INDEX ".new", BRP_INDEX) < 0) {
+		int ret = -errno;
+		unlink(BRP_INDEX ".new");
+		munmap(header, size);
+		if (old && old != index_map) {
+			munmap(old, old_size);
+		}
+		return ret;
+	}
+
+	if (old) {
+		index_retire(old, old_size);
+	}
+	index_map = header;
+	index_map_size = size;
+	return 0;
+}
+
+void *index_thread(void *arg)
+{
+	struct index_build build;
+	struct config *conf;
+	char *buf;
+	size_t len;
+	int ret;
+
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&index_lock);
+		while (!index_requested) {
+			pthread_cond_wait(&index_cond, &index_lock);
+		}
+		index_requested = 0;
+		pthread_mutex_unlock(&index_lock);
+
+		memset(&build, 0, sizeof(build));
+		conf = config_get();
+		ret = index_gather(conf, &build);
+		config_put(conf);
+
+		if (ret >= 0) {
+			if ( (buf = index_layout(&build, &len)) ) {
+				pthread_mutex_lock(&index_lock);
+				if (!index_stopped) {
+					ret = index_publish(buf, len);
+				}
+				pthread_mutex_unlock(&index_lock);
+				free(buf);
+			} else {
+				ret = -ENOMEM;
+			}
+		}
+		if (ret < 0) {
+			fprintf(stderr, "brp: unable to update " BRP_INDEX ": %s\n", strerror(-ret));
+		}
+		free(build.entries);
+		free(build.strings);
+
+		struct timespec delay = { 0, INDEX_DELAY_MS * 1000000L };
+		nanosleep(&delay, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Has the index thread rebuild BRP_INDEX soon.
+ */
+void index_request()
+{
+	if (!options.index) {
+		return;
+	}
+	pthread_mutex_lock(&index_lock);
+	index_requested = 1;
+	pthread_cond_signal(&index_cond);
+	pthread_mutex_unlock(&index_lock);
+}
+
+void index_init()
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (!options.index) {
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, index_thread, NULL) != 0) {
+		fprintf(stderr, "brp: unable to create thread to maintain " BRP_INDEX "\n");
+	}
+	pthread_attr_destroy(&attr);
+	index_request();
+}
+
+/*
+ * Removes BRP_INDEX as brp stops, so that nothing goes on trusting it once
+ * brp no longer keeps it up to date.  Readers which have it mapped are told
+ * to move on, and find it gone.
+ */
+void index_shutdown()
+{
+	pthread_mutex_lock(&index_lock);
+	index_stopped = 1;
+	if (index_map) {
+		unlink(BRP_INDEX);
+		index_retire(index_map, index_map_size);
+		index_map = NULL;
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+/*
+ * ============================================================================
+ * tracing
+ * ============================================================================
+ *
+ * With the trace option, brp records every op it serves to a file: which op,
+ * on which path, for whom, how long it took and what it replied.  The file
+ * is a trace_header followed by a ring of trace_records, mapped shared so
+ * that recording is a few stores and the file can be copied while brp runs.
+ * `brp --replay` runs a trace through brp's path resolution again; see the
+ * "trace replay" section below.
+ *
+ * Threads claim records with an atomic increment of head and fill them in
+ * without locking.  A record's seq is zeroed while it is being written and
+ * set last, so records which are torn, e.g. because brp stopped, or
+ * overwritten by a writer which lapped the ring are recognisable.
+ */
+
+#define TRACE_MAGIC "brptrace"
+#define TRACE_VERSION 1
+#define TRACE_PATH_MAX 216
+
+struct trace_record {
+	/* position in the trace, from 1, or 0 if not (yet) valid */
+	uint64_t seq;
+	/* offset of read, readdir and write ops */
+	uint64_t offset;
+	/* nanoseconds taken, saturating */
+	uint32_t latency;
+	/* size of read, readdir, write and xattr ops */
+	uint32_t size;
+	uint32_t uid;
+	uint32_t gid;
+	/* 0 or -errno */
+	int32_t result;
+	uint16_t op;
+	/* length of the path, which is truncated if TRACE_PATH_MAX or more */
+	uint16_t path_len;
+	char path[TRACE_PATH_MAX];
+};
+
+/* padded to a record, which the ring follows */
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t record_count;
+	/* records claimed so far */
+	uint64_t head;
+};
+
+struct trace_header *trace_header = NULL;
+struct trace_record *trace_records = NULL;
+
+/*
+ * What is known about an op before it is served.
+ */
+struct trace_pending {
+	uid_t uid;
+	gid_t gid;
+	size_t size;
+	off_t offset;
+	size_t path_len;
+	char path[TRACE_PATH_MAX];
+};
+
+/*
+ * Creates options.trace and starts recording to it.
+ */
+void trace_init()
+{
+	size_t size;
+	void *map;
+	int fd;
+
+	if (!options.trace || options.trace_records == 0) {
+		return;
+	}
+
+	size = (options.trace_records + 1) * sizeof(struct trace_record);
+	if ( (fd = open(options.trace, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		fprintf(stderr, "brp: unable to create trace %s: %s\n", options.trace, strerror(errno));
+		return;
+	}
+	if (ftruncate(fd, size) < 0 ||
+			(map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "brp: unable to create trace %s: %s\n", options.trace, strerror(errno));
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	trace_records = (struct trace_record *) map + 1;
+	trace_header = map;
+	memcpy(trace_header->magic, TRACE_MAGIC, sizeof(trace_header->magic));
+	trace_header->version = TRACE_VERSION;
+	trace_header->record_size = sizeof(struct trace_record);
+	trace_header->record_count = options.trace_records;
+}
+
+/*
+ * Notes what an op is about to be served for.  This has to be done
+ * beforehand, as req is gone once replied to and forget may free the node.
+ */
+void trace_begin(struct trace_pending *trace, fuse_req_t req, fuse_ino_t ino, const char *child, size_t size, off_t offset)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct node *node = ino ? node_get(ino) : NULL;
+	const char *path = node ? node->path : "";
+	int len;
+
+	trace->uid = context->uid;
+	trace->gid = context->gid;
+	trace->size = size;
+	trace->offset = offset;
+
+	if (child) {
+		len = snprintf(trace->path, sizeof(trace->path), "%s%s%s",
+				path, strcmp(path, "/") == 0 ? "" : "/", child);
+	} else {
+		len = snprintf(trace->path, sizeof(trace->path), "%s", path);
+	}
+	trace->path_len = len > 0 ? len : 0;
+}
+
+void trace_end(struct trace_pending *trace, enum op op, uint64_t latency, int result)
+{
+	uint64_t seq = __atomic_add_fetch(&trace_header->head, 1, __ATOMIC_RELAXED);
+	struct trace_record *record = &trace_records[(seq - 1) % trace_header->record_count];
+
+	__atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record->offset = trace->offset;
+	record->latency = MIN(latency, UINT32_MAX);
+	record->size = MIN(trace->size, UINT32_MAX);
+	record->uid = trace->uid;
+	record->gid = trace->gid;
+	record->result = result;
+	record->op = op;
+	record->path_len = MIN(trace->path_len, UINT16_MAX);
+	memcpy(record->path, trace->path, MIN(trace->path_len, TRACE_PATH_MAX - 1) + 1);
+
+	__atomic_store_n(&record->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * ============================================================================
+ * FUSE functions
+ * ============================================================================
+ *
+ * These implement the FUSE low-level API, which refers to files by inode
+ * number; see the "inode table" section above.  Errors are replied as
+ * positive errno values.
+ */
+
+/* what the current request was replied to with, for tracing */
+__thread int reply_errno = 0;
+
+int reply_err(fuse_req_t req, int err)
+{
+	reply_errno = err;
+	return fuse_reply_err(req, err);
+}
+
+/*
+ * Per-open state, stored in fuse_file_info's fh.
+ */
+struct open_file {
+	/* backing file for FILTER_PASS content, -1 otherwise */
+	int fd;
+	/*
+	 * FILTER_BRC_WRAP script or FILTER_EXEC output as of open, or
+	 * /.brp_stats contents, NULL otherwise
+	 */
+	char *wrapper;
+	size_t wrapper_len;
+};
+
+void open_file_free(struct open_file *file)
+{
+	if (file->fd >= 0) {
+		close(file->fd);
+	}
+	free(file->wrapper);
+	free(file);
+}
+
+/*
+ * Negotiate optional features with the kernel.
+ */
+static void brp_init(void *userdata, struct fuse_conn_info *conn)
+{
+	/* see brp_read() */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	}
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE) {
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+	}
+}
+
+/*
+ * Resolves name within parent_node and fills in e for it, creating a node
+ * for it or counting another lookup of the existing one.  Returns 0 or
+ * -errno.
+ */
+int entry_lookup(struct config *conf, const struct fuse_ctx *context, struct node *parent_node, const char *name, struct fuse_entry_param *e)
+{
+	struct out_item *out_item = NULL;
+	struct in_item *in_item = NULL;
+	char *tail = NULL;
+	struct node *node;
+	int type = NODE_ITEM;
+	int ret;
+
+	size_t parent_len = strlen(parent_node->path);
+	size_t name_len = strlen(name);
+	if (parent_len + name_len + 1 > PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+	char path[parent_len + name_len + 2];
+	strcpy(path, parent_node->path);
+	if (parent_node->type != NODE_ROOT) {
+		strcat(path, "/");
+	}
+	strcat(path, name);
+
+	memset(e, 0, sizeof(struct fuse_entry_param));
+
+	if (parent_node->type == NODE_ROOT && strcmp(name, "reparse_config") == 0) {
+		type = NODE_REPARSE_CONFIG;
+		memcpy(&e->attr, &reparse_stat, sizeof(reparse_stat));
+		ret = 0;
+	} else if (parent_node->type == NODE_ROOT && strcmp(name, ".brp_stats") == 0) {
+		type = NODE_STATS;
+		memcpy(&e->attr, &stats_stat, sizeof(stats_stat));
+		ret = 0;
+	} else if ( (ret = corresponding(conf, path, context->uid, context->gid, &e->attr, &out_item, &in_item, &tail)) >= 0) {
+		stat_filter(&e->attr, out_item->filter, in_item, tail);
+		stat_identity(conf, path, ret, out_item, in_item, tail, &e->attr);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (! (node = node_lookup(parent_node->ino, name, path, type)) ) {
+		return -ENOMEM;
+	}
+	if (type == NODE_ITEM) {
+		node_set_resolution(conf, node, ret, out_item, in_item, tail - path);
+	}
+	e->ino = node->ino;
+	e->attr_timeout = options.attr_timeout;
+	e->entry_timeout = options.entry_timeout;
+	return 0;
+}
+
+/*
+ * Look up a name within a directory, creating a node for it.  This and
+ * readdirplus are the only places the kernel hands brp a path component;
+ * everything else refers to the resulting inode number.
+ */
+static void brp_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct fuse_entry_param e;
+	struct node *parent_node;
+	struct config *conf;
+	int ret;
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+
+	if (! (parent_node = node_get(parent)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+
+	conf = config_get();
+	ret = entry_lookup(conf, context, parent_node, name, &e);
+	config_put(conf);
+
+	if (ret == -ENOENT && options.negative_timeout > 0 && negative_add(parent, name)) {
+		stat_inc(STAT_NEGATIVE_REPLY);
+		reply_errno = ENOENT;
+		/* an entry with inode number 0 lets the kernel cache the miss */
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = options.negative_timeout;
+		fuse_reply_entry(req, &e);
+	} else if (ret < 0) {
+		reply_err(req, -ret);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void brp_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void brp_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		node_forget(forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+/*
+ * FUSE calls its equivalent of stat(2) "getattr".  This just gets stat
+ * information, e.g. file size and permissions.
+ */
+static void brp_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct out_item *out_item;
+	struct in_item *in_item;
+	char *tail;
+	struct stat stbuf;
+	struct config *conf;
+	struct node *node;
+	int ret;
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+
+	if (! (node = node_get(ino)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+
+	conf = config_get();
+
+	switch (node->type) {
+	case NODE_ROOT:
+		memcpy(&stbuf, &parent_stat, sizeof(parent_stat));
+		stat_identity(conf, node->path, MATCH_ROOT, NULL, NULL, NULL, &stbuf);
+		ret = 0;
+		break;
+	case NODE_REPARSE_CONFIG:
+		memcpy(&stbuf, &reparse_stat, sizeof(reparse_stat));
+		ret = 0;
+		break;
+	case NODE_STATS:
+		memcpy(&stbuf, &stats_stat, sizeof(stats_stat));
+		ret = 0;
+		break;
+	default:
+		if ( (ret = node_resolve(conf, node, context->uid, context->gid, &stbuf, &out_item, &in_item, &tail)) >= 0) {
+			stat_filter(&stbuf, out_item->filter, in_item, tail);
+			stat_identity(conf, node->path, ret, out_item, in_item, tail, &stbuf);
+		}
+		break;
+	}
+
+	config_put(conf);
+
+	if (ret < 0) {
+		reply_err(req, -ret);
+	} else {
+		fuse_reply_attr(req, &stbuf, options.attr_timeout);
+	}
+}
+
+/*
+ * This is typically used to indicate a file should be shortened, e.g. by
+ * O_TRUNC.  Like write(), it is only being used here as an indication to
+ * reload the configuration and stratum information.
+ */
+static void brp_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	struct node *node;
+	int ret;
+
+	if (set_caller_fscreds(req) < 0) {
+		reply_err(req, EACCES);
+		return;
+	}
+
+	if (! (node = node_get(ino)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+
+	if (! (to_set & FUSE_SET_ATTR_SIZE)) {
+		reply_err(req, EACCES);
+	} else if ((ret = write_attempt(req, node, NULL, 0, -1)) < 0) {
+		reply_err(req, -ret);
+	}
+}
+
+/*
+ * Directory contents are gathered when the directory is opened and then
+ * handed out across however many readdir calls the kernel makes.
+ */
+static void brp_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct listing *listing;
+	struct config *conf;
+	struct node *node;
+	int ret;
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+
+	if (! (node = node_get(ino)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+	if (node->type == NODE_REPARSE_CONFIG || node->type == NODE_STATS) {
+		reply_err(req, ENOTDIR);
+		return;
+	}
+
+	conf = config_get();
+	ret = list_directory(conf, node->path, context->uid, context->gid, &listing);
+	config_put(conf);
+
+	if (ret < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+
+	fi->fh = (uintptr_t) listing;
+	if (fuse_reply_open(req, fi) != 0) {
+		listing_put(listing);
+	}
+}
+
+/*
+ * Fills in the inode number and file type of name within the directory at
+ * parent_path, the only parts of stbuf readdir uses, as lookup would.
+ * Unlike lookup this leaves out whatever is not needed for those, such as
+ * running exec-filters or merging directories' times.
+ */
+void dirent_stat(struct config *conf, const struct fuse_ctx *context, const char *parent_path, const char *name, struct stat *stbuf)
+{
+	struct out_item *out_item;
+	struct in_item *in_item;
+	char *tail;
+	int ret;
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	size_t parent_len = strlen(parent_path);
+	char path[parent_len + strlen(name) + 2];
+	strcpy(path, parent_path);
+	if (strcmp(name, "..") == 0) {
+		/* the root is its own parent */
+		char *slash = strrchr(path, '/');
+		if (slash == path) {
+			slash[1] = '\0';
+		} else {
+			*slash = '\0';
+		}
+		name = ".";
+	}
+	if (strcmp(name, ".") != 0) {
+		if (parent_len > 1) {
+			strcat(path, "/");
+		}
+		strcat(path, name);
+	}
+
+	if (strcmp(path, "/reparse_config") == 0) {
+		memcpy(stbuf, &reparse_stat, sizeof(reparse_stat));
+	} else if (strcmp(path, "/.brp_stats") == 0) {
+		memcpy(stbuf, &stats_stat, sizeof(stats_stat));
+	} else if ( (ret = corresponding(conf, path, context->uid, context->gid, stbuf, &out_item, &in_item, &tail)) >= 0) {
+		stbuf->st_ino = stat_ino(path, ret, stbuf);
+	} else {
+		/*
+		 * e.g. gone since the listing was made; the kernel only
+		 * finds out when it looks it up, but a zero inode number
+		 * would have some programs skip the entry entirely.
+		 */
+		memset(stbuf, 0, sizeof(struct stat));
+		stbuf->st_ino = ino_mix(hash_str(path));
+	}
+}
+
+/*
+ * Provides contents of a directory, e.g. as used by `ls`.  offset is the
+ * index into the listing gathered by brp_opendir().  Each entry's inode
+ * number and type match what a lookup of it reports; these mostly come from
+ * the lookup cache.
+ */
+static void brp_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct listing *listing = (struct listing *) (uintptr_t) fi->fh;
+	struct node *node;
+	struct config *conf;
+	struct stat stbuf;
+	size_t written = 0;
+	size_t entry_size;
+	size_t i;
+	int ret;
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+
+	if (! (node = node_get(ino)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+
+	char *buf = malloc(size);
+	if (!buf) {
+		reply_err(req, ENOMEM);
+		return;
+	}
+
+	conf = config_get();
+	for (i = offset; i < listing->name_count; i++) {
+		dirent_stat(conf, context, node->path, listing->names[i], &stbuf);
+		entry_size = fuse_add_direntry(req, buf + written, size - written, listing->names[i], &stbuf, i + 1);
+		if (entry_size > size - written) {
+			break;
+		}
+		written += entry_size;
+	}
+	config_put(conf);
+
+	fuse_reply_buf(req, buf, written);
+	free(buf);
+}
+
+/*
+ * Fills buf, which is size bytes long, with the entries of listing from
+ * offset on for brp_readdirplus(), looking each one up.  Sets *next to the
+ * offset to continue from.  Returns the number of bytes used.
+ */
+size_t readdirplus_fill(fuse_req_t req, struct config *conf, const struct fuse_ctx *context,
+		struct node *parent_node, struct listing *listing,
+		char *buf, size_t size, off_t offset, off_t *next)
+{
+	struct fuse_entry_param e;
+	size_t written = 0;
+	size_t entry_size;
+	size_t i;
+
+	for (i = offset; i < listing->name_count; i++) {
+		const char *name = listing->names[i];
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			/* not looked up; the kernel already knows these */
+			memset(&e, 0, sizeof(e));
+			e.attr.st_mode = S_IFDIR;
+		} else if (entry_lookup(conf, context, parent_node, name, &e) < 0) {
+			/*
+			 * e.g. gone since the listing was made; list it
+			 * without attributes, leaving the kernel to look it up.
+			 */
+			memset(&e, 0, sizeof(e));
+		}
+		entry_size = fuse_add_direntry_plus(req, buf + written, size - written, name, &e, i + 1);
+		if (entry_size > size - written) {
+			/* did not fit, and so the kernel will not count it */
+			if (e.ino) {
+				node_forget(e.ino, 1);
+			}
+			break;
+		}
+		written += entry_size;
+	}
+	*next = i;
+	return written;
+}
+
+/*
+ * Like brp_readdir(), but also looks up each entry, so that the kernel does
+ * not have to ask for each one's attributes separately afterwards, e.g. for
+ * `ls -l`.  Each entry returned counts as a lookup of it.
+ */
+static void brp_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct listing *listing = (struct listing *) (uintptr_t) fi->fh;
+	struct node *parent_node;
+	struct config *conf;
+	size_t written;
+	off_t next;
+	int ret;
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+
+	if (! (parent_node = node_get(ino)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+
+	char *buf = malloc(size);
+	if (!buf) {
+		reply_err(req, ENOMEM);
+		return;
+	}
+
+	conf = config_get();
+	written = readdirplus_fill(req, conf, context, parent_node, listing, buf, size, offset, &next);
+	config_put(conf);
+
+	fuse_reply_buf(req, buf, written);
+	free(buf);
+}
+
+static void brp_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	listing_put((struct listing *) (uintptr_t) fi->fh);
+	reply_err(req, 0);
+}
+
+/*
+ * Check if user has permissions to do something with file. e.g. read or write.
+ */
+static void brp_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct out_item *out_item;
+	struct in_item *in_item;
+	char *tail;
+	struct stat stbuf;
+	struct config *conf;
+	struct node *node;
+	int ret;
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+
+	if (! (node = node_get(ino)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+
+	/*
+	 * /reparse_config is the only file which could possibly be written to.
+	 * Get that out of the way here so we can assume everything else later is
+	 * only being read.
+	 */
+	if (node->type == NODE_REPARSE_CONFIG) {
+		if (context->uid != 0) {
+			/* Non-root users cannot do anything with this file. */
+			reply_err(req, EACCES);
+		} else {
+			fi->direct_io = 1;
+			fuse_reply_open(req, fi);
+		}
+		return;
+	}
+
+	/*
+	 * Everything else in this filesystem is read-only.  If the user requested
+	 * anything else, return EACCES.
+	 *
+	 * Note the way permissions are stored in fi->flags do *not* have a single
+	 * bit flag for read or write, hence the unusual looking check below.  See
+	 * `man 2 open`.
+	 */
+	if ((fi->flags & 3) != O_RDONLY ) {
+		reply_err(req, EACCES);
+		return;
+	}
+
+	if (node->type == NODE_ROOT) {
+		fuse_reply_open(req, fi);
+		return;
+	}
+
+	struct open_file *file = malloc(sizeof(struct open_file));
+	if (!file) {
+		reply_err(req, ENOMEM);
+		return;
+	}
+	file->fd = -1;
+	file->wrapper = NULL;
+
+	if (node->type == NODE_STATS) {
+		/* a snapshot, so that reading it in pieces is consistent */
+		if (! (file->wrapper = stats_contents(&file->wrapper_len)) ) {
+			open_file_free(file);
+			reply_err(req, ENOMEM);
+			return;
+		}
+		fi->direct_io = 1;
+		fi->fh = (uintptr_t) file;
+		if (fuse_reply_open(req, fi) != 0) {
+			open_file_free(file);
+		}
+		return;
+	}
+
+	conf = config_get();
+	if ( (ret = node_resolve(conf, node, context->uid, context->gid, &stbuf, &out_item, &in_item, &tail)) < 0) {
+		ret = -ENOENT;
+	} else if (out_item->filter == FILTER_PASS) {
+		/*
+		 * Unfiltered content is read straight from the backing file,
+		 * opened once here.  If it is the same, unmodified file as
+		 * last time, the kernel may keep the pages it has cached from
+		 * it rather than re-reading them through brp.
+		 */
+		if ( (file->fd = in_item_open(in_item, tail, O_RDONLY)) < 0) {
+			ret = file->fd;
+		} else if (fstat(file->fd, &stbuf) < 0) {
+			/* open_file_free() below closes it */
+			ret = -errno;
+		} else {
+			fi->keep_cache = node_check_backing(node, &stbuf);
+		}
+	} else if (out_item->filter == FILTER_BRC_WRAP) {
+		/*
+		 * Take a copy of the node's pre-rendered script so that reads
+		 * are a memcpy() from it.
+		 */
+		pthread_mutex_lock(&node_lock);
+		if (node->wrapper && (file->wrapper = malloc(node->wrapper_len))) {
+			memcpy(file->wrapper, node->wrapper, node->wrapper_len);
+			file->wrapper_len = node->wrapper_len;
+		}
+		pthread_mutex_unlock(&node_lock);
+	} else if (out_item->filter == FILTER_EXEC) {
+		/*
+		 * Likewise take a copy of the filter's output, so that reads
+		 * neither re-run the filter nor depend on the output staying
+		 * in the shared cache, which it may be too large for.  If
+		 * that fails, reads fall back to exec_filter().
+		 */
+		size_t total;
+		if (exec_filter_output(in_item, tail, NULL, 0, 0, &total, &file->wrapper) < 0) {
+			file->wrapper = NULL;
+		} else {
+			file->wrapper_len = total;
+		}
+	}
+	config_put(conf);
+
+	if (ret < 0) {
+		open_file_free(file);
+		reply_err(req, -ret);
+		return;
+	}
+
+	fi->fh = (uintptr_t) file;
+	if (fuse_reply_open(req, fi) != 0) {
+		/* interrupted; there will be no release */
+		open_file_free(file);
+	}
+}
+
+static void brp_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct open_file *file = (struct open_file *) (uintptr_t) fi->fh;
+	if (file) {
+		open_file_free(file);
+	}
+	reply_err(req, 0);
+}
+
+/*
+ * Read file contents.
+ */
+static void brp_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct out_item *out_item;
+	struct in_item *in_item;
+	char *tail;
+	char *config_str;
+	struct stat stbuf;
+	struct config *conf;
+	struct node *node;
+	struct open_file *file = (struct open_file *) (uintptr_t) fi->fh;
+	int ret;
+
+	/*
+	 * Unfiltered content was opened by brp_open(), which already checked
+	 * permissions.  Hand libfuse the backing file descriptor rather than
+	 * its contents so that, where the kernel supports it, the data is
+	 * spliced from the backing file to /dev/fuse without being copied
+	 * through brp.  How much that gains over copying has yet to be
+	 * measured; `make bench-exec` times large pass-through reads.
+	 */
+	if (file && file->fd >= 0) {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+		bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv.buf[0].fd = file->fd;
+		bufv.buf[0].pos = offset;
+		fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	char *buf = malloc(size);
+	if (!buf) {
+		reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (file && file->wrapper) {
+		ret = brc_wrap_copy(file->wrapper, file->wrapper_len, buf, size, offset);
+		fuse_reply_buf(req, buf, ret);
+		free(buf);
+		return;
+	}
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		free(buf);
+		reply_err(req, -ret);
+		return;
+	}
+
+	if (! (node = node_get(ino)) ) {
+		free(buf);
+		reply_err(req, ENOENT);
+		return;
+	}
+	if (node->type == NODE_ROOT) {
+		free(buf);
+		reply_err(req, EISDIR);
+		return;
+	}
+
+	conf = config_get();
+
+	if (node->type == NODE_REPARSE_CONFIG) {
+		config_str = config_contents(conf);
+		if (!config_str) {
+			ret = -ENOMEM;
+		} else if (offset >= strlen(config_str)) {
+			ret = 0;
+			free(config_str);
+		} else {
+			ret = MIN(strlen(config_str + offset), size);
+			memcpy(buf, config_str + offset, ret);
+			free(config_str);
+		}
+	} else if ( (ret = node_resolve(conf, node, context->uid, context->gid, &stbuf, &out_item, &in_item, &tail)) < 0) {
+		/* nothing to read */
+	} else if (out_item->filter == FILTER_BRC_WRAP && node_wrapper_copy(node, buf, size, offset, &ret)) {
+		/* served from the node's pre-rendered script */
+	} else {
+		ret = read_filter(out_item->filter, in_item, tail, buf, size, offset);
+	}
+
+	config_put(conf);
+
+	if (ret < 0) {
+		reply_err(req, -ret);
+	} else {
+		fuse_reply_buf(req, buf, ret);
+	}
+	free(buf);
+}
+
+/*
+ * This is typically used to write to a file, just as you'd expect from the
+ * name.  However, for this filesystem, we only use it as an indication to
+ * reload the configuration and stratum information.
+ */
+static void brp_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct node *node;
+	int ret;
+
+	if (set_caller_fscreds(req) < 0) {
+		reply_err(req, EACCES);
+		return;
+	}
+
+	if (! (node = node_get(ino)) ) {
+		reply_err(req, ENOENT);
+		return;
+	}
+
+	if ((ret = write_attempt(req, node, buf, size, size)) < 0) {
+		reply_err(req, -ret);
+	}
+}
+
+/*
+ * Extended attributes describing where a file comes from, so that, e.g.,
+ * `getfattr -n user.bedrock.stratum <mount-point>/bin/vim` tells which
+ * stratum provides vim.  Anything else, such as the security.capability
+ * the kernel asks about on exec, is answered without resolving the file.
+ *
+ * These are off unless the xattr option is given, in which case the kernel
+ * is told they are not implemented at all and stops asking; otherwise every
+ * exec and ACL check would cost a round trip.
+ */
+#define XATTR_PREFIX "user.bedrock."
+#define XATTR_PREFIX_LEN (sizeof(XATTR_PREFIX) - 1)
+static const char xattr_names[] =
+	XATTR_PREFIX "stratum\0"
+	XATTR_PREFIX "path\0"
+	XATTR_PREFIX "filter";
+
+/*
+ * Copies the value of the xattr XATTR_PREFIX<name> of ino into value, or if
+ * name is NULL only checks ino has them.  Returns the value's length or
+ * -errno.  The root, virtual directories and /reparse_config do not come
+ * from any one stratum and so have none.
+ */
+int xattr_get(fuse_req_t req, fuse_ino_t ino, const char *name, char *value, size_t size)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct out_item *out_item;
+	struct in_item *in_item;
+	char *tail;
+	struct stat stbuf;
+	struct config *conf;
+	struct node *node;
+	int ret;
+
+	if ((ret = set_caller_fscreds(req)) < 0) {
+		return ret;
+	}
+	if (! (node = node_get(ino)) ) {
+		return -ENOENT;
+	}
+	if (node->type != NODE_ITEM) {
+		return -ENODATA;
+	}
+
+	conf = config_get();
+	ret = node_resolve(conf, node, context->uid, context->gid, &stbuf, &out_item, &in_item, &tail);
+	if (ret == MATCH_VIRTUAL) {
+		ret = -ENODATA;
+	} else if (ret >= 0 && !name) {
+		ret = 0;
+	} else if (ret >= 0 && strcmp(name, "stratum") == 0) {
+		ret = snprintf(value, size, "%s", in_item->stratum);
+	} else if (ret >= 0 && strcmp(name, "path") == 0) {
+		ret = snprintf(value, size, "%s%s", in_item->stratum_path, tail);
+	} else if (ret >= 0 && strcmp(name, "filter") == 0) {
+		switch (out_item->filter) {
+		case FILTER_PASS:
+			ret = snprintf(value, size, "pass");
+			break;
+		case FILTER_BRC_WRAP:
+			ret = snprintf(value, size, "brc-wrap");
+			break;
+		case FILTER_EXEC:
+			ret = snprintf(value, size, "exec-filter");
+			break;
+		}
+	} else if (ret >= 0) {
+		ret = -ENODATA;
+	}
+	config_put(conf);
+
+	if (ret >= 0 && (size_t) ret >= size && name) {
+		ret = -ERANGE;
+	}
+	return ret;
+}
+
+/*
+ * Replies with an xattr value or list of length len, as appropriate for
+ * the size the caller asked for.
+ */
+void reply_xattr(fuse_req_t req, const char *value, size_t len, size_t size)
+{
+	if (size == 0) {
+		/* only asking how big it is */
+		fuse_reply_xattr(req, len);
+	} else if (size < len) {
+		reply_err(req, ERANGE);
+	} else {
+		fuse_reply_buf(req, value, len);
+	}
+}
+
+static void brp_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	char value[PATH_MAX];
+	int ret;
+
+	if (!options.xattr) {
+		reply_err(req, ENOSYS);
+		return;
+	}
+	if (strncmp(name, XATTR_PREFIX, XATTR_PREFIX_LEN) != 0) {
+		reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	if ((ret = xattr_get(req, ino, name + XATTR_PREFIX_LEN, value, sizeof(value))) < 0) {
+		reply_err(req, -ret);
+		return;
+	}
+	reply_xattr(req, value, ret, size);
+}
+
+static void brp_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	int ret;
+
+	if (!options.xattr) {
+		reply_err(req, ENOSYS);
+		return;
+	}
+
+	ret = xattr_get(req, ino, NULL, NULL, 0);
+	if (ret == -ENODATA) {
+		reply_xattr(req, NULL, 0, size);
+	} else if (ret < 0) {
+		reply_err(req, -ret);
+	} else {
+		reply_xattr(req, xattr_names, sizeof(xattr_names), size);
+	}
+}
+
+/*
+ * Each operation is counted, and its latency recorded, for /.brp_stats, and
+ * traced if enabled.  This includes sending the reply, but not what the
+ * reload thread does for writes to /reparse_config.  ino and child name the
+ * path the op is on, and size and offset what it reads, for tracing.
+ */
+#define TIMED(op, name, params, args, ino, child, size, offset)            \
+	static void timed_##name params                                     \
+	{                                                                   \
+		struct trace_pending trace;                                 \
+		struct timespec start;                                      \
+		uint64_t ns;                                                \
+		if (trace_header) {                                         \
+			trace_begin(&trace, req, ino, child, size, offset); \
+		}                                                           \
+		reply_errno = 0;                                            \
+		clock_gettime(CLOCK_MONOTONIC, &start);                     \
+		brp_##name args;                                            \
+		ns = stats_op(op, &start);                                  \
+		if (trace_header) {                                         \
+			trace_end(&trace, op, ns, -reply_errno);            \
+		}                                                           \
+	}
+
+TIMED(OP_LOOKUP, lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), parent, name, 0, 0)
+TIMED(OP_FORGET, forget, (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup), (req, ino, nlookup), ino, NULL, 0, 0)
+TIMED(OP_FORGET, forget_multi, (fuse_req_t req, size_t count, struct fuse_forget_data *forgets), (req, count, forgets), 0, NULL, 0, 0)
+TIMED(OP_GETATTR, getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+TIMED(OP_SETATTR, setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi), (req, ino, attr, to_set, fi), ino, NULL, 0, 0)
+TIMED(OP_OPENDIR, opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+TIMED(OP_READDIR, readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi), ino, NULL, size, offset)
+TIMED(OP_READDIRPLUS, readdirplus, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi), ino, NULL, size, offset)
+TIMED(OP_RELEASEDIR, releasedir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+TIMED(OP_OPEN, open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+TIMED(OP_READ, read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi), ino, NULL, size, offset)
+TIMED(OP_RELEASE, release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino, NULL, 0, 0)
+TIMED(OP_WRITE, write, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, buf, size, offset, fi), ino, NULL, size, offset)
+TIMED(OP_GETXATTR, getxattr, (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size), (req, ino, name, size), ino, NULL, size, 0)
+TIMED(OP_LISTXATTR, listxattr, (fuse_req_t req, fuse_ino_t ino, size_t size), (req, ino, size), ino, NULL, size, 0)
+
+static struct fuse_lowlevel_ops brp_oper = {
+	.init         = brp_init,
+	.lookup       = timed_lookup,
+	.forget       = timed_forget,
+	.forget_multi = timed_forget_multi,
+	.getattr      = timed_getattr,
+	.setattr      = timed_setattr,
+	.opendir      = timed_opendir,
+	.readdir      = timed_readdir,
+	.readdirplus  = timed_readdirplus,
+	.releasedir   = timed_releasedir,
+	.open         = timed_open,
+	.read         = timed_read,
+	.release      = timed_release,
+	.write        = timed_write,
+	.getxattr     = timed_getxattr,
+	.listxattr    = timed_listxattr,
+};
+
+/*
+ * ============================================================================
+ * trace replay
+ * ============================================================================
+ *
+ * `brp --replay <trace> [<bedrock-dir>] [-o <options>]` runs the ops
+ * recorded in a trace through the same path resolution and filtering brp
+ * serves them with, without FUSE or a mount, and reports the timings as
+ * /.brp_stats would.  This makes the cost of a real workload, such as a
+ * login or a desktop menu rebuild, reproducible, e.g. to compare builds.
+ *
+ * Given a bedrock-dir, its etc/brp.conf, run/enabled_strata and strata/
+ * are used instead of /bedrock's, e.g. a synthetic tree shaped like the
+ * system the trace was recorded on.  The options are those of a mount, e.g.
+ * to compare cache sizes.
+ *
+ * Only ops which resolve something are replayed: lookup, getattr, open,
+ * getxattr and listxattr resolve their path; read also filters what it
+ * reads; opendir lists the directory.  readdir and readdirplus hand out
+ * the listing opendir made, and the others do not touch the strata, so
+ * those are skipped, as are ops on paths too long to have been recorded.
+ */
+
+/* larger reads, which the kernel does not make, are skipped */
+#define REPLAY_READ_MAX (1024 * 1024)
+
+int replay_cmp(const void *a, const void *b)
+{
+	const struct trace_record *x = *(const struct trace_record **) a;
+	const struct trace_record *y = *(const struct trace_record **) b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Replays one record.  Returns 0 or -errno as brp would have replied, or 1
+ * if the op is not replayed.
+ */
+int replay_record(struct config *conf, const struct trace_record *record, char *buf)
+{
+	struct out_item *out_item;
+	struct in_item *in_item;
+	struct listing *listing;
+	struct stat stbuf;
+	char *tail;
+	char path[TRACE_PATH_MAX];
+	int ret;
+
+	if (record->path_len >= TRACE_PATH_MAX || record->path[0] != '/' ||
+			strcmp(record->path, "/reparse_config") == 0 ||
+			strcmp(record->path, "/.brp_stats") == 0) {
+		return 1;
+	}
+	strcpy(path, record->path);
+
+	switch (record->op) {
+	case OP_LOOKUP:
+	case OP_GETATTR:
+	case OP_OPEN:
+	case OP_GETXATTR:
+	case OP_LISTXATTR:
+		if ( (ret = corresponding(conf, path, record->uid, record->gid, &stbuf, &out_item, &in_item, &tail)) == MATCH_ROOT) {
+			stat_identity(conf, path, ret, NULL, NULL, NULL, &stbuf);
+		} else if (ret >= 0) {
+			stat_filter(&stbuf, out_item->filter, in_item, tail);
+			stat_identity(conf, path, ret, out_item, in_item, tail, &stbuf);
+		}
+		return ret < 0 ? ret : 0;
+
+	case OP_READ:
+		if ( (ret = corresponding(conf, path, record->uid, record->gid, &stbuf, &out_item, &in_item, &tail)) < 0) {
+			return ret;
+		}
+		ret = read_filter(out_item->filter, in_item, tail, buf, record->size, record->offset);
+		return ret < 0 ? ret : 0;
+
+	case OP_OPENDIR:
+		if ( (ret = list_directory(conf, path, record->uid, record->gid, &listing)) < 0) {
+			return ret;
+		}
+		listing_put(listing);
+		return 0;
+	}
+
+	return 1;
+}
+
+int replay(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct trace_header *header;
+	struct trace_record *records;
+	struct trace_record **order;
+	struct stat stbuf;
+	struct timespec start;
+	struct config *conf;
+	size_t count = 0;
+	size_t replayed = 0;
+	size_t differed = 0;
+	size_t i;
+	void *map;
+	char *buf;
+	char *stats_str;
+	size_t stats_len;
+	int fd;
+	int ret;
+
+	if (fuse_opt_parse(&args, &options, brp_opts, NULL) != 0 || args.argc < 2 || args.argc > 3) {
+		fprintf(stderr, "Usage: brp --replay <trace> [<bedrock-dir>] [-o <options>]\n");
+		return 1;
+	}
+
+	if (args.argc == 3) {
+		set_bedrock_dir(args.argv[2]);
+	}
+
+	if ( (fd = open(args.argv[1], O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &stbuf) < 0) {
+		fprintf(stderr, "brp: unable to read trace %s: %s\n", args.argv[1], strerror(errno));
+		return 1;
+	}
+	map = mmap(NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	header = map;
+	if (map == MAP_FAILED || (size_t) stbuf.st_size < sizeof(struct trace_record) ||
+			memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != TRACE_VERSION ||
+			header->record_size != sizeof(struct trace_record) ||
+			header->record_count > (size_t) stbuf.st_size / sizeof(struct trace_record) - 1) {
+		fprintf(stderr, "brp: %s is not a trace\n", args.argv[1]);
+		return 1;
+	}
+
+	/* the ring may have wrapped, so order by seq */
+	records = (struct trace_record *) map + 1;
+	if (! (order = malloc(header->record_count * sizeof(struct trace_record *))) ||
+			! (buf = malloc(REPLAY_READ_MAX)) ) {
+		fprintf(stderr, "brp: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < header->record_count; i++) {
+		if (records[i].seq != 0) {
+			order[count++] = &records[i];
+		}
+	}
+	qsort(order, count, sizeof(struct trace_record *), replay_cmp);
+
+	cache_init();
+	dir_scan_init();
+	if (! (conf = parse_config()) ) {
+		exit(1);
+	}
+	config_publish(conf);
+
+	conf = config_get();
+	for (i = 0; i < count; i++) {
+		if (order[i]->op == OP_READ && order[i]->size > REPLAY_READ_MAX) {
+			continue;
+		}
+		/* as brp would have served it, if running as root */
+		if (geteuid() == 0 && set_thread_fscreds(order[i]->uid, order[i]->gid, 0, NULL) < 0) {
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = replay_record(conf, order[i], buf);
+		if (ret == 1) {
+			continue;
+		}
+		stats_op(order[i]->op, &start);
+		replayed++;
+		if ((ret < 0) != (order[i]->result < 0)) {
+			differed++;
+		}
+	}
+	config_put(conf);
+	set_thread_fscreds(0, 0, 0, NULL);
+
+	printf("# %zu of %zu recorded ops replayed, %zu with a different outcome\n\n", replayed, count, differed);
+	if ( (stats_str = stats_contents(&stats_len)) ) {
+		fwrite(stats_str, 1, stats_len, stdout);
+		free(stats_str);
+	}
+
+	free(buf);
+	free(order);
+	fuse_opt_free_args(&args);
+	return 0;
+}
+
+/*
+ * ============================================================================
+ * config dump
+ * ============================================================================
+ *
+ * `brp --dump-config [<bedrock-dir>]` parses the config and prints what it
+ * parsed to, in the form the awk program parse_config() used to run printed
+ * it in, less its first line (the longest line's length, which the C parser
+ * has no use for): the item count, then for each item its path, its type
+ * ("normal" or "directory"), its filter, its in_item count and each
+ * in_item's stratum and path on lines of their own.  test-config.sh compares
+ * the two.  Given a bedrock-dir, its etc/brp.conf and run/enabled_strata are
+ * used instead of /bedrock's.
+ */
+
+int dump_config(int argc, char *argv[])
+{
+	struct config *conf;
+	size_t i, j;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: brp --dump-config [<bedrock-dir>]\n");
+		return 1;
+	}
+	if (argc == 2) {
+		set_bedrock_dir(argv[1]);
+	}
+	/* nothing is served from it, so it need not be root's */
+	config_trusted = 1;
+
+	if (! (conf = parse_config()) ) {
+		exit(1);
+	}
+	printf("%zu\n", conf->out_item_count);
+	for (i = 0; i < conf->out_item_count; i++) {
+		struct out_item *item = &conf->out_items[i];
+		printf("%s\n", item->path);
+		printf("%s\n", item->file_type == FILE_TYPE_DIRECTORY ? "directory" : "normal");
+		switch (item->filter) {
+		case FILTER_PASS:
+			printf("pass\n");
+			break;
+		case FILTER_BRC_WRAP:
+			printf("brc-wrap\n");
+			break;
+		case FILTER_EXEC:
+			printf("exec-filter\n");
+			break;
+		}
+		printf("%zu\n", item->in_item_count);
+		for (j = 0; j < item->in_item_count; j++) {
+			printf("%s\n%s\n", item->in_items[j].stratum, item->in_items[j].stratum_path);
+		}
+	}
+
+	config_free(conf);
+	return 0;
+}
+
+#ifdef BRP_BENCH
+
+/*
+ * ============================================================================
+ * benchmark
+ * ============================================================================
+ *
+ * `brp --bench [-o <options>]` generates a Bedrock tree of made-up strata in
+ * a temporary directory and times path resolution, each filter and directory
+ * listing against it in-process, as replay() does.  It needs neither root
+ * nor /dev/fuse, so it can be run from the build directory to compare
+ * changes; see `make bench`.  It, --bench-exec and --check are only built
+ * with BRP_BENCH defined, as `make bench` does, so that brp itself does not
+ * carry them.
+ *
+ * Like brp itself, the code benchmarked works through process globals: the
+ * options, the lookup and listing caches, the current config, parent_stat
+ * and the stats.  A run therefore benchmarks one config with one set of
+ * options; to compare two, run brp-bench once for each.
+ *
+ * Beyond those of a mount, options shape the tree and the run:
+ *
+ * - strata=<count> of strata.
+ * - files=<count> in each of a stratum's /usr/bin, /usr/share/man/man1 and
+ *   /usr/share/applications.  Neighbouring strata share half their names, as
+ *   strata providing the same commands do.
+ * - symlinks=<percent> of the files in /usr/bin which are symlinks into
+ *   /usr/lib, as [brc-wrap] has to dereference.
+ * - iterations=<count> of each benchmark.  Those which are much slower run a
+ *   fraction as many.
+ */
+
+struct bench_options {
+	unsigned int strata;
+	unsigned int files;
+	unsigned int symlinks;
+	unsigned int iterations;
+	/* executables --bench-exec runs; see bench_exec() */
+	char *busybox;
+	char *brc;
+	char *noop;
+};
+
+struct bench_options bench_options = {
+	.strata = 8,
+	.files = 500,
+	.symlinks = 10,
+	.iterations = 100000,
+	.busybox = "/bedrock/libexec/busybox",
+	.brc = "/bedrock/bin/brc",
+	.noop = NULL,
+};
+
+#define BENCH_OPT(t, p) { t, offsetof(struct bench_options, p), 1 }
+static const struct fuse_opt bench_opts[] = {
+	BENCH_OPT("strata=%u", strata),
+	BENCH_OPT("files=%u", files),
+	BENCH_OPT("symlinks=%u", symlinks),
+	BENCH_OPT("iterations=%u", iterations),
+	BENCH_OPT("busybox=%s", busybox),
+	BENCH_OPT("brc=%s", brc),
+	BENCH_OPT("noop=%s", noop),
+	FUSE_OPT_END
+};
+
+/* most distinct paths cycled through by each benchmark */
+#define BENCH_PATHS_MAX 4096
+
+char bench_root[PATH_MAX];
+
+enum bench {
+	BENCH_LOOKUP_HIT,
+	BENCH_LOOKUP_HIT_SCAN,
+	BENCH_LOOKUP_MISS,
+	BENCH_LOOKUP_MISS_SCAN,
+	BENCH_STAT_PASS,
+	BENCH_STAT_BRC_WRAP,
+	BENCH_STAT_EXEC,
+	BENCH_STAT_ROOT,
+	BENCH_READ_PASS,
+	BENCH_READ_BRC_WRAP,
+	BENCH_READ_BRC_WRAP_OPEN,
+	BENCH_RENDER_BRC_WRAP,
+	BENCH_READ_EXEC,
+	BENCH_READDIR,
+	BENCH_READDIR_COLD,
+	BENCH_READDIR_COLD_SERIAL,
+	BENCH_COUNT,
+};
+
+/*
+ * What each benchmark times, and the fraction of iterations it runs.  The
+ * _scan ones bypass the lookup cache, as with cache_ttl=0; readdir_cold drops
+ * the listing cache before each listing, and readdir_cold_serial also reads
+ * the strata one after another rather than with the directory scan pool, as
+ * with scan_threads=1.  read_brc_wrap renders the script
+ * for each read, as read_filter() does; read_brc_wrap_open copies it from one
+ * rendered beforehand, as brp_read() does for an open file, and
+ * render_brc_wrap is what rendering it once costs.  stat_root is the
+ * attributes of the root, whose times merge those of every backing directory.
+ */
+const struct {
+	const char *name;
+	unsigned int divisor;
+} benches[BENCH_COUNT] = {
+	[BENCH_LOOKUP_HIT] = { "lookup_hit", 1 },
+	[BENCH_LOOKUP_HIT_SCAN] = { "lookup_hit_scan", 10 },
+	[BENCH_LOOKUP_MISS] = { "lookup_miss", 1 },
+	[BENCH_LOOKUP_MISS_SCAN] = { "lookup_miss_scan", 10 },
+	[BENCH_STAT_PASS] = { "stat_pass", 1 },
+	[BENCH_STAT_BRC_WRAP] = { "stat_brc_wrap", 1 },
+	[BENCH_STAT_EXEC] = { "stat_exec_filter", 1 },
+	[BENCH_STAT_ROOT] = { "stat_root", 1 },
+	[BENCH_READ_PASS] = { "read_pass", 10 },
+	[BENCH_READ_BRC_WRAP] = { "read_brc_wrap", 1 },
+	[BENCH_READ_BRC_WRAP_OPEN] = { "read_brc_wrap_open", 1 },
+	[BENCH_RENDER_BRC_WRAP] = { "render_brc_wrap", 1 },
+	[BENCH_READ_EXEC] = { "read_exec_filter", 1 },
+	[BENCH_READDIR] = { "readdir", 100 },
+	[BENCH_READDIR_COLD] = { "readdir_cold", 1000 },
+	[BENCH_READDIR_COLD_SERIAL] = { "readdir_cold_serial", 1000 },
+};
+
+/*
+ * A path to look up, and for the filter benchmarks what it resolved to and
+ * any rendered [brc-wrap] script.
+ */
+struct bench_path {
+	char path[64];
+	struct stat stbuf;
+	struct out_item *out_item;
+	struct in_item *in_item;
+	char *tail;
+	char *wrapper;
+	size_t wrapper_len;
+};
+
+/*
+ * Formats a path within bench_root into path, which is PATH_MAX long, and
+ * creates its parent directories.
+ */
+int bench_path(char *path, const char *format, ...)
+{
+	va_list ap;
+	char *slash;
+	int len = snprintf(path, PATH_MAX, "%s/", bench_root);
+
+	va_start(ap, format);
+	vsnprintf(path + len, PATH_MAX - len, format, ap);
+	va_end(ap);
+
+	for (slash = strchr(path + len, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*slash = '/';
+			return -1;
+		}
+		*slash = '/';
+	}
+	return 0;
+}
+
+int bench_write(const char *path, const char *contents, size_t len, mode_t mode)
+{
+	int fd;
+	int ret = 0;
+
+	if ( (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode)) < 0) {
+		return -1;
+	}
+	if (write(fd, contents, len) != (ssize_t) len) {
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+/*
+ * Generates the tree described above within bench_root, with the files in
+ * /usr/bin and /usr/lib containing exe.
+ */
+int bench_tree(const char *exe, size_t exe_len)
+{
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+	char contents[256];
+	unsigned int s, i, n;
+	FILE *fp;
+
+	if (bench_path(path, "etc/brp.conf") < 0 || ! (fp = fopen(path, "w")) ) {
+		return -1;
+	}
+	fprintf(fp, "[pass]\n"
+			"/man/ = /usr/local/share/man, /usr/share/man\n"
+			"[brc-wrap]\n"
+			"/bin/ = /usr/local/bin, /usr/bin, /bin\n"
+			"[exec-filter]\n"
+			"/applications/ = /usr/local/share/applications, /usr/share/applications\n"
+			"[stratum-order]\n");
+	for (s = 0; s < bench_options.strata; s++) {
+		fprintf(fp, "bench%u\n", s);
+	}
+	if (fclose(fp) != 0) {
+		return -1;
+	}
+
+	for (s = 0; s < bench_options.strata; s++) {
+		if (bench_path(path, "run/enabled_strata/bench%u", s) < 0 ||
+				bench_write(path, "", 0, 0644) < 0) {
+			return -1;
+		}
+		for (i = 0; i < bench_options.files; i++) {
+			n = s * (bench_options.files / 2) + i;
+
+			if (i % 100 < bench_options.symlinks) {
+				snprintf(target, sizeof(target), "../lib/bench/bin%u", n);
+				if (bench_path(path, "strata/bench%u/usr/lib/bench/bin%u", s, n) < 0 ||
+						bench_write(path, exe, exe_len, 0755) < 0 ||
+						bench_path(path, "strata/bench%u/usr/bin/bin%u", s, n) < 0 ||
+						symlink(target, path) < 0) {
+					return -1;
 				}
-				if (!found) {
-					strcatoffset(buf, line, &left_to_skip, &written, size);
+			} else if (bench_path(path, "strata/bench%u/usr/bin/bin%u", s, n) < 0 ||
+					bench_write(path, exe, exe_len, 0755) < 0) {
+				return -1;
+			}
+
+			snprintf(contents, sizeof(contents), ".TH BIN%u 1\n.SH NAME\nbin%u\n", n, n);
+			if (bench_path(path, "strata/bench%u/usr/share/man/man1/bin%u.1", s, n) < 0 ||
+					bench_write(path, contents, strlen(contents), 0644) < 0) {
+				return -1;
+			}
+
+			snprintf(contents, sizeof(contents), "[Desktop Entry]\nType=Application\n"
+					"Name=bin%u\nTryExec=bin%u\nExec=bin%u %%U\n", n, n, n);
+			if (bench_path(path, "strata/bench%u/usr/share/applications/bin%u.desktop", s, n) < 0 ||
+					bench_write(path, contents, strlen(contents), 0644) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+uint64_t bench_elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
+}
+
+int bench_remove(const char *path, const struct stat *stbuf, int type, struct FTW *ftw)
+{
+	(void)stbuf;
+	(void)type;
+	(void)ftw;
+	return remove(path);
+}
+
+/*
+ * Runs one iteration of a benchmark on path.  Returns < 0 if it failed.
+ */
+int bench_run(enum bench bench, struct config *conf, struct bench_path *path, char *buf)
+{
+	struct out_item *out_item;
+	struct in_item *in_item;
+	struct listing *listing;
+	struct stat stbuf;
+	char *tail;
+	char *wrapper;
+	size_t wrapper_len;
+	int ret;
+
+	switch (bench) {
+	case BENCH_LOOKUP_HIT:
+	case BENCH_LOOKUP_MISS:
+		ret = corresponding(conf, path->path, getuid(), getgid(), &stbuf, &out_item, &in_item, &tail);
+		return bench == BENCH_LOOKUP_HIT ? ret : ret == -ENOENT ? 0 : -1;
+
+	case BENCH_LOOKUP_HIT_SCAN:
+	case BENCH_LOOKUP_MISS_SCAN:
+		ret = corresponding_scan(conf, path->path, &stbuf, &out_item, &in_item, &tail);
+		return bench == BENCH_LOOKUP_HIT_SCAN ? ret : ret == -ENOENT ? 0 : -1;
+
+	case BENCH_STAT_PASS:
+	case BENCH_STAT_BRC_WRAP:
+	case BENCH_STAT_EXEC:
+		memcpy(&stbuf, &path->stbuf, sizeof(stbuf));
+		stat_filter(&stbuf, path->out_item->filter, path->in_item, path->tail);
+		return 0;
+
+	case BENCH_STAT_ROOT:
+		memcpy(&stbuf, &parent_stat, sizeof(stbuf));
+		stat_identity(conf, path->path, MATCH_ROOT, NULL, NULL, NULL, &stbuf);
+		return 0;
+
+	case BENCH_READ_PASS:
+	case BENCH_READ_BRC_WRAP:
+	case BENCH_READ_EXEC:
+		return read_filter(path->out_item->filter, path->in_item, path->tail, buf, 4096, 0);
+
+	case BENCH_READ_BRC_WRAP_OPEN:
+		return brc_wrap_copy(path->wrapper, path->wrapper_len, buf, 4096, 0);
+
+	case BENCH_RENDER_BRC_WRAP:
+		if (! (wrapper = brc_wrap_render(path->in_item, path->tail, &wrapper_len)) ) {
+			return -1;
+		}
+		free(wrapper);
+		return 0;
+
+	case BENCH_READDIR:
+	case BENCH_READDIR_COLD:
+	case BENCH_READDIR_COLD_SERIAL:
+		if ( (ret = list_directory(conf, path->path, getuid(), getgid(), &listing)) < 0) {
+			return ret;
+		}
+		listing_put(listing);
+		return 0;
+
+	case BENCH_COUNT:
+		break;
+	}
+	return -1;
+}
+
+void bench_paths_free(struct bench_path *paths, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		free(paths[i].wrapper);
+	}
+}
+
+/*
+ * Fills paths with those a benchmark cycles through, resolving them for the
+ * filter benchmarks.  Returns how many, or 0 if any did not resolve.
+ */
+size_t bench_paths(enum bench bench, struct config *conf, struct bench_path *paths)
+{
+	/* every name is in at least one stratum */
+	size_t names = (bench_options.strata + 1) * (bench_options.files / 2);
+	size_t count = MIN(names, BENCH_PATHS_MAX);
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		switch (bench) {
+		case BENCH_LOOKUP_MISS:
+		case BENCH_LOOKUP_MISS_SCAN:
+			snprintf(paths[i].path, sizeof(paths[i].path), "/bin/missing%zu", i);
+			break;
+		case BENCH_STAT_PASS:
+		case BENCH_READ_PASS:
+			snprintf(paths[i].path, sizeof(paths[i].path), "/man/man1/bin%zu.1", i);
+			break;
+		case BENCH_STAT_EXEC:
+		case BENCH_READ_EXEC:
+			snprintf(paths[i].path, sizeof(paths[i].path), "/applications/bin%zu.desktop", i);
+			break;
+		case BENCH_STAT_ROOT:
+			strcpy(paths[i].path, "/");
+			break;
+		case BENCH_READDIR:
+		case BENCH_READDIR_COLD:
+		case BENCH_READDIR_COLD_SERIAL:
+			strcpy(paths[i].path, "/bin");
+			break;
+		default:
+			snprintf(paths[i].path, sizeof(paths[i].path), "/bin/bin%zu", i);
+			break;
+		}
+		paths[i].wrapper = NULL;
+		if (corresponding_scan(conf, paths[i].path, &paths[i].stbuf, &paths[i].out_item,
+					&paths[i].in_item, &paths[i].tail) < 0 &&
+				bench != BENCH_LOOKUP_MISS && bench != BENCH_LOOKUP_MISS_SCAN) {
+			bench_paths_free(paths, i);
+			return 0;
+		}
+		if (bench == BENCH_READ_BRC_WRAP_OPEN &&
+				! (paths[i].wrapper = brc_wrap_render(paths[i].in_item, paths[i].tail, &paths[i].wrapper_len)) ) {
+			bench_paths_free(paths, i);
+			return 0;
+		}
+	}
+	return count;
+}
+
+int bench(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct bench_path *paths;
+	struct timespec start;
+	struct config *conf;
+	const char *tmp = getenv("TMPDIR");
+	uint64_t ns;
+	size_t count;
+	size_t scan_threads;
+	unsigned int iterations;
+	unsigned int i;
+	enum bench b;
+	char *buf;
+	int ret = 0;
+
+	if (fuse_opt_parse(&args, &options, brp_opts, NULL) != 0 ||
+			fuse_opt_parse(&args, &bench_options, bench_opts, NULL) != 0 ||
+			args.argc != 1 || bench_options.strata == 0 || bench_options.files < 2 ||
+			bench_options.iterations == 0) {
+		fprintf(stderr, "Usage: brp --bench [-o <options>]\n");
+		return 1;
+	}
+
+	snprintf(bench_root, sizeof(bench_root), "%s/brp-bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (!mkdtemp(bench_root)) {
+		fprintf(stderr, "brp: unable to create %s: %s\n", bench_root, strerror(errno));
+		return 1;
+	}
+	set_bedrock_dir(bench_root);
+	config_trusted = 1;
+
+	if (bench_tree("#!/bin/sh\n", 10) < 0) {
+		fprintf(stderr, "brp: unable to generate tree in %s: %s\n", bench_root, strerror(errno));
+		nftw(bench_root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+		return 1;
+	}
+
+	if (! (paths = malloc(BENCH_PATHS_MAX * sizeof(struct bench_path))) ||
+			! (buf = malloc(4096)) ) {
+		fprintf(stderr, "brp: out of memory\n");
+		return 1;
+	}
+
+	/*
+	 * Listings of directories changed within the last second are not
+	 * cached; let the tree age as a real one would have.
+	 */
+	sleep(2);
+
+	cache_init();
+	dir_scan_init();
+	node_table_init();
+	if (! (conf = parse_config()) ) {
+		nftw(bench_root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+		free(paths);
+		free(buf);
+		return 1;
+	}
+	config_publish(conf);
+	watch_init();
+
+	printf("# %u strata, %u files each, %u%% symlinks, %u iterations\n",
+			bench_options.strata, bench_options.files, bench_options.symlinks,
+			bench_options.iterations);
+
+	conf = config_get();
+	for (b = 0; b < BENCH_COUNT; b++) {
+		if ( (count = bench_paths(b, conf, paths)) == 0) {
+			fprintf(stderr, "brp: %s: unable to resolve paths\n", benches[b].name);
+			ret = 1;
+			continue;
+		}
+		if ( (iterations = bench_options.iterations / benches[b].divisor) == 0) {
+			iterations = 1;
+		}
+
+		/* idle, rather than stopped, while the strata are read serially */
+		scan_threads = scan_thread_count;
+		if (b == BENCH_READDIR_COLD_SERIAL) {
+			scan_thread_count = 0;
+		}
+
+		/* untimed pass, to warm the caches and kernel */
+		for (i = 0; i < MIN(iterations, count); i++) {
+			bench_run(b, conf, &paths[i], buf);
+		}
+
+		ns = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < iterations; i++) {
+			if (b == BENCH_READDIR_COLD || b == BENCH_READDIR_COLD_SERIAL) {
+				ns += bench_elapsed(&start);
+				listing_clear();
+				clock_gettime(CLOCK_MONOTONIC, &start);
+			}
+			if (bench_run(b, conf, &paths[i % count], buf) < 0) {
+				break;
+			}
+		}
+		ns += bench_elapsed(&start);
+		scan_thread_count = scan_threads;
+
+		bench_paths_free(paths, count);
+		if (i < iterations) {
+			fprintf(stderr, "brp: %s: %s failed\n", benches[b].name, paths[i % count].path);
+			ret = 1;
+			continue;
+		}
+		printf("%s = %lu ns/op\n", benches[b].name, (unsigned long) (ns / iterations));
+	}
+	config_put(conf);
+
+	nftw(bench_root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+	free(buf);
+	free(paths);
+	fuse_opt_free_args(&args);
+	return ret;
+}
+
+/*
+ * ============================================================================
+ * self-check
+ * ============================================================================
+ *
+ * `brp --check [-o <options>]` generates the same tree as --bench and checks
+ * that what brp's caches and indexes answer agrees with reading the tree
+ * afresh:
+ *
+ * - /bin's listing has each name once, and a cached listing is made again
+ *   once a backing directory's ctime changes.
+ * - the name index, bloom filter included, finds every name in /bin,
+ *   including one added since it was built, and lookups through it resolve
+ *   as trying each in_item in turn does.
+ * - readdirplus counts a lookup of exactly the entries it returns, over
+ *   however many calls, forgetting those which did not fit.
+ * - lookups and listings carried over as a stratum is disabled and enabled
+ *   again match fresh ones.
+ *
+ * It prints a line per check, as test-config.sh does, and fails if any
+ * does.  `make test` runs it.  It takes the same options as --bench, less
+ * iterations.
+ */
+
+int check_failed = 0;
+
+void check_report(int ok, const char *format, ...)
+{
+	va_list ap;
+
+	printf(ok ? "ok   " : "FAIL ");
+	va_start(ap, format);
+	vprintf(format, ap);
+	va_end(ap);
+	printf("\n");
+	check_failed |= !ok;
+}
+
+/*
+ * Returns the sorted names, without duplicates, in every bench stratum's
+ * /usr/bin, read directly, or NULL if out of memory.  The caller should free
+ * them and the array.
+ */
+char **check_bin_names(size_t *count)
+{
+	char path[PATH_MAX];
+	struct dirent *dirent;
+	char **names = NULL;
+	char **new_names;
+	size_t allocated = 0;
+	size_t i, j;
+	unsigned int s;
+	DIR *dir;
+
+	*count = 0;
+	for (s = 0; s < bench_options.strata; s++) {
+		snprintf(path, sizeof(path), "%s/strata/bench%u/usr/bin", bench_root, s);
+		if (! (dir = opendir(path)) ) {
+			continue;
+		}
+		while ( (dirent = readdir(dir)) ) {
+			if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+				continue;
+			}
+			if (*count == allocated) {
+				allocated = allocated > 0 ? allocated * 2 : 1024;
+				if (! (new_names = realloc(names, allocated * sizeof(char *))) ) {
+					closedir(dir);
+					goto fail;
 				}
-				if (written >= size) {
-					break;
+				names = new_names;
+			}
+			if (! (names[*count] = strdup(dirent->d_name)) ) {
+				closedir(dir);
+				goto fail;
+			}
+			(*count)++;
+		}
+		closedir(dir);
+	}
+
+	if (*count > 0) {
+		qsort(names, *count, sizeof(char *), qsort_strcmp_wrap);
+		for (i = 1, j = 1; i < *count; i++) {
+			if (strcmp(names[i], names[j-1]) != 0) {
+				names[j++] = names[i];
+			} else {
+				free(names[i]);
+			}
+		}
+		*count = j;
+	}
+	return names;
+
+fail:
+	for (i = 0; i < *count; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return NULL;
+}
+
+/*
+ * Returns the listing's names other than "." and "..", which it keeps
+ * sorted, as a pointer into them, and sets *count to how many there are.
+ */
+char **check_listing_names(struct listing *listing, size_t *count)
+{
+	size_t i = 0;
+
+	while (i < listing->name_count && (strcmp(listing->names[i], ".") == 0 ||
+			strcmp(listing->names[i], "..") == 0)) {
+		i++;
+	}
+	*count = listing->name_count - i;
+	return listing->names + i;
+}
+
+int check_same_names(char **a, size_t a_count, char **b, size_t b_count)
+{
+	size_t i;
+
+	if (a_count != b_count) {
+		return 0;
+	}
+	for (i = 0; i < a_count; i++) {
+		if (strcmp(a[i], b[i]) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Returns the index of the /bin out_item.
+ */
+size_t check_bin_item(struct config *conf)
+{
+	size_t i;
+
+	for (i = 0; i < conf->out_item_count && strcmp(conf->out_items[i].path, "/bin") != 0; i++) {
+	}
+	return i;
+}
+
+/*
+ * Looks up each of names, and a name next to each which is not there, in
+ * /bin as a caller would, through the caches and name index, and by trying
+ * each of its in_items in turn.  Returns how many disagree, printing the
+ * first.
+ */
+size_t check_lookups(struct config *conf, char **names, size_t count)
+{
+	struct out_item *bin = &conf->out_items[check_bin_item(conf)];
+	struct out_item *out_item;
+	struct in_item *in_item;
+	struct in_item *expected;
+	struct stat stbuf;
+	char path[PATH_MAX];
+	char *tail;
+	size_t mismatches = 0;
+	size_t i, j;
+	int miss;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		for (miss = 0; miss < 2; miss++) {
+			snprintf(path, sizeof(path), "/bin/%s%s", names[i], miss ? "-missing" : "");
+			expected = NULL;
+			for (j = 0; j < bin->in_item_count && !expected; j++) {
+				if (in_item_stat(&bin->in_items[j], path + bin->path_len, NULL) >= 0) {
+					expected = &bin->in_items[j];
 				}
 			}
-			fclose(fp);
-			return written;
-		} else {
-			return -EPERM;
+			ret = corresponding(conf, path, getuid(), getgid(), &stbuf, &out_item, &in_item, &tail);
+			if (expected ? ret == MATCH_CONTAINED &&
+					strcmp(in_item->stratum, expected->stratum) == 0 &&
+					strcmp(in_item->stratum_path, expected->stratum_path) == 0 :
+					ret == -ENOENT) {
+				continue;
+			}
+			if (mismatches++ == 0) {
+				printf("# %s: %s, expected %s\n", path,
+						ret >= 0 ? in_item->stratum : strerror(-ret),
+						expected ? expected->stratum : "none");
+			}
 		}
-		break;
 	}
-
-	return -ENOENT;
+	return mismatches;
+}
+
+/*
+ * Checks that the cached listing of /bin, if any, matches a fresh one.
+ * Leaves the fresh one cached.
+ */
+int check_listing_fresh(struct config *conf)
+{
+	struct listing *cached;
+	struct listing *fresh;
+	char **cached_names;
+	char **fresh_names;
+	size_t cached_count;
+	size_t fresh_count;
+	int ok;
+
+	if (list_directory(conf, "/bin", getuid(), getgid(), &cached) < 0) {
+		return 0;
+	}
+	listing_clear();
+	if (list_directory(conf, "/bin", getuid(), getgid(), &fresh) < 0) {
+		listing_put(cached);
+		return 0;
+	}
+	cached_names = check_listing_names(cached, &cached_count);
+	fresh_names = check_listing_names(fresh, &fresh_count);
+	ok = check_same_names(cached_names, cached_count, fresh_names, fresh_count);
+	listing_put(cached);
+	listing_put(fresh);
+	return ok;
+}
+
+/*
+ * Enables or disables stratum in the tree, as brs does, and applies the
+ * change as the reload thread would.  The watcher's request for the same
+ * change is left queued, as no reload thread runs.
+ */
+int check_change_stratum(char change, char *stratum)
+{
+	struct reload_waiter waiter;
+	struct config *conf;
+	char path[PATH_MAX];
+	int ret;
+
+	if (bench_path(path, "run/enabled_strata/%s", stratum) < 0 ||
+			(change == '+' ? bench_write(path, "", 0, 0644) : unlink(path)) < 0) {
+		return -errno;
+	}
+
+	memset(&waiter, 0, sizeof(waiter));
+	waiter.change = change;
+	waiter.stratum = stratum;
+
+	conf = config_get();
+	ret = reload_change_stratum(conf, &waiter);
+	config_put(conf);
+
+	conf = config_get();
+	watch_config(conf);
+	config_put(conf);
+	return ret;
+}
+
+/*
+ * Checks that /bin's listing has each name in the tree once, and is made
+ * again once a backing directory changes.
+ */
+void check_listing(struct config *conf, char **names, size_t count)
+{
+	struct listing *first;
+	struct listing *second;
+	struct listing *changed;
+	const char *added = "check-added";
+	char **listed;
+	size_t listed_count;
+	char path[PATH_MAX];
+
+	if (list_directory(conf, "/bin", getuid(), getgid(), &first) < 0) {
+		check_report(0, "listing: unable to list /bin");
+		return;
+	}
+	listed = check_listing_names(first, &listed_count);
+	check_report(check_same_names(listed, listed_count, names, count),
+			"listing: /bin lists each of %zu names once", count);
+
+	if (list_directory(conf, "/bin", getuid(), getgid(), &second) < 0) {
+		listing_put(first);
+		check_report(0, "listing: unable to list /bin again");
+		return;
+	}
+	check_report(second == first, "listing: unchanged listing reused");
+	listing_put(second);
+
+	snprintf(path, sizeof(path), "%s/strata/bench%u/usr/bin/%s", bench_root, bench_options.strata - 1, added);
+	if (bench_write(path, "", 0, 0755) < 0 ||
+			list_directory(conf, "/bin", getuid(), getgid(), &changed) < 0) {
+		listing_put(first);
+		check_report(0, "listing: unable to add to /bin");
+		return;
+	}
+	listed = check_listing_names(changed, &listed_count);
+	check_report(changed != first && bsearch(&added, listed, listed_count, sizeof(char *), qsort_strcmp_wrap),
+			"listing: made again once a backing directory's ctime changed");
+	listing_put(changed);
+	listing_put(first);
+}
+
+/*
+ * Checks that the name index knows every name in /bin, including one added
+ * while it is being watched.
+ */
+void check_name_index(struct config *conf, char **names, size_t count)
+{
+	struct timespec delay = { 0, 10 * 1000000L };
+	char path[PATH_MAX];
+	size_t missing = 0;
+	size_t out_item;
+	size_t i;
+	int tries;
+
+	out_item = check_bin_item(conf);
+	for (tries = 0; tries < 500 && name_index_first(conf, out_item, "check") == -ESTALE; tries++) {
+		nanosleep(&delay, NULL);
+	}
+	if (tries == 500) {
+		check_report(0, "name index: /bin never indexed");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		missing += name_index_first(conf, out_item, names[i]) < 0;
+	}
+	check_report(missing == 0, "name index: no false negatives among %zu names (%zu missing)", count, missing);
+	check_report(name_index_first(conf, out_item, "check-missing") == -ENOENT,
+			"name index: absent name reported missing");
+
+	snprintf(path, sizeof(path), "%s/strata/bench0/usr/bin/check-watched", bench_root);
+	if (bench_write(path, "", 0, 0755) < 0) {
+		check_report(0, "name index: unable to add to /bin");
+		return;
+	}
+	for (tries = 0; tries < 500 && name_index_first(conf, out_item, "check-watched") < 0; tries++) {
+		nanosleep(&delay, NULL);
+	}
+	check_report(tries < 500, "name index: added name indexed");
+
+	check_report(check_lookups(conf, names, count) == 0, "name index: lookups match trying each in_item");
+}
+
+/*
+ * Checks that readdirplus counts one lookup of each entry it returns, given
+ * too little room for them all in each call.
+ */
+void check_readdirplus(struct config *conf)
+{
+	struct fuse_ctx context;
+	struct fuse_entry_param e;
+	struct listing *listing;
+	struct node *parent_node;
+	struct node *node;
+	char path[PATH_MAX];
+	char buf[4096];
+	fuse_ino_t ino;
+	size_t nodes_before;
+	size_t wrong = 0;
+	size_t calls = 0;
+	size_t named = 0;
+	off_t offset;
+	off_t next;
+	size_t i;
+
+	memset(&context, 0, sizeof(context));
+	context.uid = getuid();
+	context.gid = getgid();
+
+	if (entry_lookup(conf, &context, node_get(FUSE_ROOT_ID), "bin", &e) < 0 ||
+			! (parent_node = node_get(e.ino)) ||
+			list_directory(conf, "/bin", getuid(), getgid(), &listing) < 0) {
+		check_report(0, "readdirplus: unable to list /bin");
+		return;
+	}
+
+	pthread_mutex_lock(&node_lock);
+	nodes_before = node_count;
+	pthread_mutex_unlock(&node_lock);
+
+	for (offset = 0; offset < (off_t) listing->name_count; offset = next, calls++) {
+		readdirplus_fill(NULL, conf, &context, parent_node, listing, buf, sizeof(buf), offset, &next);
+		if (next == offset) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&node_lock);
+	for (i = 0; i < listing->name_count; i++) {
+		if (strcmp(listing->names[i], ".") == 0 || strcmp(listing->names[i], "..") == 0) {
+			continue;
+		}
+		named++;
+		snprintf(path, sizeof(path), "/bin/%s", listing->names[i]);
+		node = node_find_path(path, &e.ino);
+		wrong += !node || node->nlookup != 1;
+	}
+	check_report(offset == (off_t) listing->name_count && calls > 1 && wrong == 0 &&
+			node_count - nodes_before == named,
+			"readdirplus: each of %zu entries looked up once over %zu calls", named, calls);
+	pthread_mutex_unlock(&node_lock);
+
+	for (i = 0; i < listing->name_count; i++) {
+		snprintf(path, sizeof(path), "/bin/%s", listing->names[i]);
+		pthread_mutex_lock(&node_lock);
+		node = node_find_path(path, &e.ino);
+		ino = node && node->type == NODE_ITEM ? node->ino : 0;
+		pthread_mutex_unlock(&node_lock);
+		if (ino) {
+			node_forget(ino, 1);
+		}
+	}
+	pthread_mutex_lock(&node_lock);
+	check_report(node_count == nodes_before, "readdirplus: forgetting them all leaves no nodes behind");
+	pthread_mutex_unlock(&node_lock);
+	listing_put(listing);
+}
+
+/*
+ * Checks lookups and listings carried over as a stratum is disabled and
+ * enabled again against fresh ones.
+ */
+void check_stratum_changes(char **names, size_t count)
+{
+	const char *changes = "-+";
+	struct config *conf;
+	struct listing *listing;
+	size_t mismatches;
+	int i;
+
+	for (i = 0; changes[i]; i++) {
+		/* fill the caches, for the change to carry over */
+		conf = config_get();
+		check_lookups(conf, names, count);
+		if (list_directory(conf, "/bin", getuid(), getgid(), &listing) == 0) {
+			listing_put(listing);
+		}
+		config_put(conf);
+
+		if (check_change_stratum(changes[i], "bench0") < 0) {
+			check_report(0, "stratum change: unable to apply %cbench0", changes[i]);
+			continue;
+		}
+
+		conf = config_get();
+		mismatches = check_lookups(conf, names, count);
+		check_report(mismatches == 0, "stratum change: lookups after %cbench0 match trying each in_item", changes[i]);
+		check_report(check_listing_fresh(conf), "stratum change: listing after %cbench0 matches a fresh one", changes[i]);
+		config_put(conf);
+	}
+}
+
+int check(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct config *conf;
+	const char *tmp = getenv("TMPDIR");
+	char **names;
+	size_t count;
+	size_t i;
+
+	if (fuse_opt_parse(&args, &options, brp_opts, NULL) != 0 ||
+			fuse_opt_parse(&args, &bench_options, bench_opts, NULL) != 0 ||
+			args.argc != 1 || bench_options.strata < 2 || bench_options.files < 2) {
+		fprintf(stderr, "Usage: brp --check [-o <options>]\n");
+		return 1;
+	}
+
+	snprintf(bench_root, sizeof(bench_root), "%s/brp-bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (!mkdtemp(bench_root)) {
+		fprintf(stderr, "brp: unable to create %s: %s\n", bench_root, strerror(errno));
+		return 1;
+	}
+	set_bedrock_dir(bench_root);
+	config_trusted = 1;
+
+	if (bench_tree("#!/bin/sh\n", 10) < 0) {
+		fprintf(stderr, "brp: unable to generate tree in %s: %s\n", bench_root, strerror(errno));
+		nftw(bench_root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+		return 1;
+	}
+	if (! (names = check_bin_names(&count)) ) {
+		fprintf(stderr, "brp: out of memory\n");
+		nftw(bench_root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+		return 1;
+	}
+
+	/* as for --bench, so that listings are cached */
+	sleep(2);
+
+	cache_init();
+	dir_scan_init();
+	node_table_init();
+	if (! (conf = parse_config()) ) {
+		nftw(bench_root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+		return 1;
+	}
+	config_publish(conf);
+
+	printf("# %u strata, %u files each\n", bench_options.strata, bench_options.files);
+
+	/* before watching, so that only the ctime can tell the listing changed */
+	conf = config_get();
+	check_listing(conf, names, count);
+	config_put(conf);
+
+	/* the name index is only kept while watching */
+	options.watch = 1;
+	watch_init();
+	conf = config_get();
+	check_name_index(conf, names, count);
+	check_readdirplus(conf);
+	config_put(conf);
+
+	/* again, for the directories changed above */
+	sleep(2);
+	check_stratum_changes(names, count);
+
+	for (i = 0; i < count; i++) {
+		free(names[i]);
+	}
+	free(names);
+	nftw(bench_root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+	fuse_opt_free_args(&args);
+	return check_failed;
+}
+
+/*
+ * ============================================================================
+ * exec benchmark
+ * ============================================================================
+ *
+ * What users feel is the time from running a command another stratum
+ * provides, e.g. /bedrock/brpath/bin/vim, to it running.  That passes
+ * through brp's lookup, reading the [brc-wrap] script, busybox sh starting
+ * and running it, brc changing root and finally the command itself.
+ *
+ * `brp --bench-exec -o noop=<executable>[,<options>]` times that from end to
+ * end.  It generates the same tree as --bench, with each file in /usr/bin a
+ * copy of the noop executable, which should be static and do nothing.  As
+ * everything involved expects to find it at /bedrock, it does so in a tmpfs
+ * it makes the root of private user and mount namespaces, with the rest of
+ * the system bound into it.  brc escapes chroots, so it has to be the actual
+ * root.  It then mounts brp at /bedrock/brpath in a child process.
+ *
+ * Each iteration uses commands which have not been used yet, so that neither
+ * brp nor the kernel has cached them, and times:
+ *
+ * - lookup: stat()ing /bedrock/brpath/bin/<command>.
+ * - wrapper read: opening and reading the [brc-wrap] script.
+ * - interpreter: running a copy of the script on the tmpfs, less running brc
+ *   as it does.
+ * - brc: running brc, less running the command.
+ * - target: running the command directly.
+ * - total: running another, unused, /bedrock/brpath/bin/<command>.
+ *
+ * The phases are measured separately, so they do not quite add up to the
+ * total.  The rest is the kernel executing the script through FUSE.
+ * interpreter and brc are differences between separately timed processes,
+ * so they are only estimates, reported as interpreter_est and brc_est, and
+ * individual samples of them may be negative.  None of this has been run
+ * against a real libfuse and kernel yet.
+ *
+ * It then times reading a large [pass] file, which brp has the kernel splice
+ * from the backing file rather than copying it through itself, through
+ * /bedrock/brpath and directly.  How close the former comes to the latter
+ * is what splicing is meant to improve; it has not been measured yet.
+ *
+ * busybox=<path> and brc=<path> are those to use, by default those installed
+ * in /bedrock.  iterations is a hundredth of that given.
+ */
+
+enum bench_phase {
+	PHASE_LOOKUP,
+	PHASE_READ,
+	PHASE_INTERPRETER,
+	PHASE_BRC,
+	PHASE_TARGET,
+	PHASE_TOTAL,
+	PHASE_COUNT,
+};
+
+const char *const phase_names[PHASE_COUNT] = {
+	[PHASE_LOOKUP] = "lookup",
+	[PHASE_READ] = "wrapper_read",
+	[PHASE_INTERPRETER] = "interpreter_est",
+	[PHASE_BRC] = "brc_est",
+	[PHASE_TARGET] = "target",
+	[PHASE_TOTAL] = "total",
+};
+
+/* where the tmpfs root is mounted before it becomes the root */
+#define BENCH_EXEC_ROOT "/tmp"
+
+/* the large [pass] file read, its size, how it is read and how many times */
+#define BENCH_LARGE_PATH "strata/bench0/usr/share/man/man1/large.1"
+#define BENCH_LARGE_SIZE (64 * 1024 * 1024)
+#define BENCH_LARGE_BUF (128 * 1024)
+#define BENCH_LARGE_READS 9
+
+int serve(struct fuse_args *args);
+
+/*
+ * Reads all of path into a new buffer.
+ */
+char *bench_read(const char *path, size_t *len)
+{
+	struct stat stbuf;
+	char *contents;
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &stbuf) < 0 || ! (contents = malloc(stbuf.st_size + 1)) ) {
+		close(fd);
+		return NULL;
+	}
+	if (read(fd, contents, stbuf.st_size) != stbuf.st_size) {
+		free(contents);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	*len = stbuf.st_size;
+	return contents;
 }
 
 /*
- * ============================================================================
- * FUSE functions
- * ============================================================================
- */
-
-/*
- * FUSE calls its equivalent of stat(2) "getattr".  This just gets stat
- * information, e.g. file size and permissions.
+ * Writes BENCH_LARGE_SIZE bytes of text to path.  It is not left sparse, so
+ * that reading it reads actual pages.
  */
-static int brp_getattr(const char const *in_path, struct stat *stbuf)
+int bench_write_large(const char *path)
 {
-	SET_CALLER_UID();
-
-	char out_path[PATH_MAX+1];
-	struct out_item *out_item;
-	struct in_item *in_item;
-	char *tail;
-	char *config_str;
-	int ret;
+	char *buf;
+	size_t i;
+	int fd;
+	int ret = 0;
 
-	if (in_path[0] == '/' && in_path[1] == '\0') {
-		memcpy(stbuf, &parent_stat, sizeof(parent_stat));
-		return 0;
+	if (! (buf = malloc(BENCH_LARGE_BUF)) ) {
+		return -1;
 	}
-
-	if (strcmp(in_path, "/reparse_config") == 0) {
-		memcpy(stbuf, &reparse_stat, sizeof(reparse_stat));
-		config_str = config_contents();
-		if (config_str) {
-			stbuf->st_size = strlen(config_str);
-			free(config_str);
-			return 0;
-		} else {
-			return -ENOMEM;
+	for (i = 0; i < BENCH_LARGE_BUF; i++) {
+		buf[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	}
+	if ( (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		free(buf);
+		return -1;
+	}
+	for (i = 0; i < BENCH_LARGE_SIZE / BENCH_LARGE_BUF; i++) {
+		if (write(fd, buf, BENCH_LARGE_BUF) != BENCH_LARGE_BUF) {
+			ret = -1;
+			break;
 		}
 	}
+	close(fd);
+	free(buf);
+	return ret;
+}
 
-	if ( (ret = corresponding((char*)in_path, out_path, PATH_MAX, stbuf, &out_item, &in_item, &tail)) >= 0) {
-		stat_filter(stbuf, out_path, out_item->filter, in_item, tail);
+/*
+ * Reads all of path, BENCH_LARGE_BUF at a time, as cat would, and returns how
+ * long it took in nanoseconds, or 0 if it failed.
+ */
+uint64_t bench_read_large(const char *path, char *buf)
+{
+	struct timespec start;
+	uint64_t ns;
+	ssize_t len;
+	size_t total = 0;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
 		return 0;
-	} else {
-		return ret;
 	}
+	while ( (len = read(fd, buf, BENCH_LARGE_BUF)) > 0) {
+		total += len;
+	}
+	close(fd);
+	ns = bench_elapsed(&start);
+	return len < 0 || total != BENCH_LARGE_SIZE ? 0 : ns;
 }
 
 /*
- * Provides contents of a directory, e.g. as used by `ls`.
+ * Writes a file, e.g. /proc/self/uid_map, which must be written at once.
  */
-static int brp_readdir(const char *in_path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+int bench_write_proc(const char *path, const char *format, ...)
 {
-	SET_CALLER_UID();
-
-	(void) offset;
-	(void) fi;
+	char contents[64];
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(contents, sizeof(contents), format, ap);
+	va_end(ap);
+	return bench_write(path, contents, len, 0);
+}
 
-	const size_t out_path_size = PATH_MAX;
-	char out_path[out_path_size+1];
-	size_t i, j;
-	size_t in_path_len = strlen(in_path);
-	/* handle root directory specially */
-	if (in_path_len == 1) {
-		in_path_len = 0;
-	}
+/*
+ * Enters private user and mount namespaces whose root is a tmpfs with
+ * everything but /bedrock and /tmp bound in from the actual root, and
+ * /bedrock populated with the tree described above, busybox and brc.
+ */
+int bench_exec_root()
+{
+	struct {
+		const char *from;
+		const char *to;
+		char *contents;
+		size_t len;
+	} exes[] = {
+		{ bench_options.noop, NULL, NULL, 0 },
+		{ bench_options.busybox, "libexec/busybox", NULL, 0 },
+		{ bench_options.brc, "bin/brc", NULL, 0 },
+	};
+	char path[PATH_MAX];
+	char target[PATH_MAX];
 	struct stat stbuf;
-	int ret_val = -ENOENT;
-	char *slash;
-
-	DIR *d;
 	struct dirent *dir;
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	ssize_t len;
+	size_t i;
+	DIR *d = NULL;
+	int ret = -1;
+
+	/* before the tmpfs hides them, should they be in /tmp */
+	for (i = 0; i < sizeof(exes) / sizeof(exes[0]); i++) {
+		if (! (exes[i].contents = bench_read(exes[i].from, &exes[i].len)) ) {
+			fprintf(stderr, "brp: unable to read %s: %s\n", exes[i].from, strerror(errno));
+			goto out;
+		}
+	}
 
-	struct str_vec v;
-	str_vec_new(&v);
+	if (uid != 0) {
+		if (unshare(CLONE_NEWUSER | CLONE_NEWNS) < 0 ||
+				bench_write_proc("/proc/self/setgroups", "deny") < 0 ||
+				bench_write_proc("/proc/self/uid_map", "0 %u 1", uid) < 0 ||
+				bench_write_proc("/proc/self/gid_map", "0 %u 1", gid) < 0) {
+			goto out;
+		}
+	} else if (unshare(CLONE_NEWNS) < 0) {
+		goto out;
+	}
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0 ||
+			mount("tmpfs", BENCH_EXEC_ROOT, "tmpfs", 0, "mode=0755") < 0 ||
+			! (d = opendir("/")) ) {
+		goto out;
+	}
 
-	for (i = 0; i < out_item_count; i++) {
-		/*
-		 * Check for contents of one of the configured directories
-		 */
-		if (strncmp(in_path, out_items[i].path, out_items[i].path_len) == 0 &&
-				(in_path[out_items[i].path_len] == '\0' ||
-				in_path[out_items[i].path_len] == '/') &&
-				out_items[i].file_type == FILE_TYPE_DIRECTORY) {
-			for (j = 0; j < out_items[i].in_item_count; j++) {
-				strncpy(out_path, out_items[i].in_items[j].full_path, out_path_size);
-				strncat(out_path, in_path + out_items[i].path_len, out_path_size - out_items[i].in_items[j].full_path_len);
-				if (strlen(out_path) == out_path_size) {
-					/* would have buffer overflowed, treat as bad value */
-					continue;
-				}
-				if (brp_stat(out_path, &stbuf) < 0) {
-					continue;
-				}
-				if (S_ISDIR(stbuf.st_mode)) {
-					if (! (d = opendir(out_path)) ) {
-						continue;
-					}
-					while ( (dir = readdir(d)) ) {
-						str_vec_append(&v, dir->d_name);
-					}
-					closedir(d);
-				} else {
-					if (strrchr(out_path, '/')) {
-						str_vec_append(&v, strrchr(out_path, '/')+1);
-					} else {
-						str_vec_append(&v, out_path);
-					}
-				}
-			}
+	while ( (dir = readdir(d)) ) {
+		if (dir->d_name[0] == '.' || strcmp(dir->d_name, "bedrock") == 0 ||
+				strcmp(dir->d_name, "tmp") == 0 ||
+				fstatat(dirfd(d), dir->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+			continue;
 		}
-		/*
-		 * Check for a match directly on one of the configured items or a virtual parent directory
-		 */
-		if (strncmp(out_items[i].path, in_path, in_path_len) == 0 &&
-				out_items[i].path[in_path_len] == '/') {
-			for (j = 0; j < out_items[i].in_item_count; j++) {
-				if (brp_stat(out_items[i].in_items[j].full_path, NULL) >= 0) {
-					strncpy(out_path, out_items[i].path + in_path_len + 1, out_path_size);
-					if (strlen(out_path) == out_path_size) {
-						/* would have buffer overflowed, treat as bad value */
-						continue;
-					}
-					if ( (slash = strchr(out_path, '/')) ) {
-						*slash = '\0';
-					}
-					str_vec_append(&v, out_path);
-					break;
-				}
+		snprintf(path, sizeof(path), BENCH_EXEC_ROOT "/%s", dir->d_name);
+		if (S_ISLNK(stbuf.st_mode)) {
+			if ( (len = readlinkat(dirfd(d), dir->d_name, target, sizeof(target) - 1)) < 0) {
+				continue;
+			}
+			target[len] = '\0';
+			if (symlink(target, path) < 0) {
+				goto out;
+			}
+		} else if (S_ISDIR(stbuf.st_mode)) {
+			snprintf(target, sizeof(target), "/%s", dir->d_name);
+			if (mkdir(path, 0755) < 0 || mount(target, path, NULL, MS_BIND | MS_REC, NULL) < 0) {
+				goto out;
 			}
 		}
-
-		/*
-		 * Handle reparse_config on root
-		 */
-		if (in_path[0] == '/' && in_path[1] == '\0') {
-			str_vec_append(&v, "reparse_config");
-		}
+	}
+	if (mkdir(BENCH_EXEC_ROOT "/tmp", 01777) < 0 || chmod(BENCH_EXEC_ROOT "/tmp", 01777) < 0) {
+		goto out;
 	}
 
-	str_vec_uniq(&v);
-	for (i = 0; i < v.len; i++) {
-		if (v.array[i][0] != '\0') {
-			filler(buf, v.array[i], NULL, 0);
-			ret_val = 0;
+	strcpy(bench_root, BENCH_EXEC_ROOT "/bedrock");
+	if (mkdir(bench_root, 0755) < 0 || bench_tree(exes[0].contents, exes[0].len) < 0 || bench_path(path, "brpath/") < 0) {
+		goto out;
+	}
+	if (bench_path(path, BENCH_LARGE_PATH) < 0 || bench_write_large(path) < 0) {
+		goto out;
+	}
+	for (i = 1; i < sizeof(exes) / sizeof(exes[0]); i++) {
+		if (bench_path(path, "%s", exes[i].to) < 0 ||
+				bench_write(path, exes[i].contents, exes[i].len, 0755) < 0) {
+			goto out;
 		}
 	}
 
-	str_vec_free(&v);
+	if (mkdir(BENCH_EXEC_ROOT "/.old", 0700) < 0 ||
+			syscall(SYS_pivot_root, BENCH_EXEC_ROOT, BENCH_EXEC_ROOT "/.old") < 0 ||
+			chdir("/") < 0 ||
+			umount2("/.old", MNT_DETACH) < 0 ||
+			rmdir("/.old") < 0) {
+		goto out;
+	}
+	ret = 0;
 
-	return ret_val;
+out:
+	if (d) {
+		closedir(d);
+	}
+	for (i = 0; i < sizeof(exes) / sizeof(exes[0]); i++) {
+		free(exes[i].contents);
+	}
+	return ret;
 }
 
 /*
- * Check if user has permissions to do something with file. e.g. read or write.
+ * Runs argv[0] with argv and returns how long it took in nanoseconds, or 0
+ * if it failed.
  */
-static int brp_open(const char *in_path, struct fuse_file_info *fi)
+uint64_t bench_spawn(char *const argv[])
 {
-	SET_CALLER_UID();
+	extern char **environ;
+	struct timespec start;
+	uint64_t ns;
+	pid_t pid;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0 ||
+			waitpid(pid, &status, 0) < 0) {
+		return 0;
+	}
+	ns = bench_elapsed(&start);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "brp: %s failed\n", argv[0]);
+		return 0;
+	}
+	return ns;
+}
 
-	char out_path[PATH_MAX+1];
-	struct out_item *out_item;
-	struct in_item *in_item;
-	char *tail;
-	int ret;
+int bench_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Runs one iteration, timing the phases of running command, and using
+ * unused for the total.  Returns < 0 if anything failed.
+ */
+int bench_exec_run(unsigned int command, unsigned int unused, int64_t *phases)
+{
+	char path[PATH_MAX];
+	char stratum[NAME_MAX + 1];
+	char stratum_path[PATH_MAX];
+	char in_path[PATH_MAX];
+	char wrapper[PATH_MAX];
+	char *script;
+	size_t script_len;
+	struct timespec start;
 	struct stat stbuf;
+	uint64_t script_ns, brc_ns, target_ns, total_ns;
+	ssize_t len;
+	int fd;
 
-	/*
-	 * /reparse_config is the only file which could possibly be written to.
-	 * Get that out of the way here so we can assume everything else later is
-	 * only being read.
-	 */
-	if (strcmp(in_path, "/reparse_config") == 0) {
-		struct fuse_context *context = fuse_get_context();
-		if (context->uid != 0) {
-			/* Non-root users cannot do anything with this file. */
-			return -EACCES;
-		} else {
-			return 0;
-		}
+	snprintf(path, sizeof(path), "/bedrock/brpath/bin/bin%u", command);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (stat(path, &stbuf) < 0) {
+		return -1;
 	}
+	phases[PHASE_LOOKUP] = bench_elapsed(&start);
 
-	/*
-	 * Everything else in this filesystem is read-only.  If the user requested
-	 * anything else, return EACCES.
-	 *
-	 * Note the way permissions are stored in fi->flags do *not* have a single
-	 * bit flag for read or write, hence the unusual looking check below.  See
-	 * `man 2 open`.
-	 */
-	if ((fi->flags & 3) != O_RDONLY ) {
-		return -EACCES;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (! (script = bench_read(path, &script_len)) ) {
+		return -1;
 	}
+	phases[PHASE_READ] = bench_elapsed(&start);
 
-	if ( (ret = corresponding((char*)in_path, out_path, PATH_MAX, &stbuf, &out_item, &in_item, &tail)) >= 0) {
-		return 0;
+	/* where brp found it */
+	if ( (len = getxattr(path, XATTR_PREFIX "stratum", stratum, sizeof(stratum) - 1)) < 0) {
+		free(script);
+		return -1;
 	}
-	return -ENOENT;
+	stratum[len] = '\0';
+	if ( (len = getxattr(path, XATTR_PREFIX "path", stratum_path, sizeof(stratum_path) - 1)) < 0) {
+		free(script);
+		return -1;
+	}
+	stratum_path[len] = '\0';
+	snprintf(in_path, sizeof(in_path), "/bedrock/strata/%s%s", stratum, stratum_path);
+
+	snprintf(wrapper, sizeof(wrapper), "/tmp/bin%u", command);
+	if ( (fd = open(wrapper, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755)) < 0) {
+		free(script);
+		return -1;
+	}
+	if (write(fd, script, script_len) != (ssize_t) script_len) {
+		close(fd);
+		unlink(wrapper);
+		free(script);
+		return -1;
+	}
+	close(fd);
+	free(script);
+
+	target_ns = bench_spawn((char *[]) { in_path, NULL });
+	brc_ns = bench_spawn((char *[]) { "/bedrock/bin/brc", stratum, stratum_path, NULL });
+	script_ns = bench_spawn((char *[]) { wrapper, NULL });
+	unlink(wrapper);
+
+	snprintf(path, sizeof(path), "/bedrock/brpath/bin/bin%u", unused);
+	total_ns = bench_spawn((char *[]) { path, NULL });
+
+	if (!target_ns || !brc_ns || !script_ns || !total_ns) {
+		return -1;
+	}
+	phases[PHASE_INTERPRETER] = (int64_t) script_ns - (int64_t) brc_ns;
+	phases[PHASE_BRC] = (int64_t) brc_ns - (int64_t) target_ns;
+	phases[PHASE_TARGET] = target_ns;
+	phases[PHASE_TOTAL] = total_ns;
+	return 0;
 }
 
 /*
- * Read file contents.
+ * Times reading the large [pass] file through brp and directly, printing the
+ * median throughput of each.  Returns < 0 if anything failed.
  */
-static int brp_read(const char *in_path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+int bench_read_pass()
 {
-	SET_CALLER_UID();
+	const char *paths[] = { "/bedrock/brpath/man/man1/large.1", "/bedrock/" BENCH_LARGE_PATH };
+	int64_t samples[BENCH_LARGE_READS];
+	unsigned long mbps[2];
+	char *buf;
+	size_t i, j;
 
-	char out_path[PATH_MAX+1];
-	struct out_item *out_item;
-	struct in_item *in_item;
-	char *tail;
-	char *config_str;
+	if (! (buf = malloc(BENCH_LARGE_BUF)) ) {
+		fprintf(stderr, "brp: out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < BENCH_LARGE_READS; j++) {
+			if ( (samples[j] = bench_read_large(paths[i], buf)) == 0) {
+				fprintf(stderr, "brp: reading %s failed\n", paths[i]);
+				free(buf);
+				return -1;
+			}
+		}
+		qsort(samples, BENCH_LARGE_READS, sizeof(int64_t), bench_cmp);
+		mbps[i] = (uint64_t) BENCH_LARGE_SIZE * 1000 / samples[BENCH_LARGE_READS / 2];
+	}
+	printf("read_pass = %lu MB/s p50, %lu MB/s reading the backing file\n", mbps[0], mbps[1]);
+	free(buf);
+	return 0;
+}
+
+int bench_exec(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_args serve_args = FUSE_ARGS_INIT(0, NULL);
 	struct stat stbuf;
-	int ret;
+	struct timespec delay = { 0, 10 * 1000 * 1000 };
+	int64_t *samples[PHASE_COUNT] = { NULL };
+	/* every name is in at least one stratum */
+	unsigned int names;
+	unsigned int iterations;
+	unsigned int i;
+	int p;
+	int status;
+	pid_t pid = -1;
+	int ret = 1;
+
+	if (fuse_opt_parse(&args, &options, brp_opts, NULL) != 0 ||
+			fuse_opt_parse(&args, &bench_options, bench_opts, NULL) != 0 ||
+			args.argc != 1 || bench_options.strata == 0 || bench_options.files < 2 ||
+			!bench_options.noop) {
+		fprintf(stderr, "Usage: brp --bench-exec -o noop=<executable>[,<options>]\n");
+		goto out;
+	}
+	/* the wrappers' targets are found through brp's xattrs */
+	options.xattr = 1;
+	names = (bench_options.strata + 1) * (bench_options.files / 2);
+	if ( (iterations = bench_options.iterations / 100) == 0) {
+		iterations = 1;
+	}
+	if (iterations * 2 > names) {
+		fprintf(stderr, "brp: %u iterations need %u files, but %u strata of %u files provide %u\n",
+				iterations, iterations * 2, bench_options.strata, bench_options.files, names);
+		goto out;
+	}
 
-	if (strcmp(in_path, "/reparse_config") == 0) {
-		config_str = config_contents();
-		if (!config_str) {
-			return -ENOMEM;
+	for (p = 0; p < PHASE_COUNT; p++) {
+		if (! (samples[p] = malloc(iterations * sizeof(int64_t))) ) {
+			fprintf(stderr, "brp: out of memory\n");
+			goto out;
 		}
-		ret = MIN(strlen(config_str + offset), size);
-		memcpy(buf, config_str + offset, ret);
-		free(config_str);
-		return ret;
 	}
 
-	ret = corresponding((char*) in_path, out_path, PATH_MAX, &stbuf, &out_item, &in_item, &tail);
-	if (ret < 0) {
-		return ret;
+	if (bench_exec_root() < 0) {
+		fprintf(stderr, "brp: unable to set up namespaces: %s\n", strerror(errno));
+		goto out;
 	}
 
-	return read_filter(out_path, out_item->filter, in_item, tail, buf, size, offset);
-}
+	fflush(stdout);
+	if ( (pid = fork()) < 0) {
+		fprintf(stderr, "brp: unable to fork: %s\n", strerror(errno));
+		goto out;
+	}
+	if (pid == 0) {
+		fuse_opt_add_arg(&serve_args, "brp");
+		fuse_opt_add_arg(&serve_args, "/bedrock/brpath");
+		fuse_opt_add_arg(&serve_args, "-oallow_other");
+		_exit(serve(&serve_args));
+	}
 
-/*
- * This is typically used to write to a file, just as you'd expect from the
- * name.  However, for this filesystem, we only use it as an indication to
- * reload the configuration and stratum information.
- */
-static int brp_write(const char *in_path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
-{
-	SET_CALLER_UID();
+	/* wait for it to be mounted */
+	for (i = 0; i < 500; i++) {
+		if (stat("/bedrock/brpath/bin", &stbuf) == 0) {
+			break;
+		}
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			fprintf(stderr, "brp: unable to mount /bedrock/brpath\n");
+			/* already reaped */
+			pid = -1;
+			goto out;
+		}
+		nanosleep(&delay, NULL);
+	}
+	if (i == 500) {
+		fprintf(stderr, "brp: timed out waiting for /bedrock/brpath to be mounted\n");
+		goto out;
+	}
+	ret = 0;
+
+	printf("# %u strata, %u files each, %u iterations\n",
+			bench_options.strata, bench_options.files, iterations);
+	printf("# %s and %s are estimates: differences between separately timed runs\n",
+			phase_names[PHASE_INTERPRETER], phase_names[PHASE_BRC]);
+
+	for (i = 0; i < iterations; i++) {
+		int64_t phases[PHASE_COUNT];
+		if (bench_exec_run(i, names - 1 - i, phases) < 0) {
+			fprintf(stderr, "brp: running bin%u failed\n", i);
+			ret = 1;
+			break;
+		}
+		for (p = 0; p < PHASE_COUNT; p++) {
+			samples[p][i] = phases[p];
+		}
+	}
 
-	if (write_attempt(in_path) == 0) {
-		return strlen(buf);
-	} else {
-		return -EACCES;
+	if (ret == 0) {
+		for (p = 0; p < PHASE_COUNT; p++) {
+			qsort(samples[p], iterations, sizeof(int64_t), bench_cmp);
+			printf("%s = %ld ns p50, %ld ns p99\n", phase_names[p],
+					(long) samples[p][(iterations - 1) / 2],
+					(long) samples[p][(iterations - 1) * 99 / 100]);
+		}
 	}
-}
 
-/*
- * This is typically used to indicate a file should be shortened.  Like
- * write(), it is only being used here as an indication to reload the
- * configuration and stratum information.
- */
-static int brp_truncate(const char *in_path, off_t length)
-{
-	SET_CALLER_UID();
+	if (ret == 0 && bench_read_pass() < 0) {
+		ret = 1;
+	}
 
-	if (write_attempt(in_path) == 0) {
-		return 0;
-	} else {
-		return -EACCES;
+out:
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+	}
+	for (p = 0; p < PHASE_COUNT; p++) {
+		free(samples[p]);
 	}
+	fuse_opt_free_args(&args);
+	return ret;
 }
 
-static struct fuse_operations brp_oper = {
-	.getattr  = brp_getattr,
-	.readdir  = brp_readdir,
-	.open     = brp_open,
-	.read     = brp_read,
-	.write    = brp_write,
-	.truncate = brp_truncate,
-};
+#endif
 
 /*
  * ============================================================================
@@ -1255,11 +9667,119 @@ static struct fuse_operations brp_oper = {
  * ============================================================================
  */
 
+/*
+ * Mounts brp as described by args, as built by main(), and serves requests
+ * until it is unmounted.
+ */
+int serve(struct fuse_args *args)
+{
+	struct fuse_cmdline_opts cmdline_opts;
+	if (fuse_parse_cmdline(args, &cmdline_opts) != 0) {
+		fprintf(stderr, "ERROR: Could not parse options.\n");
+		return 1;
+	}
+
+	/* initial config parse */
+	cache_init();
+	dir_scan_init();
+	node_table_init();
+	struct config *conf = parse_config();
+	if (!conf) {
+		exit(1);
+	}
+	config_publish(conf);
+
+	pthread_t reload;
+	pthread_attr_t reload_attr;
+	pthread_attr_init(&reload_attr);
+	pthread_attr_setdetachstate(&reload_attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&reload, &reload_attr, reload_thread, NULL) != 0) {
+		fprintf(stderr, "ERROR: Could not create config reload thread.\n");
+		return 1;
+	}
+	pthread_attr_destroy(&reload_attr);
+
+	struct fuse_session *se = fuse_session_new(args, &brp_oper, sizeof(brp_oper), NULL);
+	if (!se) {
+		return 1;
+	}
+	session = se;
+	if (fuse_set_signal_handlers(se) != 0) {
+		fuse_session_destroy(se);
+		return 1;
+	}
+	if (fuse_session_mount(se, cmdline_opts.mountpoint) != 0) {
+		fuse_remove_signal_handlers(se);
+		fuse_session_destroy(se);
+		return 1;
+	}
+	watch_init();
+	index_init();
+	trace_init();
+
+	/*
+	 * Each thread sets its own filesystem credentials per request; see
+	 * set_caller_fscreds().  A slow stratum only ties up the threads
+	 * serving requests for it.
+	 */
+	int ret;
+	if (cmdline_opts.singlethread || options.threads <= 1) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config *loop_config = fuse_loop_cfg_create();
+		fuse_loop_cfg_set_max_threads(loop_config, options.threads);
+		fuse_loop_cfg_set_idle_threads(loop_config, options.threads);
+		ret = fuse_session_loop_mt(se, loop_config);
+		fuse_loop_cfg_destroy(loop_config);
+	}
+
+	index_shutdown();
+	fuse_session_unmount(se);
+	fuse_remove_signal_handlers(se);
+	fuse_session_destroy(se);
+	free(cmdline_opts.mountpoint);
+	fuse_opt_free_args(args);
+	return ret ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	(void)argc;
 	(void)argv;
 
+	/*
+	 * Default stat() values for certain output files.  Some of these may be
+	 * called quite a lot in quick succession; better to calculate them here
+	 * and memcpy() them over than calculate on-the-fly.
+	 */
+
+	memset(&parent_stat, 0, sizeof(struct stat));
+	parent_stat.st_ctime = parent_stat.st_mtime = parent_stat.st_atime = time(NULL);
+	parent_stat.st_mode = S_IFDIR | 0555;
+
+	memcpy(&reparse_stat, &parent_stat, sizeof(struct stat));
+	reparse_stat.st_mode = S_IFREG | 0600;
+	reparse_stat.st_ino = ino_mix(hash_str("/reparse_config"));
+
+	memcpy(&stats_stat, &parent_stat, sizeof(struct stat));
+	stats_stat.st_mode = S_IFREG | 0444;
+	stats_stat.st_ino = ino_mix(hash_str("/.brp_stats"));
+
+#ifdef BRP_BENCH
+	if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+		return bench(argc - 1, argv + 1);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--bench-exec") == 0) {
+		return bench_exec(argc - 1, argv + 1);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--check") == 0) {
+		return check(argc - 1, argv + 1);
+	}
+#endif
+	if (argc >= 2 && strcmp(argv[1], "--dump-config") == 0) {
+		return dump_config(argc - 1, argv + 1);
+	}
+
 	/*
 	 * Ensure we are running as root so that any requests by root to this
 	 * filesystem can be provided.
@@ -1269,6 +9789,10 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (argc >= 2 && strcmp(argv[1], "--replay") == 0) {
+		return replay(argc - 1, argv + 1);
+	}
+
 	 /*
 	  * The mount point should be provided.
 	  */
@@ -1286,40 +9810,32 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	/*
-	 * Default stat() values for certain output files.  Some of these may be
-	 * called quite a lot in quick succession; better to calculate them here
-	 * and memcpy() them over than calculate on-the-fly.
-	 */
-
-	memset(&parent_stat, 0, sizeof(struct stat));
-	parent_stat.st_ctime = parent_stat.st_mtime = parent_stat.st_atime = time(NULL);
-	parent_stat.st_mode = S_IFDIR | 0555;
-
-	memcpy(&reparse_stat, &parent_stat, sizeof(struct stat));
-	reparse_stat.st_mode = S_IFREG | 0600;
-
 	/*
 	 * Generate arguments for fuse:
 	 * - start with no arguments
 	 * - add argv[0] (which I think is just ignored)
 	 * - add mount point
-	 * - disable multithreading, as with the UID/GID switching it will result
-	 *   in abusable race conditions.
-	 * - add argument to:
-	 *   - let all users access filesystem
-	 *   - allow mounting over non-empty directories
+	 * - add argument to let all users access filesystem
+	 *
+	 * brp always stays in the foreground, useful for debugging.
 	 */
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
 	fuse_opt_add_arg(&args, argv[0]);
 	fuse_opt_add_arg(&args, argv[1]);
-	fuse_opt_add_arg(&args, "-s");
-	fuse_opt_add_arg(&args, "-oallow_other,nonempty");
-	/* stay in foreground, useful for debugging */
-	fuse_opt_add_arg(&args, "-f");
-
-	/* initial config parse */
-	parse_config();
+	/*
+	 * Pull brp-specific options out of any remaining arguments, passing
+	 * the rest through to FUSE.
+	 */
+	struct fuse_args user_args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+	if (fuse_opt_parse(&user_args, &options, brp_opts, NULL) != 0) {
+		fprintf(stderr, "ERROR: Could not parse options.\n");
+		return 1;
+	}
+	int i;
+	for (i = 1; i < user_args.argc; i++) {
+		fuse_opt_add_arg(&args, user_args.argv[i]);
+	}
+	fuse_opt_add_arg(&args, "-oallow_other");
 
-	return fuse_main(args.argc, args.argv, &brp_oper, NULL);
+	return serve(&args);
 }
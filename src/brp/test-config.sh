@@ -0,0 +1,263 @@
+#!/bin/sh
+#
+# test-config.sh
+#
+#      This program is free software; you can redistribute it and/or
+#      modify it under the terms of the GNU General Public License
+#      version 2 as published by the Free Software Foundation.
+#
+# Checks that brp's config parser reads brp.conf exactly as the awk program it
+# replaced did, by running both over a set of configs and comparing their
+# output, then times each the way brp used to start (spawning awk) against
+# how it starts now (parsing in-process).
+#
+# usage: test-config.sh <brp> [<awk>]
+#
+# <awk> defaults to busybox's, as brp used.  The awk program below is the one
+# brp ran, except that:
+#
+# - \s and \+ are spelled [ \t] and + so that any POSIX awk runs it, not
+#   only busybox's.
+# - `bri -l` is replaced by listing the test tree's enabled strata the same
+#   way.
+# - The enabled strata missing from [stratum-order] are sorted by name, as
+#   brp now does, rather than left in `for (s in a)` order, which awk leaves
+#   undefined.
+#
+# Its output then goes through old_read(), which does what brp did with it.
+
+brp="$1"
+awk="${2:-/bedrock/libexec/busybox awk}"
+runs=100
+here="$(dirname "$0")"
+
+if [ -z "$brp" ]
+then
+    echo "usage: $0 <brp> [<awk>]" >&2
+    exit 1
+fi
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+awk_parse() {
+    $awk -v enabled="$1/run/enabled_strata" '
+BEGIN {
+	FS="[=, ]+"
+
+	# get enabled strata
+	cmd="cd " enabled " && for s in *; do [ -f \"$s\" ] && ! [ -h \"$s\" ] && echo \"$s\"; done"
+	while (cmd | getline) {
+		existing_strata[$0] = $0
+	}
+	close(cmd)
+}
+
+/^[ \t]*#/ || /^[ \t]*;/ || /^[ \t]*$/ {
+	# empty line or comment, skip
+	next
+}
+
+length($0) > max_line_len {
+	max_line_len = length($0)
+}
+
+/^[ \t]*\[[^]]*\][ \t]*$/ {
+	# section header
+	section = substr($1, 2, length($1)-2)
+	next
+}
+
+section == "stratum-order" {
+	if ($0 in existing_strata && !($0 in strata)) {
+		strata_ordered[stratum_count++] = $0
+		strata[$0] = $0
+	}
+	next
+}
+
+section == "pass" || section == "brc-wrap" || section == "exec-filter" {
+	item_count+=0; # ensure is a integer, not a string
+	if (substr($1, length($1)) != "/") {
+		items[item_count".path"] = $1
+		items[item_count".type"] = "normal"
+	} else {
+		items[item_count".path"] = substr($1, 1, length($1)-1)
+		items[item_count".type"] = "directory"
+	}
+
+	items[item_count".filter"] = section
+
+	items[item_count".in_count"] = NF - 1
+
+	for (i=2; i <= NF; i++) {
+		if ( index($i, ":") == 0) {
+			items[item_count".in."(i-2)".stratum"] = ""
+			items[item_count".in."(i-2)".path"] = $i
+		} else {
+			items[item_count".in."(i-2)".stratum"] = substr($i, 0, index($i, ":")-1)
+			items[item_count".in."(i-2)".path"] = substr($i, index($i, ":")+1)
+		}
+	}
+
+	item_count++;
+}
+
+END {
+	first_unordered = stratum_count
+	for (stratum in existing_strata) {
+		if (!(stratum in strata)) {
+			for (i = stratum_count++; i > first_unordered && strata_ordered[i-1] > stratum; i--) {
+				strata_ordered[i] = strata_ordered[i-1]
+			}
+			strata_ordered[i] = stratum
+		}
+	}
+
+	print max_line_len
+	print item_count
+
+	for (item_i = 0; item_i < item_count; item_i++) {
+		print items[item_i".path"]
+		print items[item_i".type"]
+		print items[item_i".filter"]
+		in_count = 0
+		for (in_i = 0; in_i < items[item_i".in_count"]; in_i++) {
+			if (items[item_i".in."in_i".stratum"] != "") {
+				in_count++
+			} else {
+				in_count+=stratum_count
+			}
+		}
+		print in_count
+		for (in_i = 0; in_i < items[item_i".in_count"]; in_i++) {
+			if (items[item_i".in."in_i".stratum"] != "") {
+				print items[item_i".in."in_i".stratum"]
+				print items[item_i".in."in_i".path"]
+			}
+		}
+		for (stratum_i = 0; stratum_i < stratum_count; stratum_i++) {
+			for (in_i = 0; in_i < items[item_i".in_count"]; in_i++) {
+				if (items[item_i".in."in_i".stratum"] == "") {
+					print strata_ordered[stratum_i]
+					print items[item_i".in."in_i".path"]
+				}
+			}
+		}
+	}
+}
+' "$1/etc/brp.conf"
+}
+
+# Drops the longest line's length, which only sized brp's buffers, and strips
+# trailing slashes from in_items' paths, as brp did when reading them in.
+old_read() {
+    $awk '
+NR == 1 {
+	next
+}
+left > 0 {
+	if (left % 2 == 1) {
+		sub(/\/$/, "")
+	}
+	left--
+	print
+	next
+}
+NR > 2 && ++field == 4 {
+	left = 2 * $0
+	field = 0
+}
+{
+	print
+}
+'
+}
+
+# tree <name> <enabled strata, aliases as alias=target>: creates a test tree
+# whose brp.conf is read from stdin
+tree() {
+    dir="$tmp/$1"
+    shift
+    mkdir -p "$dir/etc" "$dir/run/enabled_strata" "$dir/strata"
+    cat > "$dir/etc/brp.conf"
+    for stratum in "$@"
+    do
+        case "$stratum" in
+            *=*) ln -s "${stratum#*=}" "$dir/run/enabled_strata/${stratum%%=*}" ;;
+            *) touch "$dir/run/enabled_strata/$stratum" ;;
+        esac
+    done
+}
+
+# the shipped config, with and without [stratum-order] entries
+tree shipped init=arch arch void sid < "$here/../slash-bedrock/etc/brp.conf"
+(cat "$here/../slash-bedrock/etc/brp.conf"; printf 'sid\nnothere\narch\nsid\n') |
+    tree ordered init=arch arch void sid gentoo
+
+tree syntax arch sid void <<'EOF'
+	# indented comment
+  ; another
+[pass]
+/a=/x,/y
+/b/  =   arch:/x ,, sid:/y,/z
+/c = :/empty-prefix, nothere:/p
+  /d/ = /indented
+[ brc-wrap ]
+/not-a-section = /x
+[brc-wrap]
+/e/=/f
+[exec-filter]
+/g/ = void:/g, /h
+[unknown]
+/i = /j
+[stratum-order]
+void
+ arch
+EOF
+
+tree none <<'EOF'
+[brc-wrap]
+/bin/ = /usr/bin, arch:/bin
+[stratum-order]
+arch
+EOF
+
+failed=0
+for dir in "$tmp"/*/
+do
+    dir="${dir%/}"
+    name="${dir##*/}"
+    if ! awk_parse "$dir" | old_read > "$tmp/$name.awk" ||
+            ! "$brp" --dump-config "$dir" > "$tmp/$name.brp"
+    then
+        echo "FAIL $name: unable to parse"
+        failed=1
+    elif ! cmp -s "$tmp/$name.awk" "$tmp/$name.brp"
+    then
+        echo "FAIL $name: brp differs from awk"
+        diff "$tmp/$name.awk" "$tmp/$name.brp"
+        failed=1
+    else
+        echo "ok   $name: $(head -n 1 "$tmp/$name.brp") items"
+    fi
+done
+
+# milliseconds per run of the given command over $runs runs
+per_run() {
+    start="$(date +%s%N)"
+    i=0
+    while [ "$i" -lt "$runs" ]
+    do
+        "$@" > /dev/null
+        i=$((i + 1))
+    done
+    end="$(date +%s%N)"
+    $awk "BEGIN { printf \"%.2f\", $((end - start)) / $runs / 1000000 }"
+}
+
+echo "startup, ms per parse of the shipped config including process start:"
+echo "     awk: $(per_run awk_parse "$tmp/ordered")"
+echo "     brp: $(per_run "$brp" --dump-config "$tmp/ordered")"
+
+exit "$failed"
@@ -14,6 +14,28 @@
 #include <stdlib.h>         /* exit()             */
 #include <sys/stat.h>       /* stat()             */
 #include <errno.h>          /* errno              */
+#include <sys/syscall.h>    /* SYS_*              */
+#include <unistd.h>         /* syscall()          */
+#include <fcntl.h>          /* open()             */
+#include <sched.h>          /* sched_yield()      */
+#include <string.h>         /* memcmp(), memchr() */
+#include <sys/mman.h>       /* mmap()             */
+
+#include "libbedrock.h"
+
+/*
+ * On some 32-bit architectures the original syscalls only handle 16-bit
+ * IDs.
+ */
+#ifdef SYS_setfsuid32
+#define SYS_SETFSUID SYS_setfsuid32
+#define SYS_SETFSGID SYS_setfsgid32
+#define SYS_SETGROUPS SYS_setgroups32
+#else
+#define SYS_SETFSUID SYS_setfsuid
+#define SYS_SETFSGID SYS_setfsgid
+#define SYS_SETGROUPS SYS_setgroups
+#endif
 
 /*
  * Check if config file is only writable by root.
@@ -74,3 +96,275 @@ int check_config_secure(char *config_path)
 	/* config looks good */
 	return 1;
 }
+
+/*
+ * Set the filesystem uid, gid and supplementary groups of the calling thread
+ * only.
+ *
+ * libc's setgroups() and friends apply the change to every thread in the
+ * process, which makes them unusable for multithreaded FUSE filesystems
+ * serving different users concurrently.  The raw syscalls only affect the
+ * calling thread.  This expects the process to retain an effective uid of 0
+ * so that it may change these back and forth.
+ *
+ * Returns 0 on success, -1 on failure with errno set.  On failure the thread
+ * may be left with some credentials changed and should not be used to
+ * access the filesystem.
+ */
+int set_thread_fscreds(uid_t uid, gid_t gid, size_t group_count, const gid_t *groups)
+{
+	if (syscall(SYS_SETGROUPS, group_count, groups) != 0) {
+		return -1;
+	}
+
+	/*
+	 * setfsuid/setfsgid do not report errors; they return the previous
+	 * value.  Confirm the change by setting an invalid value, which only
+	 * returns the current one.
+	 */
+	syscall(SYS_SETFSGID, gid);
+	if ((gid_t)syscall(SYS_SETFSGID, (gid_t)-1) != gid) {
+		errno = EPERM;
+		return -1;
+	}
+
+	syscall(SYS_SETFSUID, uid);
+	if ((uid_t)syscall(SYS_SETFSUID, (uid_t)-1) != uid) {
+		errno = EPERM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * brp's index of what provides the files in its [brc-wrap] items; see
+ * libbedrock.h for the layout.
+ *
+ * brp updates the index in place where it can, seqlock-style: it makes
+ * header->seq odd, changes the contents, then makes it even again.  Readers
+ * copy out what they need and retry if seq was odd or changed meanwhile, so
+ * they never block brp nor each other.  What they read in the meantime may
+ * be inconsistent, so every offset is checked before it is used.  When brp
+ * needs a bigger file it writes a new one, renames it over the old one and
+ * marks the old one retired, upon which readers map the new one.
+ */
+
+/*
+ * How many times brp_index_lookup() tries before giving up with EAGAIN.  brp
+ * only holds seq odd for a memcpy(), so this is plenty unless it stopped
+ * part way through.
+ */
+#define BRP_INDEX_ATTEMPTS 1000
+
+struct brp_index {
+	char *path;
+	const char *map;
+	size_t size;
+};
+
+/* FNV-1a */
+uint64_t brp_index_hash(const char *str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * (Re)maps index->path.  Returns 0, or -1 with errno set, in which case any
+ * previous mapping is kept.
+ */
+static int brp_index_map(struct brp_index *index)
+{
+	struct stat stbuf;
+	const struct brp_index_header *header;
+	void *map;
+	int fd;
+
+	if ((fd = open(index->path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &stbuf) < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)stbuf.st_size < sizeof(struct brp_index_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	header = map;
+	if (memcmp(header->magic, BRP_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != BRP_INDEX_VERSION) {
+		munmap(map, stbuf.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (index->map) {
+		munmap((void *)index->map, index->size);
+	}
+	index->map = map;
+	index->size = stbuf.st_size;
+	return 0;
+}
+
+struct brp_index *brp_index_open(const char *path)
+{
+	struct brp_index *index = calloc(1, sizeof(struct brp_index));
+	if (!index) {
+		return NULL;
+	}
+	if (!(index->path = strdup(path)) || brp_index_map(index) < 0) {
+		int err = errno;
+		free(index->path);
+		free(index);
+		errno = err;
+		return NULL;
+	}
+	return index;
+}
+
+void brp_index_close(struct brp_index *index)
+{
+	if (index) {
+		munmap((void *)index->map, index->size);
+		free(index->path);
+		free(index);
+	}
+}
+
+/*
+ * The NUL-terminated string at offset, or NULL if there is none there.
+ */
+static const char *brp_index_string(const struct brp_index *index, uint64_t offset)
+{
+	if (offset >= index->size || !memchr(index->map + offset, '\0', index->size - offset)) {
+		return NULL;
+	}
+	return index->map + offset;
+}
+
+/*
+ * Copies the string at offset into buf.  Returns 0 or -errno.
+ */
+static int brp_index_copy(const struct brp_index *index, uint64_t offset, char *buf, size_t size)
+{
+	const char *str = brp_index_string(index, offset);
+	size_t len;
+
+	if (!str) {
+		return -EINVAL;
+	}
+	if ((len = strlen(str)) >= size) {
+		return -ERANGE;
+	}
+	memcpy(buf, str, len + 1);
+	return 0;
+}
+
+/*
+ * One attempt at brp_index_lookup(), which may see the index mid-update.
+ * Returns 0 or -errno.
+ */
+static int brp_index_find(const struct brp_index *index, const char *path, uint64_t hash,
+		char *stratum, size_t stratum_size,
+		char *stratum_path, size_t stratum_path_size,
+		int *filter)
+{
+	const struct brp_index_header *header = (const void *)index->map;
+	struct brp_index_entry entry;
+	uint64_t buckets = header->buckets;
+	uint64_t bucket_count = header->bucket_count;
+	uint64_t offset;
+	size_t steps;
+	const char *entry_path;
+	int ret;
+
+	if (bucket_count == 0) {
+		return -ENOENT;
+	}
+	if (buckets > index->size || bucket_count > (index->size - buckets) / sizeof(uint64_t)) {
+		return -EINVAL;
+	}
+	memcpy(&offset, index->map + buckets + (hash % bucket_count) * sizeof(uint64_t), sizeof(offset));
+
+	for (steps = 0; offset != 0; steps++) {
+		if (offset > index->size - sizeof(entry) || steps > index->size / sizeof(entry)) {
+			return -EINVAL;
+		}
+		memcpy(&entry, index->map + offset, sizeof(entry));
+		if (entry.hash == hash) {
+			if (!(entry_path = brp_index_string(index, entry.path))) {
+				return -EINVAL;
+			}
+			if (strcmp(entry_path, path) == 0) {
+				if ((ret = brp_index_copy(index, entry.stratum, stratum, stratum_size)) < 0 ||
+						(ret = brp_index_copy(index, entry.stratum_path, stratum_path, stratum_path_size)) < 0) {
+					return ret;
+				}
+				*filter = entry.filter;
+				return 0;
+			}
+		}
+		offset = entry.next;
+	}
+	return -ENOENT;
+}
+
+int brp_index_lookup(struct brp_index *index, const char *path,
+		char *stratum, size_t stratum_size,
+		char *stratum_path, size_t stratum_path_size,
+		int *filter)
+{
+	uint64_t hash = brp_index_hash(path);
+	const struct brp_index_header *header;
+	uint64_t seq;
+	int attempts;
+	int ret = -EAGAIN;
+
+	/*
+	 * Bounded, as a brp which stopped mid-update leaves seq odd until the
+	 * next brp replaces the file.
+	 */
+	for (attempts = 0; attempts < BRP_INDEX_ATTEMPTS; attempts++) {
+		header = (const void *)index->map;
+		if (__atomic_load_n(&header->retired, __ATOMIC_ACQUIRE)) {
+			if (brp_index_map(index) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			ret = -EAGAIN;
+			sched_yield();
+			continue;
+		}
+
+		ret = brp_index_find(index, path, hash, stratum, stratum_size,
+				stratum_path, stratum_path_size, filter);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq) {
+			break;
+		}
+		ret = -EAGAIN;
+	}
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
@@ -10,6 +10,9 @@
  * This is a shared header file for various Bedrock Linux C programs.
  */
 
+#include <stdint.h>
+#include <sys/types.h>
+
 /*
  * This macro sets the filesystem uid and gid to that of the calling user for
  * FUSE filesystems.  This allows the kernel to take care of UID/GID-related
@@ -27,3 +30,85 @@
 
 /* ensure config file is only writable by root */
 int check_config_secure(char *config_path);
+
+/*
+ * Thread-safe alternative to SET_CALLER_UID() which also handles supplemental
+ * groups.  See libbedrock.c.
+ */
+int set_thread_fscreds(uid_t uid, gid_t gid, size_t group_count, const gid_t *groups);
+
+/*
+ * brp publishes which stratum provides each file in its [brc-wrap] items,
+ * e.g. /bin/vim, in the file BRP_INDEX, so that this can be found without
+ * going through brp.  It is meant to be mmap()ed and read with
+ * brp_index_lookup() below, which handles brp updating it concurrently.
+ *
+ * The layout is a brp_index_header followed by a hash table of
+ * brp_index_entry.  All offsets are from the start of the file and all
+ * numbers are native-endian.
+ */
+#define BRP_INDEX "/bedrock/run/brp.index"
+#define BRP_INDEX_MAGIC "brpindex"
+#define BRP_INDEX_VERSION 1
+
+enum brp_index_filter {
+	BRP_INDEX_FILTER_PASS,
+	BRP_INDEX_FILTER_BRC_WRAP,
+	BRP_INDEX_FILTER_EXEC,
+};
+
+struct brp_index_header {
+	char magic[8];
+	uint32_t version;
+	/*
+	 * Set once brp has replaced the file with a new one, e.g. because
+	 * the index outgrew it.  Readers should open BRP_INDEX again.
+	 */
+	uint32_t retired;
+	/*
+	 * Odd while brp is updating the file in place.  Readers should
+	 * retry if it was odd or changed while they were reading.
+	 */
+	uint64_t seq;
+	/* incremented whenever the contents change */
+	uint64_t generation;
+	/* offset of bucket_count uint64_t entry offsets, 0 for empty buckets */
+	uint64_t buckets;
+	uint64_t bucket_count;
+	uint64_t entry_count;
+};
+
+struct brp_index_entry {
+	/* next entry in the same bucket, or 0 */
+	uint64_t next;
+	/* brp_index_hash() of path */
+	uint64_t hash;
+	/* NUL-terminated strings */
+	uint64_t path;          /* within brp's mount point, e.g. "/bin/vim" */
+	uint64_t stratum;       /* as given to brc, e.g. "arch" or "init" */
+	uint64_t stratum_path;  /* within the stratum, e.g. "/usr/bin/vim" */
+	uint64_t filter;        /* enum brp_index_filter */
+};
+
+struct brp_index;
+
+uint64_t brp_index_hash(const char *str);
+
+/*
+ * Maps the index at path, usually BRP_INDEX.  Returns NULL with errno set on
+ * failure.
+ */
+struct brp_index *brp_index_open(const char *path);
+
+/*
+ * Looks up path, e.g. "/bin/vim", copying what provides it into the given
+ * buffers.  Returns 0, or -1 with errno set: ENOENT if path is not in the
+ * index, ERANGE if a buffer is too small, EAGAIN if brp kept the index
+ * mid-update throughout.  Lock-free; see libbedrock.c.
+ */
+int brp_index_lookup(struct brp_index *index, const char *path,
+		char *stratum, size_t stratum_size,
+		char *stratum_path, size_t stratum_path_size,
+		int *filter);
+
+void brp_index_close(struct brp_index *index);